@@ -0,0 +1,569 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define __EMU_LITTLE_ENDIAN
+
+#include "emu65816.h"
+
+
+
+// Benchmark Suite, runs a set of small guest workloads and reports how fast the emulator runs them
+// Every workload is an endless loop that starts at $8000, it's run through cpuRun (what cpuExecute uses) for a fixed
+// amount of cycles in slices, after an untimed warm up. The best of a few runs is printed as CSV, and can be saved
+// as a baseline and compared against later: a workload that got slower than the baseline by more than the tolerance
+// counts as a regression and makes the benchmark exit with 1.
+// With check=STEP the workloads aren't timed, instead they're run through the lockstep checker, which compares the
+// Batch engine against the interpreter every STEP cycles (1 = every instruction) and exits with 1 on a divergence.
+
+#define BENCH_MEM		(0x10000U)		// 64kB, the vectors are at the end
+#define BENCH_IO		(0xFE00U)		// Start of the 256 Byte IO space
+#define BENCH_SLICE		(100000)		// Cycles per cpuRun call
+#define IRQ_PERIOD		(200)			// Cycles between IRQs in the interrupt storm
+#define WARMUP			(1000000)		// Untimed cycles before every workload
+#define MAX_WORKLOADS	(32U)
+
+typedef struct{
+	const char *name;
+	const uint8_t *code;
+	uint32_t size;
+	uint16_t irq;			// Native IRQ handler (0 = no interrupts)
+} benchWorkload;
+
+typedef struct{
+	const char *name;
+	uint64_t cycles;
+	uint64_t instructions;
+	uint64_t ns;
+} benchResult;
+
+
+// Workloads ---------------------------------------------------------------- //
+// Assembled by hand, the source is next to the Bytes
+
+// Sieve of Eratosthenes over 8192 flags (8 bit A, 16 bit X/Y), the amount of primes (mod 256) ends up at $14
+const uint8_t wlSieve[] = {
+	0x18,						//   CLC
+	0xFB,						//   XCE
+	0xE2, 0x20,					//   SEP #$20
+	0xC2, 0x10,					//   REP #$10
+								// outer:
+	0xA2, 0x00, 0x00,			//   LDX #$0000
+	0xA9, 0x01,					//   LDA #$01
+								// fill:
+	0x9D, 0x00, 0x20,			//   STA $2000,X
+	0xE8,						//   INX
+	0xE0, 0x00, 0x20,			//   CPX #$2000
+	0xD0, 0xF7,					//   BNE fill
+	0x64, 0x10,					//   STZ $10
+	0xA2, 0x02, 0x00,			//   LDX #$0002
+								// next:
+	0xBD, 0x00, 0x20,			//   LDA $2000,X
+	0xF0, 0x1F,					//   BEQ skip
+	0xE6, 0x10,					//   INC $10
+	0xC2, 0x20,					//   REP #$20
+	0x8A,						//   TXA
+	0x85, 0x12,					//   STA $12
+	0x0A,						//   ASL A
+								// strike:
+	0xC9, 0x00, 0x20,			//   CMP #$2000
+	0xB0, 0x10,					//   BCS done
+	0xA8,						//   TAY
+	0xE2, 0x20,					//   SEP #$20
+	0xA9, 0x00,					//   LDA #$00
+	0x99, 0x00, 0x20,			//   STA $2000,Y
+	0xC2, 0x20,					//   REP #$20
+	0x98,						//   TYA
+	0x18,						//   CLC
+	0x65, 0x12,					//   ADC $12
+	0x80, 0xEB,					//   BRA strike
+								// done:
+	0xE2, 0x20,					//   SEP #$20
+								// skip:
+	0xE8,						//   INX
+	0xE0, 0x00, 0x20,			//   CPX #$2000
+	0xD0, 0xD6,					//   BNE next
+	0xA5, 0x10,					//   LDA $10
+	0x85, 0x14,					//   STA $14
+	0x80, 0xBD,					//   BRA outer
+};
+
+// CRC-16/CCITT of a 4kB buffer, bit by bit (16 bit), the CRC ends up at $14
+const uint8_t wlCrc[] = {
+	0x18,						//   CLC
+	0xFB,						//   XCE
+	0xC2, 0x30,					//   REP #$30
+	0xA2, 0x00, 0x00,			//   LDX #$0000
+								// init:
+	0x8A,						//   TXA
+	0x9D, 0x00, 0x20,			//   STA $2000,X
+	0xE8,						//   INX
+	0xE8,						//   INX
+	0xE0, 0x00, 0x10,			//   CPX #$1000
+	0xD0, 0xF5,					//   BNE init
+								// outer:
+	0xA9, 0xFF, 0xFF,			//   LDA #$FFFF
+	0x85, 0x10,					//   STA $10
+	0xA0, 0x00, 0x00,			//   LDY #$0000
+								// byte:
+	0xE2, 0x20,					//   SEP #$20
+	0xB9, 0x00, 0x20,			//   LDA $2000,Y
+	0xC2, 0x20,					//   REP #$20
+	0x29, 0xFF, 0x00,			//   AND #$00FF
+	0xEB,						//   XBA
+	0x45, 0x10,					//   EOR $10
+	0xA2, 0x08, 0x00,			//   LDX #$0008
+								// bit:
+	0x0A,						//   ASL A
+	0x90, 0x03,					//   BCC noxor
+	0x49, 0x21, 0x10,			//   EOR #$1021
+								// noxor:
+	0xCA,						//   DEX
+	0xD0, 0xF7,					//   BNE bit
+	0x85, 0x10,					//   STA $10
+	0xC8,						//   INY
+	0xC0, 0x00, 0x10,			//   CPY #$1000
+	0xD0, 0xDF,					//   BNE byte
+	0x85, 0x14,					//   STA $14
+	0x80, 0xD3,					//   BRA outer
+};
+
+// Copies 4kB with 16 bit loads and stores (MVN/MVP are left out, the emulator doesn't implement them)
+const uint8_t wlMemcpy[] = {
+	0x18,						//   CLC
+	0xFB,						//   XCE
+	0xC2, 0x30,					//   REP #$30
+								// outer:
+	0xA2, 0x00, 0x00,			//   LDX #$0000
+								// copy:
+	0xBD, 0x00, 0x20,			//   LDA $2000,X
+	0x9D, 0x00, 0x40,			//   STA $4000,X
+	0xE8,						//   INX
+	0xE8,						//   INX
+	0xE0, 0x00, 0x10,			//   CPX #$1000
+	0xD0, 0xF3,					//   BNE copy
+	0x80, 0xEE,					//   BRA outer
+};
+
+// Fills 4kB with 8 bit stores
+const uint8_t wlMemset[] = {
+	0x18,						//   CLC
+	0xFB,						//   XCE
+	0xE2, 0x20,					//   SEP #$20
+	0xC2, 0x10,					//   REP #$10
+								// outer:
+	0xA9, 0x55,					//   LDA #$55
+	0xA2, 0x00, 0x00,			//   LDX #$0000
+								// fill:
+	0x9D, 0x00, 0x40,			//   STA $4000,X
+	0xE8,						//   INX
+	0xE0, 0x00, 0x10,			//   CPX #$1000
+	0xD0, 0xF7,					//   BNE fill
+	0x80, 0xF0,					//   BRA outer
+};
+
+// 8 bit ALU and shifts in Emulation mode
+const uint8_t wlArith8[] = {
+	0xD8,						//   CLD
+								// outer:
+	0xA2, 0x00,					//   LDX #$00
+	0xA9, 0x00,					//   LDA #$00
+	0x18,						//   CLC
+								// calc:
+	0x69, 0x37,					//   ADC #$37
+	0x49, 0x5A,					//   EOR #$5A
+	0x0A,						//   ASL A
+	0x26, 0x10,					//   ROL $10
+	0xE5, 0x11,					//   SBC $11
+	0x85, 0x11,					//   STA $11
+	0x4A,						//   LSR A
+	0xE8,						//   INX
+	0xD0, 0xF1,					//   BNE calc
+	0x80, 0xEA,					//   BRA outer
+};
+
+// 16 bit ALU and shifts in Native mode
+const uint8_t wlArith16[] = {
+	0x18,						//   CLC
+	0xFB,						//   XCE
+	0xC2, 0x30,					//   REP #$30
+	0xD8,						//   CLD
+								// outer:
+	0xA2, 0x00, 0x00,			//   LDX #$0000
+	0xA9, 0x34, 0x12,			//   LDA #$1234
+								// calc:
+	0x18,						//   CLC
+	0x69, 0x79, 0x35,			//   ADC #$3579
+	0x49, 0xA5, 0xA5,			//   EOR #$A5A5
+	0x0A,						//   ASL A
+	0x26, 0x10,					//   ROL $10
+	0x38,						//   SEC
+	0xE5, 0x12,					//   SBC $12
+	0x85, 0x12,					//   STA $12
+	0x4A,						//   LSR A
+	0xE8,						//   INX
+	0xD0, 0xED,					//   BNE calc
+	0x80, 0xE5,					//   BRA outer
+};
+
+// Decimal mode ADC/SBC, 16 and 8 bit
+const uint8_t wlBcd[] = {
+	0x18,						//   CLC
+	0xFB,						//   XCE
+	0xC2, 0x30,					//   REP #$30
+	0xF8,						//   SED
+								// outer:
+	0xA9, 0x00, 0x00,			//   LDA #$0000
+	0xA2, 0x00, 0x00,			//   LDX #$0000
+								// calc:
+	0x18,						//   CLC
+	0x69, 0x23, 0x01,			//   ADC #$0123
+	0x38,						//   SEC
+	0xE9, 0x45, 0x00,			//   SBC #$0045
+	0x85, 0x10,					//   STA $10
+	0xE2, 0x20,					//   SEP #$20
+	0x18,						//   CLC
+	0x69, 0x19,					//   ADC #$19
+	0x38,						//   SEC
+	0xE9, 0x07,					//   SBC #$07
+	0xC2, 0x20,					//   REP #$20
+	0xE8,						//   INX
+	0xD0, 0xE9,					//   BNE calc
+	0x80, 0xE1,					//   BRA outer
+};
+
+// Recursive fib(20) with JSR/RTS, 21891 calls per round, the result ends up at $14
+const uint8_t wlRecurse[] = {
+	0x18,						//   CLC
+	0xFB,						//   XCE
+	0xC2, 0x30,					//   REP #$30
+	0xA2, 0xFF, 0x0F,			//   LDX #$0FFF
+	0x9A,						//   TXS
+								// outer:
+	0xA9, 0x14, 0x00,			//   LDA #$0014
+	0x20, 0x12, 0x80,			//   JSR fib
+	0x85, 0x14,					//   STA $14
+	0x80, 0xF6,					//   BRA outer
+								// fib:
+	0xC9, 0x02, 0x00,			//   CMP #$0002
+	0x90, 0x10,					//   BCC ret
+	0x3A,						//   DEC A
+	0x48,						//   PHA
+	0x20, 0x12, 0x80,			//   JSR fib
+	0x7A,						//   PLY
+	0x48,						//   PHA
+	0x98,						//   TYA
+	0x3A,						//   DEC A
+	0x20, 0x12, 0x80,			//   JSR fib
+	0x18,						//   CLC
+	0x63, 0x01,					//   ADC 1,S
+	0xFA,						//   PLX
+								// ret:
+	0x60,						//   RTS
+};
+
+// Busy loop that gets interrupted every IRQ_PERIOD cycles, the handler acknowledges the IRQ through IO
+const uint8_t wlIrq[] = {
+	0x18,						//   CLC
+	0xFB,						//   XCE
+	0xC2, 0x30,					//   REP #$30
+	0xA2, 0xFF, 0x0F,			//   LDX #$0FFF
+	0x9A,						//   TXS
+	0x58,						//   CLI
+								// loop:
+	0xE8,						//   INX
+	0xC8,						//   INY
+	0x80, 0xFC,					//   BRA loop
+								// irq:
+	0x48,						//   PHA
+	0xE2, 0x20,					//   SEP #$20
+	0x8D, 0x00, 0xFE,			//   STA $FE00
+	0xC2, 0x20,					//   REP #$20
+	0xE6, 0x10,					//   INC $10
+	0x68,						//   PLA
+	0x40,						//   RTI
+};
+
+
+// Polls a status register until it's ready, then reads a data register (like a UART driver)
+const uint8_t wlPoll[] = {
+	0x18,						//   CLC
+	0xFB,						//   XCE
+	0xE2, 0x20,					//   SEP #$20
+	0xC2, 0x10,					//   REP #$10
+								// outer:
+	0xA2, 0x00, 0x00,			//   LDX #$0000
+								// wait:
+	0xAD, 0x01, 0xFE,			//   LDA $FE01
+	0x29, 0x01,					//   AND #$01
+	0xF0, 0xF9,					//   BEQ wait
+	0xAD, 0x02, 0xFE,			//   LDA $FE02
+	0x9D, 0x00, 0x20,			//   STA $2000,X
+	0xE8,						//   INX
+	0xE0, 0x00, 0x10,			//   CPX #$1000
+	0xD0, 0xED,					//   BNE wait
+	0x80, 0xE8,					//   BRA outer
+};
+
+
+const benchWorkload workloads[] = {
+	{"sieve",		wlSieve,	sizeof(wlSieve),	0},
+	{"crc16",		wlCrc,		sizeof(wlCrc),		0},
+	{"memcpy",		wlMemcpy,	sizeof(wlMemcpy),	0},
+	{"memset",		wlMemset,	sizeof(wlMemset),	0},
+	{"arith8",		wlArith8,	sizeof(wlArith8),	0},
+	{"arith16",		wlArith16,	sizeof(wlArith16),	0},
+	{"bcd",			wlBcd,		sizeof(wlBcd),		0},
+	{"recursion",	wlRecurse,	sizeof(wlRecurse),	0},
+	{"irqstorm",	wlIrq,		sizeof(wlIrq),		0x800D},
+	{"iopoll",		wlPoll,		sizeof(wlPoll),		0}
+};
+
+#define WORKLOADS	(sizeof(workloads) / sizeof(workloads[0]))
+
+cpuState CPU;
+uint8_t memory[BENCH_MEM];
+uint32_t polls, pollData;
+
+uint64_t cycleCount = 100000000;
+uint32_t repeat = 3;
+double tolerance = 10.0;
+const char *only = NULL;
+const char *baselinePath = NULL;
+const char *savePath = NULL;
+int32_t checkStep = 0;
+
+bool parseOptions(int argc, char* argv[]);
+void loadWorkload(const benchWorkload* W);
+void runWorkload(const benchWorkload* W, benchResult* R);
+bool checkWorkload(const benchWorkload* W);
+void printResults(const benchResult* R, uint32_t count, FILE* fp);
+uint32_t checkBaseline(const benchResult* R, uint32_t count);
+
+uint8_t benchReadIO(uint32_t addr);
+void benchWriteIO(uint32_t addr, uint8_t val);
+
+
+
+
+int main(int argc, char* argv[]){
+	benchResult results[MAX_WORKLOADS];
+	uint32_t count = 0, diverged = 0;
+	FILE *fp;
+	
+	if (!parseOptions(argc, argv)) return -1;
+	
+	for (uint32_t i = 0; i < WORKLOADS; i++){
+		if (only && strcmp(only, workloads[i].name)) continue;
+		if (checkStep){
+			diverged += !checkWorkload(&workloads[i]);
+			count++;
+			continue;
+		}
+		runWorkload(&workloads[i], &results[count++]);
+	}
+	if (!count){
+		printf("Unknown workload \"%s\"!\n", only);
+		return -1;
+	}
+	if (checkStep) return diverged ? 1 : 0;
+	
+	printResults(results, count, stdout);
+	
+	if (savePath){
+		fp = fopen(savePath, "w");
+		if (!fp){
+			printf("Couldn't write \"%s\"!\n", savePath);
+			return -1;
+		}
+		printResults(results, count, fp);
+		fclose(fp);
+	}
+	
+	if (baselinePath && checkBaseline(results, count)) return 1;
+	return 0;
+}
+
+
+
+
+bool parseOptions(int argc, char* argv[]){
+	char *val;
+	
+	for (int i = 1; i < argc; i++){
+		val = strchr(argv[i], '=');
+		if (!val){
+			printf("Usage: %s [name=value ...]\n", argv[0]);
+			printf("Options: cycles=N repeat=N only=WORKLOAD save=FILE baseline=FILE tolerance=PERCENT check=STEP\n");
+			return false;
+		}
+		val++;
+		
+		if (!strncmp(argv[i], "cycles=", 7)){			// Timed cycles per workload
+			cycleCount = strtoull(val, NULL, 0);
+		}else if (!strncmp(argv[i], "repeat=", 7)){		// Runs per workload, the fastest one counts
+			repeat = strtoul(val, NULL, 0);
+			if (!repeat) repeat = 1;
+		}else if (!strncmp(argv[i], "only=", 5)){		// Run a single workload
+			only = val;
+		}else if (!strncmp(argv[i], "save=", 5)){		// Also write the results to a file (to use as a baseline)
+			savePath = val;
+		}else if (!strncmp(argv[i], "baseline=", 9)){	// Compare against the results in a file
+			baselinePath = val;
+		}else if (!strncmp(argv[i], "tolerance=", 10)){	// How much slower than the baseline is still ok (percent)
+			tolerance = strtod(val, NULL);
+		}else if (!strncmp(argv[i], "check=", 6)){		// Compare the Batch engine against the interpreter instead
+			checkStep = strtol(val, NULL, 0);
+		}else{
+			printf("Unknown Argument \"%s\"!\n", argv[i]);
+			return false;
+		}
+	}
+	
+	return true;
+}
+
+// Loads a workload into a fresh machine
+void loadWorkload(const benchWorkload* W){
+	memset(memory, 0, sizeof(memory));
+	memcpy(memory + 0x8000, W->code, W->size);
+	memory[0xFFFC] = 0x00;			// Reset
+	memory[0xFFFD] = 0x80;
+	memory[0xFFEE] = W->irq;		// Native IRQ
+	memory[0xFFEF] = W->irq >> 8;
+	polls = 0;
+	pollData = 0;
+	
+	cpuInit(&CPU, memory, BENCH_MEM, BENCH_IO, 256, benchReadIO, benchWriteIO);
+}
+
+// Loads a workload and runs it "repeat" times, the fastest run ends up in R
+void runWorkload(const benchWorkload* W, benchResult* R){
+	cpuRunCtl RUN;
+	uint64_t t0, cyc0, left, used, insts;
+	int32_t slice = W->irq ? IRQ_PERIOD : BENCH_SLICE;
+	
+	loadWorkload(W);
+	memset(R, 0, sizeof(benchResult));
+	R->name = W->name;
+	
+	for (uint32_t r = 0; r <= repeat; r++){
+		left = r ? cycleCount : WARMUP;		// The first round only warms up the caches and branch predictors
+		cyc0 = CPU.cycle_count;
+		insts = 0;
+		t0 = cpuNowNs();
+		
+		while (left && !CPU.stp){
+			RUN = (cpuRunCtl){.cycles = (left < (uint64_t)slice) ? (int32_t)left : slice};
+			cpuRun(&CPU, &RUN);
+			insts += RUN.executed;
+			used = RUN.cycles - RUN.cycle_rem;
+			left = (used >= left) ? 0 : left - used;
+			if (W->irq) cpuAssertIRQ(CPU, 0);
+		}
+		
+		t0 = cpuNowNs() - t0;
+		if (r && (!R->ns || (t0 < R->ns))){
+			R->ns = t0;
+			R->cycles = CPU.cycle_count - cyc0;
+			R->instructions = insts;
+		}
+	}
+}
+
+// Loads a workload and runs it for "cycles" cycles in the lockstep checker, returns false if the engines diverged
+bool checkWorkload(const benchWorkload* W){
+	cpuDiff *D = malloc(sizeof(cpuDiff));
+	int32_t slice = W->irq ? IRQ_PERIOD : BENCH_SLICE;
+	uint64_t left = cycleCount, done;
+	bool ok = true;
+	
+	loadWorkload(W);
+	if (!D || !cpuDiffInit(&CPU, D, NULL, checkStep)){
+		printf("%s: Couldn't start the checker!\n", W->name);
+		free(D);
+		return false;
+	}
+	
+	while (left && ok && !CPU.stp){
+		done = D->cycles;
+		ok = cpuDiffRun(D, (left < (uint64_t)slice) ? left : (uint64_t)slice);
+		done = D->cycles - done;
+		left = (done >= left) ? 0 : left - done;
+		if (W->irq) cpuAssertIRQ(CPU, 0);
+	}
+	
+	printf("%s: ", W->name);
+	cpuDiffReport(D, stdout);
+	
+	cpuDiffFree(D);
+	free(D);
+	return ok;
+}
+
+// Writes the results as CSV
+void printResults(const benchResult* R, uint32_t count, FILE* fp){
+	fprintf(fp, "workload,cycles,instructions,seconds,emu_mhz,ns_per_inst,inst_per_sec\n");
+	for (uint32_t i = 0; i < count; i++){
+		fprintf(fp, "%s,%llu,%llu,%.6f,%.3f,%.3f,%.0f\n", R[i].name, (unsigned long long)R[i].cycles,
+			(unsigned long long)R[i].instructions, R[i].ns / 1e9, R[i].cycles * 1000.0 / R[i].ns,
+			(double)R[i].ns / R[i].instructions, R[i].instructions * 1e9 / R[i].ns);
+	}
+}
+
+// Compares the host time per instruction against the baseline file, workloads that aren't in it are skipped
+// Returns the amount of regressions
+uint32_t checkBaseline(const benchResult* R, uint32_t count){
+	FILE *fp = fopen(baselinePath, "r");
+	char line[256], name[64];
+	double base, now;
+	uint32_t regressions = 0;
+	
+	if (!fp){
+		printf("Couldn't read the baseline \"%s\"!\n", baselinePath);
+		return 1;
+	}
+	
+	while (fgets(line, sizeof(line), fp)){
+		// workload,cycles,instructions,seconds,emu_mhz,ns_per_inst,...
+		if (sscanf(line, "%63[^,],%*[^,],%*[^,],%*[^,],%*[^,],%lf", name, &base) != 2) continue;
+		
+		for (uint32_t i = 0; i < count; i++){
+			if (strcmp(name, R[i].name)) continue;
+			
+			now = (double)R[i].ns / R[i].instructions;
+			if (now > (base * (1.0 + tolerance / 100.0))){
+				fprintf(stderr, "REGRESSION %s: %.3f ns/inst, baseline %.3f ns/inst (%+.1f%%)\n", name, now, base, (now / base - 1.0) * 100.0);
+				regressions++;
+			}
+		}
+	}
+	
+	fclose(fp);
+	return regressions;
+}
+
+
+
+
+uint8_t benchReadIO(uint32_t addr){
+	switch(addr & 0x000000FF){
+		case 1:		// Status Register, ready on every 4th read
+		return !(++polls & 3);
+		
+		case 2:		// Data Register
+		return pollData++;
+	}
+	return 0;
+}
+
+void benchWriteIO(uint32_t addr, uint8_t val){
+	switch(addr & 0x000000FF){
+		case 0:		// Acknowledges the IRQ
+			cpuDeassertIRQ(CPU, 0);
+		break;
+	}
+}
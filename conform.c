@@ -0,0 +1,663 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+
+#define __EMU_LITTLE_ENDIAN
+
+#include "emu65816.h"
+
+
+
+// Single Instruction Conformance Test Runner
+// Runs test vectors for single instructions, like the 65816 set of the SingleStepTests (ProcessorTests): every test
+// has an initial state with the RAM contents it needs, the final state and RAM after the instruction and the bus
+// cycles it makes. A file is a JSON array of tests, or the binary form of one that this runner writes with save=1
+// (FILE.json -> FILE.ctb), which loads a lot faster. The files are loaded by one thread per host core, then the
+// tests are split between the same threads in chunks. Every thread has a single cpuState with 16MB of Memory and a
+// Snapshot of it, so between tests only the Pages the last test wrote to are reset.
+// The emulator doesn't model the individual bus cycles, so only the amount of them is compared against the cycles
+// the instruction took. A mismatch there is counted on it's own, with strict=1 it also fails the test.
+
+#define CT_MEM			(0x1000000U)	// 16MB, the whole address space
+#define CT_CHUNK		(256U)			// Tests a thread takes at a time
+#define CT_MAGIC		(0x54433536U)	// "65CT"
+#define CT_VERSION		(1U)
+#define NAME_LEN		(24U)
+#define CT_ENTRIES		(STATS_MODES * 256)
+
+// What didn't match
+#define CT_FAIL_STATE	(0x01)		// Registers, flags or Memory
+#define CT_FAIL_CYCLES	(0x02)		// Amount of cycles
+
+typedef struct{
+	uint16_t pc, s, a, x, y, d;
+	uint8_t pbr, dbr, p, e;
+} ctRegs;
+
+typedef struct{
+	uint32_t addr;
+	uint8_t val;
+} ctByte;
+
+typedef struct{
+	char name[NAME_LEN];
+	ctRegs init;
+	ctRegs final;
+	uint32_t init_ram;			// First Byte of the initial and final RAM in the file's Byte pool
+	uint32_t final_ram;
+	uint16_t init_count;
+	uint16_t final_count;
+	uint16_t cycles;			// Length of the bus cycle log
+} ctTest;
+
+typedef struct{
+	const char *path;
+	ctTest *tests;
+	uint32_t count;
+	uint32_t size;
+	ctByte *bytes;				// Byte pool of all tests
+	uint32_t byte_count;
+	uint32_t byte_size;
+	bool ok;
+} ctFile;
+
+typedef struct{
+	pthread_t thread;
+	cpuState cpu;
+	cpuSnapshot snap;
+	uint32_t total[CT_ENTRIES];		// Indexed like the cycle table (mode * 256 + opcode)
+	uint32_t failed[CT_ENTRIES];
+	uint32_t cycles[CT_ENTRIES];	// Tests with the wrong amount of cycles
+	uint64_t first[CT_ENTRIES];		// First failing test (file << 32 | test), UINT64_MAX = none
+} ctWorker;
+
+// Parser state
+typedef struct{
+	const char *p;
+	const char *end;
+	bool err;
+} ctJson;
+
+const char *modeNames[STATS_MODES] = {"m16x16", "m16x8", "m8x16", "m8x8", "emu"};
+
+ctFile *files;
+uint32_t fileCount = 0;
+uint64_t *fileStart;			// Index of the first test of every file, and the total at the end
+uint32_t nextFile = 0;			// Next file to load (atomic)
+uint64_t nextTest = 0;			// Next test to run (atomic)
+uint32_t shown = 0;				// Failures printed so far (atomic)
+pthread_mutex_t printLock = PTHREAD_MUTEX_INITIALIZER;
+
+uint32_t threads = 0;			// 0 = one per host core
+bool strict = false;
+bool saveBinary = false;
+uint32_t showMax = 0;
+
+bool parseOptions(int argc, char* argv[]);
+void* loadThread(void* arg);
+void* runThread(void* arg);
+bool loadFile(ctFile* F);
+bool loadJSON(ctFile* F, const char* text, uint64_t len);
+bool loadBinary(ctFile* F, FILE* fp);
+bool saveFile(const ctFile* F);
+uint8_t runTest(ctWorker* W, const ctFile* F, const ctTest* T, uint32_t* entry, char* why, uint32_t size);
+
+uint8_t ctReadIO(uint32_t addr);
+void ctWriteIO(uint32_t addr, uint8_t val);
+
+
+
+
+int main(int argc, char* argv[]){
+	ctWorker *workers;
+	uint64_t t0, total = 0, failed = 0, cycles = 0, first;
+	uint32_t tests, fails, offs;
+	const ctFile *F;
+	
+	if (argc < 2){
+		printf("Usage: %s FILE... [name=value ...]\n", argv[0]);
+		printf("Options: threads=N strict=0|1 show=N save=0|1\n");
+		return -1;
+	}
+	
+	if (!parseOptions(argc, argv)) return -1;
+	if (!fileCount){
+		printf("No test files given!\n");
+		return -1;
+	}
+	
+	if (!threads) threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (!threads) threads = 1;
+	workers = calloc(threads, sizeof(ctWorker));
+	fileStart = calloc(fileCount + 1, sizeof(uint64_t));
+	if (!workers || !fileStart){
+		printf("Out of memory!\n");
+		return -1;
+	}
+	
+	// Load all files, one thread per file at a time
+	t0 = cpuNowNs();
+	for (uint32_t i = 0; i < threads; i++) pthread_create(&workers[i].thread, NULL, loadThread, NULL);
+	for (uint32_t i = 0; i < threads; i++) pthread_join(workers[i].thread, NULL);
+	
+	for (uint32_t i = 0; i < fileCount; i++){
+		if (!files[i].ok) return -1;
+		fileStart[i + 1] = fileStart[i] + files[i].count;
+	}
+	fprintf(stderr, "[CONFORM] %llu tests in %u files loaded in %.2f seconds\n", (unsigned long long)fileStart[fileCount],
+		fileCount, (cpuNowNs() - t0) / 1e9);
+	
+	// Every worker gets it's own CPU and Memory, with a Snapshot of the empty Memory to reset to
+	for (uint32_t i = 0; i < threads; i++){
+		cpuInit(&workers[i].cpu, calloc(CT_MEM, 1), CT_MEM, 0, 0, ctReadIO, ctWriteIO);
+		if (!workers[i].cpu.mem || !cpuSnapshotInit(&workers[i].cpu, &workers[i].snap)){
+			printf("Out of memory!\n");
+			return -1;
+		}
+	}
+	
+	t0 = cpuNowNs();
+	for (uint32_t i = 0; i < threads; i++) pthread_create(&workers[i].thread, NULL, runThread, &workers[i]);
+	for (uint32_t i = 0; i < threads; i++) pthread_join(workers[i].thread, NULL);
+	t0 = cpuNowNs() - t0;
+	
+	// Merge the counters of all workers, every opcode/mode that was tested gets a line
+	printf("entry,opcode,mode,tests,passed,failed,cycles_off,first_failure\n");
+	for (uint32_t e = 0; e < CT_ENTRIES; e++){
+		tests = fails = offs = 0;
+		first = UINT64_MAX;
+		for (uint32_t i = 0; i < threads; i++){
+			tests += workers[i].total[e];
+			fails += workers[i].failed[e];
+			offs += workers[i].cycles[e];
+			if (workers[i].first[e] < first) first = workers[i].first[e];
+		}
+		if (!tests) continue;
+		
+		printf("%u,0x%02X,%s,%u,%u,%u,%u,", e, e & 0xFF, modeNames[e >> 8], tests, tests - fails, fails, offs);
+		if (first != UINT64_MAX){
+			F = &files[first >> 32];
+			printf("\"%s:%s\"", F->path, F->tests[first & 0xFFFFFFFF].name);
+		}
+		printf("\n");
+		
+		total += tests;
+		failed += fails;
+		cycles += offs;
+	}
+	
+	fprintf(stderr, "[CONFORM] %llu tests, %llu passed, %llu failed, %llu with the wrong amount of cycles (%.2f seconds, %.0f tests/s)\n",
+		(unsigned long long)total, (unsigned long long)(total - failed), (unsigned long long)failed,
+		(unsigned long long)cycles, t0 / 1e9, total * 1e9 / (t0 ? t0 : 1));
+	
+	return failed ? 1 : 0;
+}
+
+
+
+
+bool parseOptions(int argc, char* argv[]){
+	char *val;
+	
+	files = calloc(argc, sizeof(ctFile));
+	if (!files) return false;
+	
+	for (int i = 1; i < argc; i++){
+		val = strchr(argv[i], '=');
+		if (!val){		// Everything that isn't an option is a test file
+			files[fileCount++].path = argv[i];
+			continue;
+		}
+		val++;
+		
+		if (!strncmp(argv[i], "threads=", 8)){			// Threads to use (0 = one per host core)
+			threads = strtoul(val, NULL, 0);
+		}else if (!strncmp(argv[i], "strict=", 7)){		// The wrong amount of cycles fails a test
+			strict = !!strtoul(val, NULL, 0);
+		}else if (!strncmp(argv[i], "show=", 5)){		// Print the details of this many failures
+			showMax = strtoul(val, NULL, 0);
+		}else if (!strncmp(argv[i], "save=", 5)){		// Write every JSON file as a binary file next to it
+			saveBinary = !!strtoul(val, NULL, 0);
+		}else{
+			printf("Unknown Argument \"%s\"!\n", argv[i]);
+			return false;
+		}
+	}
+	
+	return true;
+}
+
+void* loadThread(void* arg){
+	uint32_t i;
+	
+	while ((i = __atomic_fetch_add(&nextFile, 1, __ATOMIC_RELAXED)) < fileCount){
+		files[i].ok = loadFile(&files[i]);
+		if (files[i].ok && saveBinary && !saveFile(&files[i])){
+			fprintf(stderr, "Couldn't write the binary form of \"%s\"!\n", files[i].path);
+		}
+	}
+	
+	return NULL;
+}
+
+// Takes chunks of tests until all are done, a chunk doesn't cross into the next file
+void* runThread(void* arg){
+	ctWorker *W = arg;
+	uint64_t start, end;
+	uint32_t f = 0, entry;
+	uint8_t res;
+	char why[128];
+	
+	for (uint32_t e = 0; e < CT_ENTRIES; e++) W->first[e] = UINT64_MAX;
+	
+	while ((start = __atomic_fetch_add(&nextTest, CT_CHUNK, __ATOMIC_RELAXED)) < fileStart[fileCount]){
+		end = start + CT_CHUNK;
+		if (end > fileStart[fileCount]) end = fileStart[fileCount];
+		
+		for (uint64_t t = start; t < end; t++){
+			while (t >= fileStart[f + 1]) f++;		// The chunks only go up, so the file does too
+			
+			res = runTest(W, &files[f], &files[f].tests[t - fileStart[f]], &entry, why, sizeof(why));
+			W->total[entry]++;
+			if (res & CT_FAIL_CYCLES) W->cycles[entry]++;
+			if (!strict) res &= ~CT_FAIL_CYCLES;
+			if (!res) continue;
+			
+			W->failed[entry]++;
+			if (((uint64_t)f << 32 | (t - fileStart[f])) < W->first[entry]) W->first[entry] = (uint64_t)f << 32 | (t - fileStart[f]);
+			
+			if (__atomic_fetch_add(&shown, 1, __ATOMIC_RELAXED) < showMax){
+				pthread_mutex_lock(&printLock);
+				fprintf(stderr, "FAIL %s:%s (opcode $%02X, %s): %s\n", files[f].path, files[f].tests[t - fileStart[f]].name,
+					entry & 0xFF, modeNames[entry >> 8], why);
+				pthread_mutex_unlock(&printLock);
+			}
+		}
+	}
+	
+	return NULL;
+}
+
+// Loads a file, the binary form is recognized by it's extension
+bool loadFile(ctFile* F){
+	FILE *fp = fopen(F->path, "rb");
+	char *text;
+	uint64_t len;
+	bool ok;
+	
+	if (!fp){
+		fprintf(stderr, "Couldn't open \"%s\"!\n", F->path);
+		return false;
+	}
+	
+	len = strlen(F->path);
+	if ((len > 4) && !strcmp(F->path + len - 4, ".ctb")){
+		ok = loadBinary(F, fp);
+		fclose(fp);
+		if (!ok) fprintf(stderr, "\"%s\" isn't a binary test file!\n", F->path);
+		return ok;
+	}
+	
+	fseek(fp, 0, SEEK_END);
+	len = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	text = malloc(len + 1);
+	if (!text || (fread(text, 1, len, fp) != len)){
+		fprintf(stderr, "Couldn't read \"%s\"!\n", F->path);
+		free(text);
+		fclose(fp);
+		return false;
+	}
+	fclose(fp);
+	
+	ok = loadJSON(F, text, len);
+	free(text);
+	if (!ok) fprintf(stderr, "\"%s\" isn't a valid test file!\n", F->path);
+	return ok;
+}
+
+
+
+
+// JSON ----------------------------------------------------------------------- //
+// Just enough to read the test files: objects, arrays, strings (without escapes other than \") and integers
+
+void static jsonWS(ctJson* J){
+	while ((J->p < J->end) && isspace((unsigned char)*J->p)) J->p++;
+}
+
+// Skips the character if it's next, returns true if it was
+bool static jsonChar(ctJson* J, char c){
+	jsonWS(J);
+	if ((J->p < J->end) && (*J->p == c)){
+		J->p++;
+		return true;
+	}
+	return false;
+}
+
+void static jsonExpect(ctJson* J, char c){
+	if (!jsonChar(J, c)) J->err = true;
+}
+
+// Reads a string into buf (cut to size)
+void static jsonString(ctJson* J, char* buf, uint32_t size){
+	uint32_t len = 0;
+	
+	jsonExpect(J, '"');
+	while (!J->err && (J->p < J->end) && (*J->p != '"')){
+		if ((*J->p == '\\') && ((J->p + 1) < J->end)) J->p++;
+		if ((len + 1) < size) buf[len++] = *J->p;
+		J->p++;
+	}
+	if (size) buf[len] = 0;
+	jsonExpect(J, '"');
+}
+
+int64_t static jsonNumber(ctJson* J){
+	char *end;
+	int64_t val;
+	
+	jsonWS(J);
+	val = strtoll(J->p, &end, 10);
+	if (end == J->p) J->err = true;
+	J->p = end;
+	return val;
+}
+
+// Skips over any value, including everything in it
+void static jsonSkip(ctJson* J){
+	char tmp[1];
+	
+	jsonWS(J);
+	if (J->p >= J->end){
+		J->err = true;
+	}else if (*J->p == '"'){
+		jsonString(J, tmp, 0);
+	}else if ((*J->p == '[') || (*J->p == '{')){
+		char close = (*J->p == '[') ? ']' : '}';
+		
+		J->p++;
+		if (jsonChar(J, close)) return;
+		do{
+			if (close == '}'){
+				jsonString(J, tmp, 0);
+				jsonExpect(J, ':');
+			}
+			jsonSkip(J);
+		}while (!J->err && jsonChar(J, ','));
+		jsonExpect(J, close);
+	}else{
+		while ((J->p < J->end) && !strchr(",]} \t\r\n", *J->p)) J->p++;		// Numbers, true, false, null
+	}
+}
+
+// Adds a Byte to the file's pool
+void static ctAddByte(ctFile* F, uint32_t addr, uint8_t val){
+	ctByte *tmp;
+	
+	if (F->byte_count >= F->byte_size){
+		F->byte_size = F->byte_size ? F->byte_size * 2 : 4096;
+		tmp = realloc(F->bytes, F->byte_size * sizeof(ctByte));
+		if (!tmp) exit(-1);
+		F->bytes = tmp;
+	}
+	F->bytes[F->byte_count++] = (ctByte){addr & 0x00FFFFFF, val};
+}
+
+// Reads an "initial" or "final" object, it's RAM goes to the end of the pool
+void static jsonState(ctJson* J, ctFile* F, ctRegs* R, uint32_t* ram, uint16_t* count){
+	char key[8];
+	int64_t val;
+	
+	*ram = F->byte_count;
+	*count = 0;
+	
+	jsonExpect(J, '{');
+	if (jsonChar(J, '}')) return;
+	do{
+		jsonString(J, key, sizeof(key));
+		jsonExpect(J, ':');
+		
+		if (!strcmp(key, "ram")){
+			jsonExpect(J, '[');
+			if (jsonChar(J, ']')) continue;
+			do{
+				jsonExpect(J, '[');
+				val = jsonNumber(J);
+				jsonExpect(J, ',');
+				ctAddByte(F, val, jsonNumber(J));
+				jsonExpect(J, ']');
+				(*count)++;
+			}while (!J->err && jsonChar(J, ','));
+			jsonExpect(J, ']');
+			continue;
+		}
+		
+		if (!strcmp(key, "pc")) R->pc = jsonNumber(J);
+		else if (!strcmp(key, "s")) R->s = jsonNumber(J);
+		else if (!strcmp(key, "a")) R->a = jsonNumber(J);
+		else if (!strcmp(key, "x")) R->x = jsonNumber(J);
+		else if (!strcmp(key, "y")) R->y = jsonNumber(J);
+		else if (!strcmp(key, "d")) R->d = jsonNumber(J);
+		else if (!strcmp(key, "pbr")) R->pbr = jsonNumber(J);
+		else if (!strcmp(key, "dbr")) R->dbr = jsonNumber(J);
+		else if (!strcmp(key, "p")) R->p = jsonNumber(J);
+		else if (!strcmp(key, "e")) R->e = jsonNumber(J);
+		else jsonSkip(J);
+	}while (!J->err && jsonChar(J, ','));
+	jsonExpect(J, '}');
+}
+
+// Parses a JSON array of tests
+bool loadJSON(ctFile* F, const char* text, uint64_t len){
+	ctJson J = {text, text + len, false};
+	ctTest *T, *tmp;
+	char key[16];
+	
+	jsonExpect(&J, '[');
+	if (jsonChar(&J, ']')) return !J.err;
+	
+	do{
+		if (F->count >= F->size){
+			F->size = F->size ? F->size * 2 : 1024;
+			tmp = realloc(F->tests, F->size * sizeof(ctTest));
+			if (!tmp) return false;
+			F->tests = tmp;
+		}
+		T = &F->tests[F->count++];
+		memset(T, 0, sizeof(ctTest));
+		
+		jsonExpect(&J, '{');
+		if (jsonChar(&J, '}')) continue;
+		do{
+			jsonString(&J, key, sizeof(key));
+			jsonExpect(&J, ':');
+			
+			if (!strcmp(key, "name")){
+				jsonString(&J, T->name, NAME_LEN);
+			}else if (!strcmp(key, "initial")){
+				jsonState(&J, F, &T->init, &T->init_ram, &T->init_count);
+			}else if (!strcmp(key, "final")){
+				jsonState(&J, F, &T->final, &T->final_ram, &T->final_count);
+			}else if (!strcmp(key, "cycles")){		// Only the amount of bus cycles is used
+				jsonExpect(&J, '[');
+				if (jsonChar(&J, ']')) continue;
+				do{
+					jsonSkip(&J);
+					T->cycles++;
+				}while (!J.err && jsonChar(&J, ','));
+				jsonExpect(&J, ']');
+			}else{
+				jsonSkip(&J);
+			}
+		}while (!J.err && jsonChar(&J, ','));
+		jsonExpect(&J, '}');
+	}while (!J.err && jsonChar(&J, ','));
+	jsonExpect(&J, ']');
+	
+	return !J.err;
+}
+
+
+
+
+// Binary Files --------------------------------------------------------------- //
+// Header (magic, version, size of a test, amount of tests and Bytes), then all tests and the Byte pool as they are
+// in memory, so it's only meant for the same kind of host that wrote it
+
+bool loadBinary(ctFile* F, FILE* fp){
+	uint32_t hdr[5];
+	
+	if (fread(hdr, sizeof(hdr), 1, fp) != 1) return false;
+	if ((hdr[0] != CT_MAGIC) || (hdr[1] != CT_VERSION) || (hdr[2] != sizeof(ctTest))) return false;
+	
+	F->count = F->size = hdr[3];
+	F->byte_count = F->byte_size = hdr[4];
+	F->tests = malloc(F->count * sizeof(ctTest) + 1);
+	F->bytes = malloc(F->byte_count * sizeof(ctByte) + 1);
+	if (!F->tests || !F->bytes) return false;
+	
+	if (fread(F->tests, sizeof(ctTest), F->count, fp) != F->count) return false;
+	if (fread(F->bytes, sizeof(ctByte), F->byte_count, fp) != F->byte_count) return false;
+	return true;
+}
+
+// Writes a loaded JSON file as FILE.ctb (replacing a .json extension)
+bool saveFile(const ctFile* F){
+	uint32_t hdr[5] = {CT_MAGIC, CT_VERSION, sizeof(ctTest), F->count, F->byte_count};
+	uint32_t len = strlen(F->path);
+	char path[len + 5];
+	FILE *fp;
+	bool ok;
+	
+	if ((len > 4) && !strcmp(F->path + len - 4, ".ctb")) return true;		// Already is one
+	strcpy(path, F->path);
+	if ((len > 5) && !strcmp(path + len - 5, ".json")) path[len - 5] = 0;
+	strcat(path, ".ctb");
+	
+	fp = fopen(path, "wb");
+	if (!fp) return false;
+	ok = (fwrite(hdr, sizeof(hdr), 1, fp) == 1);
+	ok = ok && (fwrite(F->tests, sizeof(ctTest), F->count, fp) == F->count);
+	ok = ok && (fwrite(F->bytes, sizeof(ctByte), F->byte_count, fp) == F->byte_count);
+	return !fclose(fp) && ok;
+}
+
+
+
+
+// Running -------------------------------------------------------------------- //
+
+void static ctSetRegs(cpuState* CPU, const ctRegs* R){
+	CPU->reg_pc.w = R->pc;
+	CPU->reg_sp.w = R->s;
+	CPU->reg_a.w = R->a;
+	CPU->reg_x.w = R->x;
+	CPU->reg_y.w = R->y;
+	CPU->reg_dp.w = R->d;
+	CPU->reg_pb = R->pbr;
+	CPU->reg_db = R->dbr;
+	CPU->fl_c = !!(R->p & 0x01);
+	CPU->fl_z = !!(R->p & 0x02);
+	CPU->fl_i = !!(R->p & 0x04);
+	CPU->fl_d = !!(R->p & 0x08);
+	CPU->fl_x = !!(R->p & 0x10) || R->e;
+	CPU->fl_m = !!(R->p & 0x20) || R->e;
+	CPU->fl_v = !!(R->p & 0x40);
+	CPU->fl_n = !!(R->p & 0x80);
+	CPU->fl_e = R->e;
+	CPU->wai = false;
+	CPU->stp = false;
+	CPU->interrupt = 0;
+	CPU->irq_line = 0;
+}
+
+void static ctGetRegs(const cpuState* CPU, ctRegs* R){
+	R->pc = CPU->reg_pc.w;
+	R->s = CPU->reg_sp.w;
+	R->a = CPU->reg_a.w;
+	R->x = CPU->reg_x.w;
+	R->y = CPU->reg_y.w;
+	R->d = CPU->reg_dp.w;
+	R->pbr = CPU->reg_pb;
+	R->dbr = CPU->reg_db;
+	R->p = (CPU->fl_n << 7) | (CPU->fl_v << 6) | (CPU->fl_m << 5) | (CPU->fl_x << 4)
+		| (CPU->fl_d << 3) | (CPU->fl_i << 2) | (CPU->fl_z << 1) | CPU->fl_c;
+	R->e = CPU->fl_e;
+}
+
+// Runs a single test on the worker's CPU and stores it's cycle table index in entry
+// Returns what didn't match (CT_FAIL_*), the first mismatch is described in why
+uint8_t runTest(ctWorker* W, const ctFile* F, const ctTest* T, uint32_t* entry, char* why, uint32_t size){
+	cpuState *CPU = &W->cpu;
+	const ctByte *B;
+	const ctRegs *E = &T->final;
+	ctRegs R;
+	uint64_t cyc;
+	uint8_t res = 0, mode, mask;
+	
+	// Only the Pages the last test wrote to go back to 0
+	cpuSnapshotLoad(CPU, &W->snap);
+	B = F->bytes + T->init_ram;
+	for (uint32_t i = 0; i < T->init_count; i++){
+		CPU->mem[B[i].addr] = B[i].val;
+		cpuMarkDirty(CPU, B[i].addr, 1);
+	}
+	ctSetRegs(CPU, &T->init);
+	
+	mode = T->init.e ? STATS_MODE_EMU : (((T->init.p & 0x20) ? 2 : 0) | ((T->init.p & 0x10) ? 1 : 0));
+	*entry = mode * 256 + CPU->mem[((uint32_t)T->init.pbr << 16) | T->init.pc];
+	
+	cyc = CPU->cycle_count;
+	cpuStep(CPU);
+	cyc = CPU->cycle_count - cyc;
+	ctGetRegs(CPU, &R);
+	
+	// In Emulation mode bit 4 and 5 of P aren't M and X
+	mask = E->e ? 0xCF : 0xFF;
+	
+	if (R.pc != E->pc) snprintf(why, size, "PC $%04X, expected $%04X", R.pc, E->pc);
+	else if (R.pbr != E->pbr) snprintf(why, size, "PB $%02X, expected $%02X", R.pbr, E->pbr);
+	else if (R.a != E->a) snprintf(why, size, "A $%04X, expected $%04X", R.a, E->a);
+	else if (R.x != E->x) snprintf(why, size, "X $%04X, expected $%04X", R.x, E->x);
+	else if (R.y != E->y) snprintf(why, size, "Y $%04X, expected $%04X", R.y, E->y);
+	else if (R.s != E->s) snprintf(why, size, "SP $%04X, expected $%04X", R.s, E->s);
+	else if (R.d != E->d) snprintf(why, size, "DP $%04X, expected $%04X", R.d, E->d);
+	else if (R.dbr != E->dbr) snprintf(why, size, "DB $%02X, expected $%02X", R.dbr, E->dbr);
+	else if ((R.p & mask) != (E->p & mask)) snprintf(why, size, "P $%02X, expected $%02X", R.p, E->p);
+	else if (R.e != E->e) snprintf(why, size, "E %u, expected %u", R.e, E->e);
+	else mask = 0;
+	if (mask) res |= CT_FAIL_STATE;
+	
+	B = F->bytes + T->final_ram;
+	for (uint32_t i = 0; !res && (i < T->final_count); i++){
+		if (CPU->mem[B[i].addr] == B[i].val) continue;
+		snprintf(why, size, "$%06X = $%02X, expected $%02X", B[i].addr, CPU->mem[B[i].addr], B[i].val);
+		res |= CT_FAIL_STATE;
+	}
+	
+	if (cyc != T->cycles){
+		if (!res) snprintf(why, size, "%llu cycles, expected %u", (unsigned long long)cyc, T->cycles);
+		res |= CT_FAIL_CYCLES;
+	}
+	
+	return res;
+}
+
+
+
+
+// There's no IO block, all 16MB are Memory
+uint8_t ctReadIO(uint32_t addr){
+	return 0;
+}
+
+void ctWriteIO(uint32_t addr, uint8_t val){
+}
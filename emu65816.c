@@ -1,11 +1,33 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <sched.h>
+#include <time.h>
 #include <stdbool.h>
 
 // Comment out this #define if compiling on a Big Endian System/CPU
 #define __EMU_LITTLE_ENDIAN
 
+// Uncomment this #define (or use -D__EMU_FUZZ) to build with the coverage hooks used for fuzzing
+// #define __EMU_FUZZ
+
+// Uncomment this #define (or use -D__EMU_STATS) to build with the per-opcode execution statistics
+// #define __EMU_STATS
+
+// Uncomment this #define (or use -D__EMU_PROFILE) to build with the sampling profiler
+// #define __EMU_PROFILE
+
+// Uncomment this #define (or use -D__EMU_TRACE) to build with the binary execution trace (see emu65816_trace.c)
+// #define __EMU_TRACE
+
+// Uncomment this #define (or use -D__EMU_HEATMAP) to build with the memory and IO access counters
+// #define __EMU_HEATMAP
+
+// Uncomment this #define (or use -D__EMU_PERF) to build with the runtime performance counters
+// #define __EMU_PERF
+
 #include "emu65816_library.h"
 
 
@@ -15,6 +37,17 @@ void cpuInit(cpuState* CPU, uint8_t* memory, uint32_t memSize, uint32_t ioAddres
 	
 	CPU->wai = false;
 	CPU->stp = false;
+	CPU->cycle_count = 0;
+	CPU->dirty_map = NULL;
+	CPU->dirty_mask = 0;
+	memset(CPU->snaps, 0, sizeof(CPU->snaps));
+	CPU->stats = NULL;
+	CPU->prof = NULL;
+	CPU->trace = NULL;
+	CPU->heat = NULL;
+	CPU->perf = NULL;
+	CPU->cov_map = NULL;
+	CPU->cov_prev = 0;
 	MEM = memory;
 	CPU->io_read = ioRead;
 	CPU->io_write = ioWrite;
@@ -22,6 +55,7 @@ void cpuInit(cpuState* CPU, uint8_t* memory, uint32_t memSize, uint32_t ioAddres
 	IOS = ioSize;
 	MES = memSize;
 	INT = 0;
+	CPU->irq_line = 0;
 	DBG = false;
 	
 	A.w = 0;
@@ -45,44 +79,77 @@ void cpuInit(cpuState* CPU, uint8_t* memory, uint32_t memSize, uint32_t ioAddres
 // Executes instructions for a set amount of cycles
 // Returns how many Cycles it didn't use, value is negative if it used more Cycles than requested
 int32_t cpuExecute(cpuState* CPU, int32_t cycles){
-	int32_t cycleRem = cycles;
-	uint8_t opcode;
+	cpuRunCtl RUN = {.cycles = cycles};
+	
+	cpuRun(CPU, &RUN);
+	
+	return RUN.cycle_rem;
+}
+
+
+// Executes a single instruction
+// Returns why it stopped (RUN_INSTRUCTIONS, or RUN_WAI/RUN_STP if the CPU isn't running)
+uint8_t cpuStep(cpuState* CPU){
+	cpuRunCtl RUN = {.cycles = RUN_UNLIMITED, .instructions = 1};
+	
+	return cpuRun(CPU, &RUN);
+}
+
+// Returns the monotonic host time in nanoseconds, for everything that measures how long the emulation took
+uint64_t cpuNowNs(void){
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+// Executes instructions until one of the stop conditions in RUN is met
+// The conditions are checked after every instruction, breakpoints are only checked from the 2nd instruction onwards
+// so that a run can continue from the breakpoint it last stopped at
+// Returns why it stopped (RUN_*), which is also stored in RUN together with the amount of cycles and instructions
+uint8_t cpuRun(cpuState* CPU, cpuRunCtl* RUN){
+	int32_t cycleRem = RUN->cycles;
+	uint32_t executed = 0;
+	uint8_t opcode, cyc;
 	bool _pre_debug = DBG;
+	bool limits = RUN->instructions || RUN->deadline || RUN->bp_count;
 	cint32_t tmp0, tmp1, tmp2, tmp3;
+	#ifdef __EMU_PERF
+	uint64_t perfStart = CPU->perf ? cpuNowNs() : 0;
+	uint64_t perfCycles = CPU->cycle_count;
+	uint32_t perfExecuted = 0;
+	#endif
 	
 	// If a STP instruction was executed, exit immediately
-	if (CPU->stp) return 0;
+	// (the early exits still go through done, so the call is counted by the performance counters as well)
+	if (CPU->stp){
+		cycleRem = 0;
+		RUN->reason = RUN_STP;
+		goto done;
+	}
 	
 	// If a WAI instruction was executed but no interrupt was issued, exit immediately
-	if (CPU->wai) return cycleRem;
+	// (an asserted IRQ Line also wakes the CPU, even if the I flag is set)
+	if (CPU->wai){
+		if (!__atomic_load_n(&CPU->irq_line, __ATOMIC_RELAXED)){
+			RUN->reason = RUN_WAI;
+			goto done;
+		}
+		CPU->wai = false;
+	}
 	
 	// Handle Hardware Interrupts (IRQ, NMI, ABT)
 	if(INT){
-		if (EF){		// Emulation
-			pushStack(CPU, PC.bh);
-			pushStack(CPU, PC.bl);
-			pushStack(CPU, readSR(CPU) | SR_INT);
-			setD(false);
-			setI(true);
-			PC.bl = readMem(CPU, interruptTableE[INT]);
-			PC.bh = readMem(CPU, interruptTableE[INT] + 1);
-			PB = 0;
-		}else{			// Native
-			pushStack(CPU, PB);
-			pushStack(CPU, PC.bh);
-			pushStack(CPU, PC.bl);
-			pushStack(CPU, readSR(CPU));
-			setD(false);
-			setI(true);
-			PC.bl = readMem(CPU, interruptTableN[INT]);
-			PC.bh = readMem(CPU, interruptTableN[INT] + 1);
-			PB = 0;
-		}
+		enterInterrupt(CPU, INT);
 		INT = 0;
 	}
 	
 	next:
 	
+	// Sample the level-triggered IRQ Line at every Instruction boundary (it can be changed by other threads)
+	if (__atomic_load_n(&CPU->irq_line, __ATOMIC_RELAXED) && !IF) enterInterrupt(CPU, 1);
+	
 	// Clear the high Bytes of X and Y when XF=1, in case they were changed somehow
 	if (XF){
 		X.bh = 0;
@@ -94,6 +161,8 @@ int32_t cpuExecute(cpuState* CPU, int32_t cycles){
 	
 	// Fetch an Opcode
 	opcode = fetch(CPU);
+	executed++;
+	traceInst(opcode);
 	
 	// Decode it
 	// Run the correct operation
@@ -113,6 +182,7 @@ int32_t cpuExecute(cpuState* CPU, int32_t cycles){
 			tmp0.bm = fetch(CPU);
 			PC.w = tmp0.wl;
 			dbg_printf("JMP $%04X", PC.w);
+			fuzzEdge();
 		break;
 		
 		// Absolute Indirect
@@ -122,6 +192,7 @@ int32_t cpuExecute(cpuState* CPU, int32_t cycles){
 			PC.bl = readMem(CPU, 0x0000FFFF & (tmp0.wl));
 			PC.bh = readMem(CPU, 0x0000FFFF & (tmp0.wl + 1));
 			dbg_printf("JMP ($%04X) (Value: $%04X)", tmp0.wl, PC.w);
+			fuzzEdge();
 		break;
 		
 		// Absolute X Indirect
@@ -131,6 +202,7 @@ int32_t cpuExecute(cpuState* CPU, int32_t cycles){
 			PC.bl = readMem(CPU, 0x00FFFFFF & ((PB << 16U) | (((uint32_t)tmp0.wl + X.w) & 0x0000FFFF)));
 			PC.bh = readMem(CPU, 0x00FFFFFF & ((PB << 16U) | (((uint32_t)tmp0.wl + X.w + 1) & 0x0000FFFF)));
 			dbg_printf("JMP ($%04X,X) (Target: $%06X, Value: $%04X)", tmp0.wl, 0x00FFFFFF & ((PB << 16U) | (((uint32_t)tmp0.wl + X.w) & 0x0000FFFF)), PC.w);
+			fuzzEdge();
 		break;
 		
 		// Absolute Indirect Long
@@ -141,6 +213,7 @@ int32_t cpuExecute(cpuState* CPU, int32_t cycles){
 			PC.bh = readMem(CPU, 0x0000FFFF & (tmp0.wl + 1));
 			PB = readMem(CPU, 0x0000FFFF & (tmp0.wl + 2));
 			dbg_printf("JML ($%04X) (Value: $%02X%04X)", tmp0.wl, PB, PC.w);
+			fuzzEdge();
 		break;
 		
 		// Absolute Long
@@ -151,6 +224,7 @@ int32_t cpuExecute(cpuState* CPU, int32_t cycles){
 			PC.w = tmp0.wl;
 			PB = tmp0.bh;
 			dbg_printf("JML $%02X%04X", PB, PC.w);
+			fuzzEdge();
 		break;
 		
 		// Absolute
@@ -159,8 +233,10 @@ int32_t cpuExecute(cpuState* CPU, int32_t cycles){
 			pushStack(CPU, PC.bh);
 			pushStack(CPU, PC.bl);			// Push the PC before fetching the 2nd Operand
 			tmp0.bm = fetch(CPU);
+			profCall();
 			PC.w = tmp0.wl;
 			dbg_printf("JSR $%04X ------------------------------------------------", PC.w);
+			fuzzEdge();
 		break;
 		
 		// Absolute X Indirect
@@ -169,9 +245,11 @@ int32_t cpuExecute(cpuState* CPU, int32_t cycles){
 			pushStack(CPU, PC.bh);
 			pushStack(CPU, PC.bl);			// Push the PC before fetching the 2nd Operand
 			tmp0.bm = fetch(CPU);
+			profCall();
 			PC.bl = readMem(CPU, 0x00FFFFFF & ((PB << 16U) | (((uint32_t)tmp0.wl + X.w) & 0x0000FFFF)));
 			PC.bh = readMem(CPU, 0x00FFFFFF & ((PB << 16U) | (((uint32_t)tmp0.wl + X.w + 1) & 0x0000FFFF)));
 			dbg_printf("JSR ($%04X,X) (Target: $%06X, Value: $%04X)", tmp0.wl, (tmp0.wl + X.w) & 0x0000FFFF, PC.w);
+			fuzzEdge();
 		break;
 		
 		// Absolute Long
@@ -185,9 +263,11 @@ int32_t cpuExecute(cpuState* CPU, int32_t cycles){
 			pushStack(CPU, PC.bl);			// Push the PC before fetching the 3rd Operand
 			setE(tmp3.bl);		// And afterwards restore it again
 			tmp0.bh = fetch(CPU);
+			profCall();
 			PC.w = tmp0.wl;
 			PB = tmp0.bh;
 			dbg_printf("JSL $%02X%04X ----------------------------------------------", PB, PC.w);
+			fuzzEdge();
 		break;
 		
 		// Returns --------------------------------------------------------------- //
@@ -197,6 +277,8 @@ int32_t cpuExecute(cpuState* CPU, int32_t cycles){
 			tmp0.bm = pullStack(CPU);
 			PC.w = tmp0.wl + 1;
 			dbg_printf("RTS (Target: $%02X%04X)", PB, PC.w);
+			fuzzEdge();
+			profReturn();
 		break;
 		
 		// From Long Subroutine
@@ -209,6 +291,8 @@ int32_t cpuExecute(cpuState* CPU, int32_t cycles){
 			PB = pullStack(CPU);
 			setE(tmp3.bl);		// And afterwards restore it again
 			dbg_printf("RTL (Target: $%02X%04X)", PB, PC.w);
+			fuzzEdge();
+			profReturn();
 		break;
 		
 		// From Interrupt
@@ -224,6 +308,8 @@ int32_t cpuExecute(cpuState* CPU, int32_t cycles){
 				PB = pullStack(CPU);
 			}
 			dbg_printf("RTI (Target: $%02X%04X)", PB, PC.w);
+			fuzzEdge();
+			profReturn();
 		break;
 		
 		// Branches -------------------------------------------------------------- //
@@ -245,6 +331,7 @@ int32_t cpuExecute(cpuState* CPU, int32_t cycles){
 			}else{
 				dbg_printf("Not Taken)");
 			}
+			fuzzEdge();		// Taken or not, both start a new block
 		break;
 		
 		// Branch on Zero Clear/Set
@@ -265,6 +352,7 @@ int32_t cpuExecute(cpuState* CPU, int32_t cycles){
 			}else{
 				dbg_printf("Not Taken)");
 			}
+			fuzzEdge();		// Taken or not, both start a new block
 		break;
 		
 		// Branch on Interrupt Clear/Set
@@ -285,6 +373,7 @@ int32_t cpuExecute(cpuState* CPU, int32_t cycles){
 			}else{
 				dbg_printf("Not Taken)");
 			}
+			fuzzEdge();		// Taken or not, both start a new block
 		break;
 		
 		// Branch on Overflow Clear/Set
@@ -305,6 +394,7 @@ int32_t cpuExecute(cpuState* CPU, int32_t cycles){
 			}else{
 				dbg_printf("Not Taken)");
 			}
+			fuzzEdge();		// Taken or not, both start a new block
 		break;
 		
 		// Unconditional Branches
@@ -312,6 +402,7 @@ int32_t cpuExecute(cpuState* CPU, int32_t cycles){
 			tmp0.bl = fetch(CPU);					// Relative Offset
 			PC.w += tmp0.sbl;
 			dbg_printf("BRA (Target: $%02X%04X)", PB, PC.w);
+			fuzzEdge();
 		break;
 		
 		case OP_BRL_R:
@@ -319,6 +410,7 @@ int32_t cpuExecute(cpuState* CPU, int32_t cycles){
 			tmp0.bm = fetch(CPU);					// 16-bit Relative Offset
 			PC.w += tmp0.swl;
 			dbg_printf("BRA (Target: $%02X%04X)", PB, PC.w);
+			fuzzEdge();
 		break;
 		
 		// Stack Operations ------------------------------------------------------ //
@@ -1337,15 +1429,19 @@ int32_t cpuExecute(cpuState* CPU, int32_t cycles){
 		// Wait for Interrupt
 		case OP_WAI:
 			dbg_printf("WAI");
+			if (__atomic_load_n(&CPU->irq_line, __ATOMIC_RELAXED)) break;		// An already asserted IRQ Line lets WAI fall through (the I flag must be set, otherwise it would've been taken)
 			CPU->wai = true;
-			return cycleRem;
+			RUN->reason = RUN_WAI;
+			goto done;
 		break;
 		
 		// Stop CPU
 		case OP_STP:
 			dbg_printf("STP");
 			CPU->stp = true;
-			return 0;
+			cycleRem = 0;
+			RUN->reason = RUN_STP;
+			goto done;
 		break;
 		
 		// Expansion?
@@ -1368,6 +1464,7 @@ int32_t cpuExecute(cpuState* CPU, int32_t cycles){
 		case OP_BRK_IM:
 			tmp0.bl = fetch(CPU);
 			dbg_printf("BRK #$%02X", tmp0.bl);
+			profCall();
 			if (EF){		// Emulation
 				pushStack(CPU, PC.bh);
 				pushStack(CPU, PC.bl);
@@ -1394,6 +1491,7 @@ int32_t cpuExecute(cpuState* CPU, int32_t cycles){
 		case OP_COP_IM:
 			tmp0.bl = fetch(CPU);
 			dbg_printf("COP #$%02X", tmp0.bl);
+			profCall();
 			if (EF){		// Emulation
 				pushStack(CPU, PC.bh);
 				pushStack(CPU, PC.bl);
@@ -2461,16 +2559,1460 @@ int32_t cpuExecute(cpuState* CPU, int32_t cycles){
 	if (EF) SP.bh = 1;
 	
 	// Subtract the Cycles of the current instruction from the remainder
-	cycleRem -= cycleTable[(EF ? 0x0400 : 0x0000) | (MF ? 0x0200 : 0x0000) | (XF ? 0x0100 : 0x0000) | opcode];
+	// (in Emulation mode M and X are always set, so the e1 part of the table is used on it's own)
+	cyc = cycleTable[cycleIndex(opcode)];
+	cycleRem -= cyc;
+	CPU->cycle_count += cyc;
+	
+	#ifdef __EMU_PROFILE
+	if (CPU->prof && (CPU->cycle_count >= CPU->prof->next)) profSample(CPU);
+	#endif
+	
+	#ifdef __EMU_STATS
+	if (CPU->stats){
+		CPU->stats->count[cycleIndex(opcode)]++;
+		CPU->stats->cycles[cycleIndex(opcode)] += cyc;
+	}
+	#endif
 	
 	dbg_printf(" (Cycles Remaining: %d)\n", cycleRem);
 	
 	// Update the Debug Flag
 	DBG = _pre_debug;
 	
+	#ifdef __EMU_PERF
+	// Publish the counters every now and then, so a dashboard doesn't have to wait for the end of a long run
+	if (CPU->perf && !(executed & (PERF_INTERVAL - 1))){
+		perfStart = perfAdd(CPU, executed - perfExecuted, CPU->cycle_count - perfCycles, perfStart);
+		perfCycles = CPU->cycle_count;
+		perfExecuted = executed;
+	}
+	#endif
+	
+	// Check the optional stop conditions
+	if (limits){
+		if (RUN->instructions && executed >= RUN->instructions){
+			RUN->reason = RUN_INSTRUCTIONS;
+			goto done;
+		}
+		
+		if (RUN->deadline && CPU->cycle_count >= RUN->deadline){
+			RUN->reason = RUN_DEADLINE;
+			goto done;
+		}
+		
+		if (RUN->bp_count){
+			tmp0.l = ((uint32_t)PB << 16U) | PC.w;
+			for (uint32_t i = 0; i < RUN->bp_count; i++){
+				if (RUN->breakpoints[i] == tmp0.l){
+					RUN->reason = RUN_BREAKPOINT;
+					goto done;
+				}
+			}
+		}
+	}
+	
 	// Do another Instruction if there are still cycles left
 	if (cycleRem > 0) goto next;
 	
-	return cycleRem;
+	RUN->reason = RUN_CYCLES;
+	
+	done:
+	RUN->cycle_rem = cycleRem;
+	RUN->executed = executed;
+	
+	#ifdef __EMU_PERF
+	if (CPU->perf) perfUpdate(CPU, RUN, executed - perfExecuted, CPU->cycle_count - perfCycles, perfStart);
+	#endif
+	
+	return RUN->reason;
+}
+
+
+
+
+// Snapshots ---------------------------------------------------------------- //
+// A Snapshot holds a copy of the CPU and of the entire Memory. While a Snapshot exists the CPU keeps track of which
+// Pages it writes to, so saving and loading only has to copy the Pages that changed since the last save/load.
+// Up to SNAP_MAX Snapshots can be used with a CPU at the same time (ie: one of the freshly booted machine to reset to,
+// and one that follows the emulation for rollbacks), each of them has it's own bit in the dirty map and it's own list.
+
+// Copies the CPU's state from src, but keeps everything the Host set up (Memory, IO, tracking)
+void static restoreState(cpuState* CPU, const cpuState* src){
+	cpuState host = *CPU;
+	
+	*CPU = *src;
+	
+	MEM = host.mem;
+	MES = host.mem_size;
+	IOB = host.io_base;
+	IOS = host.io_size;
+	CPU->io_read = host.io_read;
+	CPU->io_write = host.io_write;
+	DBG = host.dbg;
+	CPU->dirty_map = host.dirty_map;
+	CPU->dirty_mask = host.dirty_mask;
+	memcpy(CPU->snaps, host.snaps, sizeof(CPU->snaps));
+	CPU->stats = host.stats;
+	CPU->prof = host.prof;
+	CPU->trace = host.trace;
+	CPU->heat = host.heat;
+	CPU->perf = host.perf;
+	CPU->cov_map = host.cov_map;
+}
+
+// Forgets about all Pages the Snapshot has in it's dirty list
+void static clearDirty(cpuState* CPU, cpuSnapshot* SNAP){
+	for (uint32_t i = 0; i < SNAP->dirty_count; i++){
+		CPU->dirty_map[SNAP->dirty_list[i]] &= ~(1U << SNAP->slot);
+	}
+	SNAP->dirty_count = 0;
+}
+
+// Copies the Pages in the Snapshot's dirty list from one Memory to another
+void static copyDirty(cpuState* CPU, const cpuSnapshot* SNAP, uint8_t* dst, const uint8_t* src){
+	uint32_t ad, size;
+	
+	for (uint32_t i = 0; i < SNAP->dirty_count; i++){
+		ad = SNAP->dirty_list[i] << MEM_PAGE_SHIFT;
+		size = ((MES - ad) < MEM_PAGE_SIZE) ? (MES - ad) : MEM_PAGE_SIZE;
+		memcpy(dst + ad, src + ad, size);
+	}
+}
+
+// Returns the CPU's Memory to the Snapshot, the Pages that change are dirty for all other Snapshots
+void static revertDirty(cpuState* CPU, cpuSnapshot* SNAP){
+	copyDirty(CPU, SNAP, MEM, SNAP->mem);
+	for (uint32_t i = 0; i < SNAP->dirty_count; i++){
+		markDirty(CPU, SNAP->dirty_list[i] << MEM_PAGE_SHIFT);
+	}
+	clearDirty(CPU, SNAP);
+}
+
+// Takes a full Snapshot of the CPU and enables dirty Page tracking
+// Should be called after cpuInit, returns false if there isn't enough memory or all SNAP_MAX Snapshots are in use
+bool cpuSnapshotInit(cpuState* CPU, cpuSnapshot* SNAP){
+	uint8_t slot = 0;
+	
+	while ((slot < SNAP_MAX) && (CPU->dirty_mask & (1U << slot))) slot++;
+	if (slot >= SNAP_MAX) return false;
+	
+	SNAP->mem_size = MES;
+	SNAP->mem = malloc(MES);
+	SNAP->dirty_list = malloc(MEM_PAGES(MES) * sizeof(uint32_t));
+	SNAP->dirty_count = 0;
+	SNAP->slot = slot;
+	if (!CPU->dirty_map) CPU->dirty_map = calloc(MEM_PAGES(MES), sizeof(uint8_t));
+	
+	if (!SNAP->mem || !SNAP->dirty_list || !CPU->dirty_map){
+		free(SNAP->mem);
+		free(SNAP->dirty_list);
+		SNAP->mem = NULL;
+		SNAP->dirty_list = NULL;
+		if (!CPU->dirty_mask){
+			free(CPU->dirty_map);
+			CPU->dirty_map = NULL;
+		}
+		return false;
+	}
+	
+	CPU->dirty_mask |= (1U << slot);
+	CPU->snaps[slot] = SNAP;
+	
+	memcpy(SNAP->mem, MEM, MES);
+	SNAP->cpu = *CPU;
+	SNAP->generation = 0;
+	
+	return true;
+}
+
+// Updates the Snapshot to the current state of the CPU
+void cpuSnapshotSave(cpuState* CPU, cpuSnapshot* SNAP){
+	copyDirty(CPU, SNAP, SNAP->mem, MEM);
+	clearDirty(CPU, SNAP);
+	SNAP->cpu = *CPU;
+	SNAP->generation++;
+}
+
+// Returns the CPU to the state of the Snapshot
+// Only the Pages written to since the Snapshot was last saved/loaded are copied, which makes this a cheap reset
+void cpuSnapshotLoad(cpuState* CPU, cpuSnapshot* SNAP){
+	revertDirty(CPU, SNAP);
+	restoreState(CPU, &SNAP->cpu);
+}
+
+// Frees the Snapshot, dirty Page tracking is disabled once the last Snapshot of the CPU is freed
+void cpuSnapshotFree(cpuState* CPU, cpuSnapshot* SNAP){
+	clearDirty(CPU, SNAP);
+	CPU->dirty_mask &= ~(1U << SNAP->slot);
+	CPU->snaps[SNAP->slot] = NULL;
+	if (!CPU->dirty_mask){
+		free(CPU->dirty_map);
+		CPU->dirty_map = NULL;
+	}
+	
+	free(SNAP->mem);
+	free(SNAP->dirty_list);
+	SNAP->mem = NULL;
+	SNAP->dirty_list = NULL;
+}
+
+// Marks a range of Memory as dirty, needed when the Host writes to the CPU's Memory directly
+void cpuMarkDirty(cpuState* CPU, uint32_t addr, uint32_t size){
+	if (!CPU->dirty_map || !size) return;
+	if (addr >= MES) return;
+	if (size > (MES - addr)) size = MES - addr;
+	
+	for (uint32_t pg = addr >> MEM_PAGE_SHIFT; pg <= ((addr + size - 1) >> MEM_PAGE_SHIFT); pg++){
+		markDirty(CPU, pg << MEM_PAGE_SHIFT);
+	}
+}
+
+
+
+
+// Saved States ------------------------------------------------------------- //
+// A Saved State is a flat buffer that holds everything needed to continue a CPU later (or in another process).
+// All values are stored in little endian, in this order:
+// Header:	magic (4), version (1), type (1), mem_size (4), base generation (4)
+// CPU:		PC, SP, DP, A, X, Y (2 each), PB, DB, Flags (NVMXDIZC), E, WAI, STP, interrupt (1 each),
+//			IRQ Line (4), Cycle Count (8)
+// Memory:	STATE_FULL:  the entire Memory (mem_size)
+//			STATE_DELTA: amount of Pages (4), followed by the number (4) and contents (MEM_PAGE_SIZE) of every Page
+
+#define STATE_HEADER		14
+#define STATE_CPU			31
+
+void static inline put8(uint8_t** p, uint8_t v){
+	*(*p)++ = v;
+}
+
+void static inline put16(uint8_t** p, uint16_t v){
+	put8(p, v);
+	put8(p, v >> 8U);
+}
+
+void static inline put32(uint8_t** p, uint32_t v){
+	put16(p, v);
+	put16(p, v >> 16U);
+}
+
+void static inline put64(uint8_t** p, uint64_t v){
+	put32(p, v);
+	put32(p, v >> 32U);
+}
+
+uint8_t static inline get8(const uint8_t** p){
+	return *(*p)++;
+}
+
+uint16_t static inline get16(const uint8_t** p){
+	uint16_t v = get8(p);
+	return v | (get8(p) << 8U);
+}
+
+uint32_t static inline get32(const uint8_t** p){
+	uint32_t v = get16(p);
+	return v | ((uint32_t)get16(p) << 16U);
+}
+
+uint64_t static inline get64(const uint8_t** p){
+	uint64_t v = get32(p);
+	return v | ((uint64_t)get32(p) << 32U);
+}
+
+// Size of a Page in the Saved State (the last Page can be cut short by the end of Memory)
+uint32_t static inline pageSize(cpuState* CPU, uint32_t pg){
+	uint32_t ad = pg << MEM_PAGE_SHIFT;
+	return ((MES - ad) < MEM_PAGE_SIZE) ? (MES - ad) : MEM_PAGE_SIZE;
+}
+
+// Saves the CPU and it's Memory into buf
+// If BASE is NULL the entire Memory is saved, otherwise only the Pages that changed since BASE was last saved/loaded
+// (BASE has to be one of the CPU's Snapshots)
+// If buf is NULL nothing is written and only the required size is returned
+// Returns the amount of Bytes written, or 0 if they don't fit into size
+uint32_t cpuSaveState(cpuState* CPU, const cpuSnapshot* BASE, uint8_t* buf, uint32_t size){
+	uint32_t need = STATE_HEADER + STATE_CPU;
+	uint8_t *p = buf;
+	
+	if (BASE && (CPU->snaps[BASE->slot] != BASE)) return 0;
+	if (BASE){
+		need += 4;
+		for (uint32_t i = 0; i < BASE->dirty_count; i++){
+			need += 4 + pageSize(CPU, BASE->dirty_list[i]);
+		}
+	}else{
+		need += MES;
+	}
+	
+	if (!buf) return need;
+	if (need > size) return 0;
+	
+	put32(&p, STATE_MAGIC);
+	put8(&p, STATE_VERSION);
+	put8(&p, BASE ? STATE_DELTA : STATE_FULL);
+	put32(&p, MES);
+	put32(&p, BASE ? BASE->generation : 0);
+	
+	put16(&p, PC.w);
+	put16(&p, SP.w);
+	put16(&p, DP.w);
+	put16(&p, A.w);
+	put16(&p, X.w);
+	put16(&p, Y.w);
+	put8(&p, PB);
+	put8(&p, DB);
+	put8(&p, readSR(CPU));
+	put8(&p, EF);
+	put8(&p, CPU->wai);
+	put8(&p, CPU->stp);
+	put8(&p, INT);
+	put32(&p, __atomic_load_n(&CPU->irq_line, __ATOMIC_RELAXED));
+	put64(&p, CPU->cycle_count);
+	
+	if (BASE){
+		put32(&p, BASE->dirty_count);
+		for (uint32_t i = 0; i < BASE->dirty_count; i++){
+			put32(&p, BASE->dirty_list[i]);
+			memcpy(p, MEM + (BASE->dirty_list[i] << MEM_PAGE_SHIFT), pageSize(CPU, BASE->dirty_list[i]));
+			p += pageSize(CPU, BASE->dirty_list[i]);
+		}
+	}else{
+		memcpy(p, MEM, MES);
+	}
+	
+	return need;
+}
+
+// Loads a Saved State created by cpuSaveState into the CPU, the Host's Memory pointer and IO handlers are kept
+// A delta needs the same Snapshot (with the same generation) it was saved against, a full State works with or without one
+// Returns false (without changing anything) if the State is damaged or doesn't fit the CPU
+bool cpuLoadState(cpuState* CPU, cpuSnapshot* BASE, const uint8_t* buf, uint32_t size){
+	const uint8_t *p = buf;
+	const uint8_t *end = buf + size;
+	uint8_t type;
+	uint32_t cnt, pg;
+	
+	if (size < (STATE_HEADER + STATE_CPU)) return false;
+	if (get32(&p) != STATE_MAGIC) return false;
+	if (get8(&p) != STATE_VERSION) return false;
+	type = get8(&p);
+	if (get32(&p) != MES) return false;
+	pg = get32(&p);
+	
+	// Check the whole State before touching the CPU
+	if (type == STATE_DELTA){
+		if (!BASE || (BASE->generation != pg) || (BASE->mem_size != MES) || (CPU->snaps[BASE->slot] != BASE)) return false;
+		p += STATE_CPU;
+		if ((end - p) < 4) return false;
+		cnt = get32(&p);
+		for (uint32_t i = 0; i < cnt; i++){
+			if ((end - p) < 4) return false;
+			pg = get32(&p);
+			if ((pg >= MEM_PAGES(MES)) || ((uint32_t)(end - p) < pageSize(CPU, pg))) return false;
+			p += pageSize(CPU, pg);
+		}
+	}else if (type == STATE_FULL){
+		if ((uint32_t)(end - p - STATE_CPU) < MES) return false;
+	}else{
+		return false;
+	}
+	
+	p = buf + STATE_HEADER;
+	PC.w = get16(&p);
+	SP.w = get16(&p);
+	DP.w = get16(&p);
+	A.w = get16(&p);
+	X.w = get16(&p);
+	Y.w = get16(&p);
+	PB = get8(&p);
+	DB = get8(&p);
+	writeSR(CPU, get8(&p));
+	EF = get8(&p);
+	CPU->wai = get8(&p);
+	CPU->stp = get8(&p);
+	INT = get8(&p);
+	__atomic_store_n(&CPU->irq_line, get32(&p), __ATOMIC_RELEASE);		// Replaces the levels of all Devices (which may be host threads)
+	CPU->cycle_count = get64(&p);
+	
+	if (type == STATE_DELTA){
+		// Go back to the Snapshot, then apply the Pages that differ from it (which makes them dirty again)
+		revertDirty(CPU, BASE);
+		cnt = get32(&p);
+		for (uint32_t i = 0; i < cnt; i++){
+			pg = get32(&p);
+			memcpy(MEM + (pg << MEM_PAGE_SHIFT), p, pageSize(CPU, pg));
+			markDirty(CPU, pg << MEM_PAGE_SHIFT);
+			p += pageSize(CPU, pg);
+		}
+	}else{
+		memcpy(MEM, p, MES);
+		cpuMarkDirty(CPU, 0, MES);
+	}
+	
+	return true;
+}
+
+
+#ifdef __EMU_STATS
+// Execution Statistics ----------------------------------------------------- //
+
+const char static *statsModes[STATS_MODES] = {"m16x16", "m16x8", "m8x16", "m8x8", "emu"};
+
+void cpuStatsReset(cpuStats* ST){
+	memset(ST, 0, sizeof(cpuStats));
+}
+
+// Writes every opcode that was executed at least once (per mode) as CSV or JSON, together with the share of
+// all executed instructions and cycles it makes up
+void cpuStatsDump(const cpuStats* ST, FILE* fp, bool json){
+	uint64_t count = 0, cycles = 0;
+	bool first = true;
+	
+	for (uint32_t i = 0; i < (STATS_MODES * 256); i++){
+		count += ST->count[i];
+		cycles += ST->cycles[i];
+	}
+	if (!count) count = 1;
+	if (!cycles) cycles = 1;
+	
+	if (json){
+		fprintf(fp, "[\n");
+	}else{
+		fprintf(fp, "opcode,mode,count,cycles,count_pct,cycles_pct\n");
+	}
+	
+	for (uint32_t i = 0; i < (STATS_MODES * 256); i++){
+		if (!ST->count[i]) continue;
+		
+		if (json){
+			fprintf(fp, "%s\t{\"opcode\": %u, \"mode\": \"%s\", \"count\": %llu, \"cycles\": %llu, \"count_pct\": %.4f, \"cycles_pct\": %.4f}",
+				first ? "" : ",\n", i & 0xFF, statsModes[i >> 8], (unsigned long long)ST->count[i], (unsigned long long)ST->cycles[i],
+				ST->count[i] * 100.0 / count, ST->cycles[i] * 100.0 / cycles);
+		}else{
+			fprintf(fp, "0x%02X,%s,%llu,%llu,%.4f,%.4f\n", i & 0xFF, statsModes[i >> 8], (unsigned long long)ST->count[i],
+				(unsigned long long)ST->cycles[i], ST->count[i] * 100.0 / count, ST->cycles[i] * 100.0 / cycles);
+		}
+		first = false;
+	}
+	
+	if (json) fprintf(fp, "\n]\n");
+}
+#endif
+
+
+#ifdef __EMU_HEATMAP
+// Memory Heatmap ----------------------------------------------------------- //
+// Counts reads, writes and fetches per Page, and reads/writes plus the host time of the IO handlers per IO register
+
+// Allocates counters for the whole Memory and IO space of the CPU and attaches them to it
+// Returns false if there isn't enough memory
+bool cpuHeatmapInit(cpuState* CPU, cpuHeatmap* H){
+	memset(H, 0, sizeof(cpuHeatmap));
+	H->pages = (MES + HEAT_PAGE_SIZE - 1) >> HEAT_PAGE_BITS;
+	H->io_size = IOS;
+	H->reads = calloc(H->pages, sizeof(uint64_t));
+	H->writes = calloc(H->pages, sizeof(uint64_t));
+	H->fetches = calloc(H->pages, sizeof(uint64_t));
+	H->io = calloc(H->io_size ? H->io_size : 1, sizeof(cpuHeatIO));
+	
+	if (!H->reads || !H->writes || !H->fetches || !H->io){
+		cpuHeatmapFree(CPU, H);
+		return false;
+	}
+	
+	CPU->heat = H;
+	return true;
+}
+
+void cpuHeatmapReset(cpuHeatmap* H){
+	memset(H->reads, 0, H->pages * sizeof(uint64_t));
+	memset(H->writes, 0, H->pages * sizeof(uint64_t));
+	memset(H->fetches, 0, H->pages * sizeof(uint64_t));
+	memset(H->io, 0, H->io_size * sizeof(cpuHeatIO));
+}
+
+// Writes every Page that was accessed at least once as CSV, together with it's share of all accesses
+void cpuHeatmapDump(const cpuHeatmap* H, FILE* fp){
+	uint64_t total = 0, sum;
+	
+	for (uint32_t i = 0; i < H->pages; i++) total += H->reads[i] + H->writes[i] + H->fetches[i];
+	if (!total) total = 1;
+	
+	fprintf(fp, "page,reads,writes,fetches,pct\n");
+	for (uint32_t i = 0; i < H->pages; i++){
+		sum = H->reads[i] + H->writes[i] + H->fetches[i];
+		if (!sum) continue;
+		fprintf(fp, "0x%06lX,%llu,%llu,%llu,%.4f\n", i * HEAT_PAGE_SIZE, (unsigned long long)H->reads[i],
+			(unsigned long long)H->writes[i], (unsigned long long)H->fetches[i], sum * 100.0 / total);
+	}
+}
+
+// Writes every IO register that was accessed at least once as CSV, with the average host time per access
+void cpuHeatmapDumpIO(const cpuHeatmap* H, FILE* fp){
+	const cpuHeatIO *R;
+	
+	fprintf(fp, "offset,reads,writes,read_ns,write_ns,ns_per_read,ns_per_write\n");
+	for (uint32_t i = 0; i < H->io_size; i++){
+		R = &H->io[i];
+		if (!R->reads && !R->writes) continue;
+		fprintf(fp, "0x%04X,%llu,%llu,%llu,%llu,%.1f,%.1f\n", i, (unsigned long long)R->reads, (unsigned long long)R->writes,
+			(unsigned long long)R->read_ns, (unsigned long long)R->write_ns,
+			R->reads ? (double)R->read_ns / R->reads : 0.0, R->writes ? (double)R->write_ns / R->writes : 0.0);
+	}
+}
+
+// Detaches the heatmap from the CPU and frees it's counters
+void cpuHeatmapFree(cpuState* CPU, cpuHeatmap* H){
+	if (CPU->heat == H) CPU->heat = NULL;
+	
+	free(H->reads);
+	free(H->writes);
+	free(H->fetches);
+	free(H->io);
+	memset(H, 0, sizeof(cpuHeatmap));
+}
+#endif
+
+
+#ifdef __EMU_PERF
+// Performance Counters ----------------------------------------------------- //
+// The CPU counts into the live counters while it runs and publishes a copy at the end of every cpuRun (and every
+// lockstep run of a Batch), so a dashboard thread can read them at any time without stopping the CPU.
+
+// Clears the counters (only while the CPU isn't running)
+void cpuPerfReset(cpuPerf* P){
+	memset(P, 0, sizeof(cpuPerf));
+}
+
+// Reads the published counters, safe to call from any thread while the CPU is running
+// (retries if the CPU published a new copy in the meantime, so all counters in out are from the same moment)
+void cpuPerfRead(cpuPerf* P, cpuPerfCounters* out){
+	const uint64_t *src = (const uint64_t*)&P->pub;
+	uint64_t *dst = (uint64_t*)out;
+	uint32_t seq;
+	
+	do{
+		while ((seq = __atomic_load_n(&P->seq, __ATOMIC_ACQUIRE)) & 1) sched_yield();
+		for (uint32_t i = 0; i < (sizeof(cpuPerfCounters) / sizeof(uint64_t)); i++){
+			dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+		}
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	}while (__atomic_load_n(&P->seq, __ATOMIC_RELAXED) != seq);
+}
+#endif
+
+
+#ifdef __EMU_PROFILE
+// Profiler ----------------------------------------------------------------- //
+// Samples PB:PC together with a shadow call stack every "interval" cycles, see profSample.
+// The result is written as folded stacks ("outer;inner;leaf count"), which flamegraph.pl and speedscope read directly
+
+// Attaches the profiler to the CPU and clears it, the first sample is taken "interval" cycles from now
+// Returns false if there isn't enough memory for the stack table
+bool cpuProfileInit(cpuState* CPU, cpuProfile* P, uint32_t interval){
+	memset(P, 0, sizeof(cpuProfile));
+	P->interval = interval ? interval : 1;
+	P->next = CPU->cycle_count + P->interval;
+	if (!profGrow(P)) return false;
+	
+	CPU->prof = P;
+	return true;
+}
+
+// Parses a number as hex ("$C000", "0xC000", "00C000") or, with dec set, as decimal unless it has a hex prefix
+// A trailing ':' is allowed (listing addresses), returns false if the token isn't a number
+bool static profParseNum(const char* s, bool dec, uint32_t* out){
+	char *end;
+	int base = dec ? 10 : 16;
+	
+	if (*s == '$'){
+		s++;
+		base = 16;
+	}else if ((s[0] == '0') && ((s[1] == 'x') || (s[1] == 'X'))){
+		s += 2;
+		base = 16;
+	}
+	if (!isxdigit((unsigned char)*s)) return false;
+	
+	*out = strtoul(s, &end, base);
+	if (*end == ':') end++;
+	return !*end;
+}
+
+int static profCompareSyms(const void* a, const void* b){
+	const cpuProfileSymbol *sa = a, *sb = b;
+	
+	return (sa->addr > sb->addr) - (sa->addr < sb->addr);
+}
+
+// Loads symbols from a label or listing file, the formats below are recognized line by line, anything else is skipped:
+//   "al 00C000 .name"		(VICE label file, ie: ld65 -Ln)
+//   "name = $C000"			(symbol assignments, ie: 64tass --labels or ca65 exports)
+//   "C000 name"			(plain address/name lists, ie: WDC or nm style maps)
+//   "00C000 ... name:"		(listings, the first label on a line that starts with an address)
+// Leading dots are dropped and cheap local labels ("@name") are ignored. Can be called several times to merge files
+// Returns the amount of symbols loaded, or -1 if the file couldn't be read or there isn't enough memory
+int32_t cpuProfileLoadSymbols(cpuProfile* P, const char* path){
+	FILE *fp = fopen(path, "r");
+	char line[512], *tok[8], *name, *save;
+	uint32_t addr, n, len;
+	int32_t loaded = 0;
+	cpuProfileSymbol *tmp;
+	
+	if (!fp) return -1;
+	
+	while (fgets(line, sizeof(line), fp)){
+		n = 0;
+		for (char *t = strtok_r(line, " \t\r\n", &save); t && (n < 8); t = strtok_r(NULL, " \t\r\n", &save)) tok[n++] = t;
+		if (n < 2) continue;
+		
+		name = NULL;
+		if (!strcmp(tok[0], "al") && (n >= 3)){
+			if (profParseNum(tok[1], false, &addr)) name = tok[2];
+		}else if ((n >= 3) && !strcmp(tok[1], "=")){
+			if (profParseNum(tok[2], true, &addr)) name = tok[0];
+		}else if (profParseNum(tok[0], false, &addr)){
+			for (uint32_t i = 1; (i < n) && !name; i++){
+				len = strlen(tok[i]);
+				if ((len > 1) && (tok[i][len - 1] == ':')){
+					tok[i][len - 1] = 0;
+					name = tok[i];
+				}
+			}
+			if (!name && (n == 2)) name = tok[1];
+		}
+		
+		if (!name) continue;
+		if (*name == '.') name++;
+		if (!*name || (*name == '@') || isdigit((unsigned char)*name)) continue;
+		
+		if (!(P->sym_count & 0xFF)){
+			tmp = realloc(P->syms, (P->sym_count + 0x100) * sizeof(cpuProfileSymbol));
+			if (!tmp) break;
+			P->syms = tmp;
+		}
+		P->syms[P->sym_count].addr = addr & 0x00FFFFFF;
+		P->syms[P->sym_count].name = strdup(name);
+		if (!P->syms[P->sym_count].name) break;
+		P->sym_count++;
+		loaded++;
+	}
+	
+	if (ferror(fp)) loaded = -1;
+	fclose(fp);
+	qsort(P->syms, P->sym_count, sizeof(cpuProfileSymbol), profCompareSyms);
+	
+	return loaded;
+}
+
+// Writes the name of the closest symbol at or below addr, or the address itself if there is none
+void static profPrintFrame(const cpuProfile* P, uint32_t addr, FILE* fp){
+	uint32_t lo = 0, hi = P->sym_count;
+	
+	while (lo < hi){
+		if (P->syms[(lo + hi) / 2].addr <= addr){
+			lo = (lo + hi) / 2 + 1;
+		}else{
+			hi = (lo + hi) / 2;
+		}
+	}
+	
+	if (lo){
+		fputs(P->syms[lo - 1].name, fp);
+	}else{
+		fprintf(fp, "$%06X", addr);
+	}
+}
+
+// Writes every sampled stack in the folded format, one line each ("main;update;draw 1234")
+void cpuProfileDump(const cpuProfile* P, FILE* fp){
+	for (uint32_t i = 0; i < P->table_size; i++){
+		if (!P->table[i].hash) continue;
+		
+		for (uint32_t j = 0; j < P->table[i].len; j++){
+			if (j) fputc(';', fp);
+			profPrintFrame(P, P->table[i].frames[j], fp);
+		}
+		fprintf(fp, " %llu\n", (unsigned long long)P->table[i].count);
+	}
+}
+
+// Detaches the profiler from the CPU and frees it's tables and symbols
+void cpuProfileFree(cpuState* CPU, cpuProfile* P){
+	if (CPU->prof == P) CPU->prof = NULL;
+	
+	for (uint32_t i = 0; i < P->sym_count; i++) free(P->syms[i].name);
+	free(P->syms);
+	free(P->table);
+	memset(P, 0, sizeof(cpuProfile));
+}
+#endif
+
+
+#ifdef __EMU_FUZZ
+// Fuzzing ------------------------------------------------------------------ //
+// Persistent mode harness, every test case starts from the same Snapshot (which only copies back the Pages the last
+// case changed) instead of a new process or a full reload. Coverage goes into CPU->cov_map, see fuzzHit
+
+// Resets the CPU to BASE, copies the input to addr (unless data is NULL, ie: when the Host feeds it through IO)
+// and runs until the guest executes STP or WAI, or one of the conditions in RUN is met
+// Returns why the run stopped (RUN_*)
+uint8_t cpuFuzzRun(cpuState* CPU, cpuSnapshot* BASE, const uint8_t* data, uint32_t size, uint32_t addr, cpuRunCtl* RUN){
+	cpuSnapshotLoad(CPU, BASE);
+	CPU->cov_prev = 0;
+	
+	if (data){
+		if (addr > MES) addr = MES;
+		if (size > (MES - addr)) size = MES - addr;
+		memcpy(MEM + addr, data, size);
+		cpuMarkDirty(CPU, addr, size);
+	}
+	
+	return cpuRun(CPU, RUN);
+}
+#endif
+
+
+// Vectored Interrupt Controller -------------------------------------------- //
+// Collects the IRQ Lines of up to 32 Devices and drives a single IRQ Line of a CPU with them.
+// The Host maps it into its IO space by calling vicRead/vicWrite from its IO handlers,
+// the guest can then read VIC_VECTOR to jump straight to the handler of the Device (ie: "JMP (table,X)")
+
+// Recalculates the state of the CPU's IRQ Line
+void static inline vicUpdate(vicState* VIC){
+	if (VIC->lines & VIC->enable){
+		__atomic_store_n(&VIC->cpu->wai, false, __ATOMIC_RELAXED);
+		__atomic_fetch_or(&VIC->cpu->irq_line, (1UL << VIC->cpu_line), __ATOMIC_RELEASE);
+	}else{
+		__atomic_fetch_and(&VIC->cpu->irq_line, ~(1UL << VIC->cpu_line), __ATOMIC_RELEASE);		// (atomic, the other bits may belong to other devices)
+	}
+}
+
+void vicInit(vicState* VIC, cpuState* CPU, uint8_t cpuLine){
+	VIC->cpu = CPU;
+	VIC->lines = 0;
+	VIC->enable = 0;
+	VIC->cpu_line = cpuLine & 31U;
+	vicUpdate(VIC);
+}
+
+void vicAssert(vicState* VIC, uint8_t source){
+	VIC->lines |= (1UL << (source & 31U));
+	vicUpdate(VIC);
+}
+
+void vicDeassert(vicState* VIC, uint8_t source){
+	VIC->lines &= ~(1UL << (source & 31U));
+	vicUpdate(VIC);
 }
 
+uint8_t vicRead(vicState* VIC, uint32_t addr){
+	cint32_t tmp;
+	
+	switch(addr){
+		case VIC_PEND:
+		case VIC_PEND + 1:
+		case VIC_PEND + 2:
+		case VIC_PEND + 3:
+			tmp.l = VIC->lines & VIC->enable;
+		return tmp.l >> ((addr - VIC_PEND) * 8U);
+		
+		case VIC_ENABLE:
+		case VIC_ENABLE + 1:
+		case VIC_ENABLE + 2:
+		case VIC_ENABLE + 3:
+		return VIC->enable >> ((addr - VIC_ENABLE) * 8U);
+		
+		case VIC_VECTOR:	// Lowest numbered Source has the highest Priority
+			tmp.l = VIC->lines & VIC->enable;
+			if (!tmp.l) return VIC_NONE;
+		return __builtin_ctz(tmp.l) * 2U;
+		
+		default:
+		return 0;
+	}
+}
+
+void vicWrite(vicState* VIC, uint32_t addr, uint8_t val){
+	switch(addr){
+		case VIC_ENABLE:
+		case VIC_ENABLE + 1:
+		case VIC_ENABLE + 2:
+		case VIC_ENABLE + 3:
+			VIC->enable &= ~(0xFFUL << ((addr - VIC_ENABLE) * 8U));
+			VIC->enable |= ((uint32_t)val << ((addr - VIC_ENABLE) * 8U));
+			vicUpdate(VIC);
+		break;
+		
+		default:
+		break;
+	}
+}
+
+
+
+// Batch Engine ------------------------------------------------------------- //
+// Runs up to BATCH_LANES CPUs that execute the same code (ie: the same ROM with different inputs) in lockstep.
+// As long as all lanes are at the same PC, in the same mode, and their code Bytes match, every instruction is decoded
+// once and executed on all lanes together. The registers are kept in arrays (one entry per lane) and every operation
+// is a plain loop over all lanes, which the compiler turns into SIMD instructions (ie: -O3 -mavx2 or -mavx512bw).
+// Instructions that aren't supported in lockstep, memory accesses to IO, and branches the lanes don't agree on
+// are executed by the normal interpreter one lane at a time, afterwards the lanes that are still at the same PC
+// continue in lockstep. A lane that is left on it's own runs the rest of it's cycles in the normal interpreter.
+
+// Registers of the lanes in lockstep, in Structure of Arrays form
+typedef struct{
+	uint16_t a[BATCH_LANES];
+	uint16_t x[BATCH_LANES];
+	uint16_t y[BATCH_LANES];
+	uint16_t sp[BATCH_LANES];
+	uint16_t dp[BATCH_LANES];
+	uint8_t db[BATCH_LANES];
+	uint8_t c[BATCH_LANES];		// Flags (0 or 1)
+	uint8_t z[BATCH_LANES];
+	uint8_t v[BATCH_LANES];
+	uint8_t n[BATCH_LANES];
+	uint8_t act[BATCH_LANES];	// 1 if the lane is part of the lockstep group
+	
+	uint32_t ad0[BATCH_LANES];	// Address of the Low Byte of the memory operand
+	uint32_t ad1[BATCH_LANES];	// Address of the High Byte of the memory operand
+	uint16_t val[BATCH_LANES];	// Operand
+	
+	// Shared by all lanes
+	uint32_t lead;				// First lane of the group
+	cint16_t pc;
+	uint8_t pb;
+	bool fe, fm, fx, fd, fi;
+} batchLanes;
+
+void cpuBatchInit(cpuBatch* B){
+	memset(B, 0, sizeof(cpuBatch));
+}
+
+// Adds an already initialized CPU as a new lane, returns false if the Batch is full
+bool cpuBatchAdd(cpuBatch* B, cpuState* CPU){
+	if (B->count >= BATCH_LANES) return false;
+	B->cpu[B->count++] = CPU;
+	return true;
+}
+
+// Returns true if the CPU is in a state that can be run in lockstep (running, no interrupts, no debug output)
+// (a profiled CPU has to take it's samples at the right instruction, and the heatmap, the trace and the edge coverage
+// only see the accesses, instructions and jumps the interpreter makes, so those CPUs always run in the interpreter)
+bool static inline batchReady(cpuState* CPU){
+	#ifdef __EMU_PROFILE
+	if (CPU->prof) return false;
+	#endif
+	#ifdef __EMU_HEATMAP
+	if (CPU->heat) return false;
+	#endif
+	#ifdef __EMU_TRACE
+	if (CPU->trace) return false;
+	#endif
+	#ifdef __EMU_FUZZ
+	if (CPU->cov_map) return false;
+	#endif
+	return !CPU->stp && !CPU->wai && !INT && !(__atomic_load_n(&CPU->irq_line, __ATOMIC_RELAXED) && !IF) && !DBG;
+}
+
+// Returns true if both CPUs are at the same instruction in the same mode
+bool static inline batchMatch(cpuState* CPU, cpuState* lead){
+	return (PC.w == lead->reg_pc.w) && (PB == lead->reg_pb) && (EF == lead->fl_e) && (MF == lead->fl_m)
+		&& (XF == lead->fl_x) && (DF == lead->fl_d) && (IF == lead->fl_i);
+}
+
+void static batchGather(cpuBatch* B, batchLanes* L, cpuState* lead){
+	cpuState *CPU;
+	
+	for (uint32_t i = 0; i < B->count; i++){
+		if (!L->act[i]) continue;
+		CPU = B->cpu[i];
+		L->a[i] = A.w;
+		L->x[i] = X.w;
+		L->y[i] = Y.w;
+		L->sp[i] = SP.w;
+		L->dp[i] = DP.w;
+		L->db[i] = DB;
+		L->c[i] = CF;
+		L->z[i] = ZF;
+		L->v[i] = VF;
+		L->n[i] = NF;
+	}
+	
+	L->pc = lead->reg_pc;
+	L->pb = lead->reg_pb;
+	L->fe = lead->fl_e;
+	L->fm = lead->fl_m;
+	L->fx = lead->fl_x;
+	L->fd = lead->fl_d;
+	L->fi = lead->fl_i;
+}
+
+void static batchScatter(cpuBatch* B, batchLanes* L, uint64_t cycles){
+	cpuState *CPU;
+	
+	for (uint32_t i = 0; i < B->count; i++){
+		if (!L->act[i]) continue;
+		CPU = B->cpu[i];
+		A.w = L->a[i];
+		X.w = L->x[i];
+		Y.w = L->y[i];
+		SP.w = L->sp[i];
+		DP.w = L->dp[i];
+		DB = L->db[i];
+		CF = L->c[i];
+		ZF = L->z[i];
+		VF = L->v[i];
+		NF = L->n[i];
+		PC = L->pc;
+		PB = L->pb;
+		MF = L->fm;
+		XF = L->fx;
+		DF = L->fd;
+		CPU->cycle_count += cycles;
+	}
+}
+
+#ifdef __EMU_PERF
+// Counts a lockstep run for every lane that took part and publishes it, the host time is split evenly between them
+void static batchPerf(cpuBatch* B, batchLanes* L, uint64_t instructions, int32_t cycles, uint64_t ns){
+	cpuPerf *P;
+	
+	for (uint32_t i = 0; i < B->count; i++){
+		P = B->cpu[i]->perf;
+		if (!L->act[i] || !P) continue;
+		P->live.instructions += instructions;
+		P->live.cycles += cycles;
+		P->live.host_ns += ns;
+		perfPublish(P);
+	}
+}
+#endif
+
+// Reads the next 4 Bytes of code (Opcode and up to 3 Operand Bytes) from every lane
+// Returns false if the lanes don't agree on them or the code isn't in plain Memory
+bool static batchFetch(cpuBatch* B, batchLanes* L, uint32_t* code){
+	uint32_t ad = ((uint32_t)L->pb << 16U) | L->pc.w;
+	uint32_t tmp;
+	bool first = true;
+	cpuState *CPU;
+	
+	if (L->pc.w > 0xFFFC) return false;		// The Operands would wrap around within the Bank
+	
+	for (uint32_t i = 0; i < B->count; i++){
+		if (!L->act[i]) continue;
+		CPU = B->cpu[i];
+		if ((ad + 4) > MES) return false;
+		if (((ad + 4) > IOB) && (ad < (IOB + IOS))) return false;
+		
+		tmp = MEM[ad] | (MEM[ad + 1] << 8U) | (MEM[ad + 2] << 16U) | ((uint32_t)MEM[ad + 3] << 24U);
+		if (first){
+			*code = tmp;
+			first = false;
+		}else if (tmp != *code){
+			return false;
+		}
+	}
+	
+	return true;
+}
+
+// Returns false if an Address of any lane is outside of Memory or inside the IO block
+bool static batchCheck(cpuBatch* B, batchLanes* L, bool wide){
+	cpuState *CPU;
+	
+	for (uint32_t i = 0; i < B->count; i++){
+		if (!L->act[i]) continue;
+		CPU = B->cpu[i];
+		if ((L->ad0[i] >= MES) || chkIO(L->ad0[i])) return false;
+		if (wide && ((L->ad1[i] >= MES) || chkIO(L->ad1[i]))) return false;
+	}
+	
+	return true;
+}
+
+// Direct Page Addresses of every lane (same as addrDP)
+bool static batchAddrDP(cpuBatch* B, batchLanes* L, uint8_t op, bool wide){
+	for (uint32_t i = 0; i < BATCH_LANES; i++){
+		if (L->fe && !(L->dp[i] & 0x00FF)){
+			L->ad0[i] = (L->dp[i] & 0xFF00) | op;
+			L->ad1[i] = (L->dp[i] & 0xFF00) | ((op + 1) & 0x00FF);
+		}else{
+			L->ad0[i] = (L->dp[i] + op) & 0x0000FFFF;
+			L->ad1[i] = (L->dp[i] + op + 1) & 0x0000FFFF;
+		}
+	}
+	return batchCheck(B, L, wide);
+}
+
+// Absolute Addresses of every lane (same as addrAbs)
+bool static batchAddrAbs(cpuBatch* B, batchLanes* L, uint16_t op, bool wide){
+	for (uint32_t i = 0; i < BATCH_LANES; i++){
+		L->ad0[i] = (op + ((uint32_t)L->db[i] << 16U)) & 0x00FFFFFF;
+		L->ad1[i] = (op + 1 + ((uint32_t)L->db[i] << 16U)) & 0x00FFFFFF;
+	}
+	return batchCheck(B, L, wide);
+}
+
+// Stack Addresses of the 2 Bytes a JSR pushes (push = true) or a RTS pulls (same as pushStack/pullStack)
+bool static batchAddrStack(cpuBatch* B, batchLanes* L, bool push){
+	uint16_t lo = push ? -1 : 1;
+	uint16_t hi = push ? 0 : 2;
+	
+	for (uint32_t i = 0; i < BATCH_LANES; i++){
+		if (L->fe){
+			L->ad0[i] = 0x0100 | ((L->sp[i] + lo) & 0x00FF);
+			L->ad1[i] = 0x0100 | ((L->sp[i] + hi) & 0x00FF);
+		}else{
+			L->ad0[i] = (L->sp[i] + lo) & 0xFFFF;
+			L->ad1[i] = (L->sp[i] + hi) & 0xFFFF;
+		}
+	}
+	return batchCheck(B, L, true);
+}
+
+// Reads the operand of every lane from ad0/ad1 (only call after the Addresses were checked)
+void static batchRead(cpuBatch* B, batchLanes* L, bool wide){
+	cpuState *CPU;
+	
+	for (uint32_t i = 0; i < B->count; i++){
+		if (!L->act[i]) continue;
+		CPU = B->cpu[i];
+		L->val[i] = MEM[L->ad0[i]];
+		if (wide) L->val[i] |= MEM[L->ad1[i]] << 8U;
+	}
+}
+
+// Writes a register of every lane to ad0/ad1 (only call after the Addresses were checked)
+void static batchWrite(cpuBatch* B, batchLanes* L, const uint16_t* src, bool wide){
+	cpuState *CPU;
+	
+	for (uint32_t i = 0; i < B->count; i++){
+		if (!L->act[i]) continue;
+		CPU = B->cpu[i];
+		markDirty(CPU, L->ad0[i]);
+		MEM[L->ad0[i]] = src[i];
+		if (wide){
+			markDirty(CPU, L->ad1[i]);
+			MEM[L->ad1[i]] = src[i] >> 8U;
+		}
+	}
+}
+
+// Same Operand for every lane
+void static inline batchImm(batchLanes* L, uint16_t op){
+	for (uint32_t i = 0; i < BATCH_LANES; i++) L->val[i] = op;
+}
+
+// Sets N and Z of every lane from a result
+void static inline batchNZ(batchLanes* L, bool flag, uint32_t i, uint16_t res){
+	L->n[i] = flag ? ((res >> 7U) & 1U) : (res >> 15U);
+	L->z[i] = flag ? !(res & 0x00FF) : !res;
+}
+
+// Loads the Operand into a register (LDA, LDX, LDY), also used for transfers (TAX, TXY, etc.)
+void static batchLoad(batchLanes* L, uint16_t* dst, const uint16_t* src, bool flag){
+	for (uint32_t i = 0; i < BATCH_LANES; i++){
+		dst[i] = flag ? ((dst[i] & 0xFF00) | (src[i] & 0x00FF)) : src[i];
+		batchNZ(L, flag, i, dst[i]);
+	}
+}
+
+// Adds delta to a register (INX, DEX, INY, DEY, INC, DEC)
+void static batchStep(batchLanes* L, uint16_t* r, bool flag, uint16_t delta){
+	for (uint32_t i = 0; i < BATCH_LANES; i++){
+		r[i] = flag ? ((r[i] & 0xFF00) | ((r[i] + delta) & 0x00FF)) : (r[i] + delta);
+		batchNZ(L, flag, i, r[i]);
+	}
+}
+
+// Compares a register with the Operand (CMP, CPX, CPY)
+void static batchCompare(batchLanes* L, const uint16_t* r, bool flag){
+	uint16_t mask = flag ? 0x00FF : 0xFFFF;
+	
+	for (uint32_t i = 0; i < BATCH_LANES; i++){
+		L->c[i] = (r[i] & mask) >= (L->val[i] & mask);
+		batchNZ(L, flag, i, (r[i] - L->val[i]) & mask);
+	}
+}
+
+// Binary ADC/SBC, AND, ORA, EOR with the Operand (same as g1ALU with D cleared)
+void static batchALU(batchLanes* L, uint8_t op){
+	uint16_t mask = L->fm ? 0x00FF : 0xFFFF;
+	uint32_t sign = L->fm ? 0x0080 : 0x8000;
+	uint32_t res;
+	
+	switch(op){
+		case ALU_SBC:
+			for (uint32_t i = 0; i < BATCH_LANES; i++) L->val[i] = ~L->val[i];
+		case ALU_ADC:
+			for (uint32_t i = 0; i < BATCH_LANES; i++){
+				res = (uint32_t)(L->a[i] & mask) + (L->val[i] & mask) + L->c[i];
+				L->c[i] = res > mask;
+				L->v[i] = !!((~(L->a[i] ^ L->val[i])) & (L->a[i] ^ res) & sign);
+				L->val[i] = res;
+			}
+		break;
+		
+		case ALU_AND:
+			for (uint32_t i = 0; i < BATCH_LANES; i++) L->val[i] &= L->a[i];
+		break;
+		
+		case ALU_ORA:
+			for (uint32_t i = 0; i < BATCH_LANES; i++) L->val[i] |= L->a[i];
+		break;
+		
+		default:
+			for (uint32_t i = 0; i < BATCH_LANES; i++) L->val[i] ^= L->a[i];
+		break;
+	}
+	
+	batchLoad(L, L->a, L->val, L->fm);
+}
+
+// ASL, ROL, LSR, ROR on the Accumulator (same as g2ALU)
+void static batchShift(batchLanes* L, uint8_t op){
+	uint16_t mask = L->fm ? 0x00FF : 0xFFFF;
+	uint16_t top = L->fm ? 7 : 15;
+	uint32_t in, res;
+	
+	for (uint32_t i = 0; i < BATCH_LANES; i++){
+		in = L->a[i] & mask;
+		if (op == ALU_ASL || op == ALU_ROL){
+			res = (in << 1U) | ((op == ALU_ROL) ? L->c[i] : 0);
+			L->c[i] = (in >> top) & 1U;
+		}else{
+			res = (in >> 1U) | ((op == ALU_ROR) ? ((uint32_t)L->c[i] << top) : 0);
+			L->c[i] = in & 1U;
+		}
+		L->a[i] = (L->a[i] & ~mask) | (res & mask);
+		batchNZ(L, L->fm, i, L->a[i]);
+	}
+}
+
+// Returns 1 if all lanes take the branch, 0 if none do, and -1 if they disagree
+int32_t static batchBranch(cpuBatch* B, batchLanes* L, uint8_t opcode){
+	const uint8_t *flag;
+	uint32_t taken = 0, cnt = 0;
+	
+	switch(opcode >> 6U){	// Flag to check is in bits 6-7 of the opcode, the value to check for in bit 5
+		case 0: flag = L->n; break;
+		case 1: flag = L->v; break;
+		case 2: flag = L->c; break;
+		default: flag = L->z; break;
+	}
+	
+	for (uint32_t i = 0; i < B->count; i++){
+		taken += L->act[i] & (flag[i] == !!(opcode & 0b00100000));
+		cnt += L->act[i];
+	}
+	
+	if (taken == cnt) return 1;
+	if (!taken) return 0;
+	return -1;
+}
+
+// Executes instructions on all lanes in L until one can't be executed in lockstep or the cycles run out
+// Returns the amount of cycles used
+int32_t static batchRun(cpuBatch* B, batchLanes* L, int32_t cycles){
+	int32_t used = 0;
+	uint32_t code = 0;
+	uint8_t opcode, op8, len;
+	uint16_t op16, idx;
+	bool wide;
+	
+	while (used < cycles){
+		if (!batchFetch(B, L, &code)) break;
+		opcode = code;
+		op8 = code >> 8U;
+		op16 = code >> 8U;
+		wide = !L->fm;
+		len = 1;
+		
+		switch(opcode){
+			// Flags
+			case OP_NOP: break;
+			case OP_CLC: memset(L->c, 0, sizeof(L->c)); break;
+			case OP_SEC: memset(L->c, 1, sizeof(L->c)); break;
+			case OP_CLV: memset(L->v, 0, sizeof(L->v)); break;
+			
+			case OP_REP_IM:
+			case OP_SEP_IM:
+				if (op8 & 0x04) goto stop;		// Changing I could let an IRQ in, leave that to the interpreter
+				for (uint32_t i = 0; i < BATCH_LANES; i++){
+					if (op8 & 0x01) L->c[i] = (opcode == OP_SEP_IM);
+					if (op8 & 0x02) L->z[i] = (opcode == OP_SEP_IM);
+					if (op8 & 0x40) L->v[i] = (opcode == OP_SEP_IM);
+					if (op8 & 0x80) L->n[i] = (opcode == OP_SEP_IM);
+				}
+				if (op8 & 0x08) L->fd = (opcode == OP_SEP_IM);
+				if (!L->fe){	// In Emulation mode M and X stay set
+					if (op8 & 0x10) L->fx = (opcode == OP_SEP_IM);
+					if (op8 & 0x20) L->fm = (opcode == OP_SEP_IM);
+				}
+				if (L->fx){
+					for (uint32_t i = 0; i < BATCH_LANES; i++){
+						L->x[i] &= 0x00FF;
+						L->y[i] &= 0x00FF;
+					}
+				}
+				len = 2;
+			break;
+			
+			// Transfers
+			case OP_TAX: batchLoad(L, L->x, L->a, L->fx); break;
+			case OP_TAY: batchLoad(L, L->y, L->a, L->fx); break;
+			case OP_TXA: batchLoad(L, L->a, L->x, L->fm); break;
+			case OP_TYA: batchLoad(L, L->a, L->y, L->fm); break;
+			case OP_TXY: batchLoad(L, L->y, L->x, L->fx); break;
+			case OP_TYX: batchLoad(L, L->x, L->y, L->fx); break;
+			
+			// Increment/Decrement
+			case OP_INX: batchStep(L, L->x, L->fx, 1); break;
+			case OP_DEX: batchStep(L, L->x, L->fx, -1); break;
+			case OP_INY: batchStep(L, L->y, L->fx, 1); break;
+			case OP_DEY: batchStep(L, L->y, L->fx, -1); break;
+			case OP_INC: batchStep(L, L->a, L->fm, 1); break;
+			case OP_DEC: batchStep(L, L->a, L->fm, -1); break;
+			
+			// Shifts on the Accumulator
+			case OP_ASL:
+			case OP_ROL:
+			case OP_LSR:
+			case OP_ROR:
+				batchShift(L, aaa(opcode));
+			break;
+			
+			// Immediate
+			case OP_LDA_IM:
+			case OP_LDX_IM:
+			case OP_LDY_IM:
+			case OP_CPX_IM:
+			case OP_CPY_IM:
+				wide = (opcode == OP_LDA_IM) ? !L->fm : !L->fx;
+				batchImm(L, wide ? op16 : op8);
+				len = wide ? 3 : 2;
+				switch(opcode){
+					case OP_LDA_IM: batchLoad(L, L->a, L->val, L->fm); break;
+					case OP_LDX_IM: batchLoad(L, L->x, L->val, L->fx); break;
+					case OP_LDY_IM: batchLoad(L, L->y, L->val, L->fx); break;
+					case OP_CPX_IM: batchCompare(L, L->x, L->fx); break;
+					default: batchCompare(L, L->y, L->fx); break;
+				}
+			break;
+			
+			case OP_ADC_IM:
+			case OP_SBC_IM:
+			case OP_AND_IM:
+			case OP_ORA_IM:
+			case OP_XOR_IM:
+			case OP_CMP_IM:
+				if (L->fd && ((opcode == OP_ADC_IM) || (opcode == OP_SBC_IM))) goto stop;		// Decimal mode is left to the interpreter
+				batchImm(L, wide ? op16 : op8);
+				len = wide ? 3 : 2;
+				if (opcode == OP_CMP_IM){
+					batchCompare(L, L->a, L->fm);
+				}else{
+					batchALU(L, aaa(opcode));
+				}
+			break;
+			
+			// Loads and Stores (Direct Page and Absolute)
+			case OP_LDA_DP:
+			case OP_LDX_DP:
+			case OP_LDY_DP:
+			case OP_STA_DP:
+			case OP_STX_DP:
+			case OP_STY_DP:
+			case OP_STZ_DP:
+			case OP_LDA_A:
+			case OP_LDX_A:
+			case OP_LDY_A:
+			case OP_STA_A:
+			case OP_STX_A:
+			case OP_STY_A:
+			case OP_STZ_A:
+				if ((opcode & 0x03) != 0x01) wide = !L->fx;		// X and Y opcodes end in 00 or 10 (except STZ)
+				if (opcode == OP_STZ_DP || opcode == OP_STZ_A) wide = !L->fm;
+				if (!(opcode & 0x08)){		// Direct Page opcodes have bit 3 cleared
+					if (!batchAddrDP(B, L, op8, wide)) goto stop;
+					len = 2;
+				}else{
+					if (!batchAddrAbs(B, L, op16, wide)) goto stop;
+					len = 3;
+				}
+				switch(opcode){
+					case OP_LDA_DP: case OP_LDA_A: batchRead(B, L, wide); batchLoad(L, L->a, L->val, L->fm); break;
+					case OP_LDX_DP: case OP_LDX_A: batchRead(B, L, wide); batchLoad(L, L->x, L->val, L->fx); break;
+					case OP_LDY_DP: case OP_LDY_A: batchRead(B, L, wide); batchLoad(L, L->y, L->val, L->fx); break;
+					case OP_STA_DP: case OP_STA_A: batchWrite(B, L, L->a, wide); break;
+					case OP_STX_DP: case OP_STX_A: batchWrite(B, L, L->x, wide); break;
+					case OP_STY_DP: case OP_STY_A: batchWrite(B, L, L->y, wide); break;
+					default: batchImm(L, 0); batchWrite(B, L, L->val, wide); break;
+				}
+			break;
+			
+			// Branches and Jumps
+			case OP_BPL_R:
+			case OP_BMI_R:
+			case OP_BVC_R:
+			case OP_BVS_R:
+			case OP_BCC_R:
+			case OP_BCS_R:
+			case OP_BNE_R:
+			case OP_BEQ_R:
+				switch(batchBranch(B, L, opcode)){
+					case 1: L->pc.w += (int8_t)op8; break;
+					case 0: break;
+					default: goto stop;		// The lanes go seperate ways
+				}
+				len = 2;
+			break;
+			
+			case OP_BRA_R:
+				L->pc.w += (int8_t)op8;
+				len = 2;
+			break;
+			
+			case OP_JMP_A:
+				L->pc.w = op16 - 3;
+				len = 3;
+			break;
+			
+			case OP_JSR_A:
+				if (!batchAddrStack(B, L, true)) goto stop;
+				batchImm(L, L->pc.w + 2);
+				batchWrite(B, L, L->val, true);
+				for (uint32_t i = 0; i < BATCH_LANES; i++){
+					L->sp[i] = L->fe ? (0x0100 | ((L->sp[i] - 2) & 0x00FF)) : (L->sp[i] - 2);
+				}
+				L->pc.w = op16 - 3;
+				len = 3;
+			break;
+			
+			case OP_RTS:
+				if (!batchAddrStack(B, L, false)) goto stop;
+				batchRead(B, L, true);
+				for (uint32_t i = 0; i < B->count; i++){		// All lanes have to return to the same place
+					if (L->act[i] && (L->val[i] != L->val[L->lead])) goto stop;
+				}
+				for (uint32_t i = 0; i < BATCH_LANES; i++){
+					L->sp[i] = L->fe ? (0x0100 | ((L->sp[i] + 2) & 0x00FF)) : (L->sp[i] + 2);
+				}
+				L->pc.w = L->val[L->lead];
+			break;
+			
+			default:
+			goto stop;
+		}
+		
+		L->pc.w += len;
+		idx = (L->fe ? 0x0400 : ((L->fm ? 0x0200 : 0x0000) | (L->fx ? 0x0100 : 0x0000))) | opcode;
+		used += cycleTable[idx];
+		B->lockstep++;
+		
+		#ifdef __EMU_STATS
+		for (uint32_t i = 0; i < B->count; i++){
+			if (!L->act[i] || !B->cpu[i]->stats) continue;
+			B->cpu[i]->stats->count[idx]++;
+			B->cpu[i]->stats->cycles[idx] += cycleTable[idx];
+		}
+		#endif
+	}
+	
+	stop:
+	return used;
+}
+
+// Runs every lane of the Batch for a set amount of cycles, what every lane didn't use is stored in B->rem
+// (the lanes end up in exactly the same state as if cpuExecute was called on each of them)
+void cpuBatchExecute(cpuBatch* B, int32_t cycles){
+	batchLanes L;
+	cpuRunCtl RUN;
+	cpuState *lead;
+	bool done[BATCH_LANES] = {false};
+	uint32_t cnt;
+	int32_t budget, used;
+	#ifdef __EMU_PERF
+	uint64_t perfStart, perfSteps;
+	#endif
+	
+	// Like cpuExecute a budget of 0 or less still runs one instruction, which isn't worth gathering the lanes for
+	if (cycles <= 0){
+		for (uint32_t i = 0; i < B->count; i++){
+			RUN = (cpuRunCtl){.cycles = cycles};
+			cpuRun(B->cpu[i], &RUN);
+			B->rem[i] = RUN.cycle_rem;
+			B->scalar += RUN.executed;
+		}
+		return;
+	}
+	
+	memset(&L, 0, sizeof(L));
+	for (uint32_t i = 0; i < B->count; i++) B->rem[i] = cycles;
+	
+	while(1){
+		// The first lane that isn't done yet leads the group
+		lead = NULL;
+		for (uint32_t i = 0; i < B->count; i++){
+			if (B->rem[i] <= 0) done[i] = true;
+			if (!done[i] && !lead){
+				lead = B->cpu[i];
+				L.lead = i;
+			}
+		}
+		if (!lead) break;
+		
+		// Collect all lanes that are at the same instruction as the leader
+		memset(L.act, 0, sizeof(L.act));
+		cnt = 0;
+		budget = B->rem[L.lead];
+		if (batchReady(lead)){
+			for (uint32_t i = L.lead; i < B->count; i++){
+				if (!done[i] && batchReady(B->cpu[i]) && batchMatch(B->cpu[i], lead)){
+					L.act[i] = 1;
+					cnt++;
+					if (B->rem[i] < budget) budget = B->rem[i];
+				}
+			}
+		}
+		
+		// A lane on it's own runs the rest of it's cycles in the interpreter
+		if (cnt < 2){
+			RUN = (cpuRunCtl){.cycles = B->rem[L.lead]};
+			cpuRun(lead, &RUN);
+			B->rem[L.lead] = RUN.cycle_rem;
+			B->scalar += RUN.executed;
+			done[L.lead] = true;
+			continue;
+		}
+		
+		#ifdef __EMU_PERF
+		perfStart = cpuNowNs();
+		perfSteps = B->lockstep;
+		#endif
+		
+		batchGather(B, &L, lead);
+		used = batchRun(B, &L, budget);
+		batchScatter(B, &L, used);
+		
+		#ifdef __EMU_PERF
+		batchPerf(B, &L, B->lockstep - perfSteps, used, (cpuNowNs() - perfStart) / cnt);
+		#endif
+		
+		for (uint32_t i = 0; i < B->count; i++){
+			if (!L.act[i]) continue;
+			B->rem[i] -= used;
+			
+			// The lockstep run stopped at an instruction it can't handle, so every lane executes that one on it's own
+			if ((used < budget) && (B->rem[i] > 0)){
+				RUN = (cpuRunCtl){.cycles = B->rem[i], .instructions = 1};
+				cpuRun(B->cpu[i], &RUN);
+				B->rem[i] = RUN.cycle_rem;
+				B->scalar += RUN.executed;
+			}
+		}
+	}
+}
@@ -11,6 +11,105 @@
 #define cpuSendNMI(c)		c.wai = 0; if (c.interrupt < 2) c.interrupt = 2
 // #define cpuSendABT(c)		c.wai = 0; if (c.interrupt < 3) c.interrupt = 3
 
+#define chkCycles(c)		(c.cycle_count)
+
+// Atomic, so other devices (or host threads) driving their own bits at the same time can't undo the change
+#define cpuAssertIRQ(c,n)	(__atomic_store_n(&c.wai, 0, __ATOMIC_RELAXED), __atomic_fetch_or(&c.irq_line, (1UL << (n)), __ATOMIC_RELEASE))
+#define cpuDeassertIRQ(c,n)	(__atomic_fetch_and(&c.irq_line, ~(1UL << (n)), __ATOMIC_RELEASE))
+
+// cpuRun stop reasons
+enum{
+	RUN_CYCLES,			// Cycle budget used up
+	RUN_INSTRUCTIONS,	// Instruction budget used up
+	RUN_DEADLINE,		// Cycle deadline reached
+	RUN_BREAKPOINT,		// Reached one of the breakpoints
+	RUN_WAI,			// The CPU is waiting for an interrupt
+	RUN_STP				// The CPU is stopped
+};
+
+#define RUN_UNLIMITED		INT32_MAX
+
+// Granularity of the dirty Page tracking used by Snapshots
+#define MEM_PAGE_SHIFT		8
+#define MEM_PAGE_SIZE		(1UL << MEM_PAGE_SHIFT)
+#define MEM_PAGES(s)		(((s) + MEM_PAGE_SIZE - 1) >> MEM_PAGE_SHIFT)
+#define SNAP_MAX			8		// Snapshots that can be used with a CPU at the same time
+
+// Vectored Interrupt Controller Registers (relative to wherever the Host maps the Controller)
+#define VIC_PEND			0x00	// Pending (and enabled) Sources, 32-bit, read only
+#define VIC_ENABLE			0x04	// Enable Mask, 32-bit, read/write
+#define VIC_VECTOR			0x08	// 2 * Number of the highest Priority pending Source, or VIC_NONE, read only
+#define VIC_SIZE			0x09
+
+#define VIC_NONE			0x80
+
+#define BATCH_LANES			16		// CPUs per Batch, a multiple of the SIMD width of the host
+
+// Processor modes of the execution statistics (e = emulation, m = memory/accu, x = index registers)
+enum{
+	STATS_MODE_M16X16,	// e0 m0 x0
+	STATS_MODE_M16X8,	// e0 m0 x1
+	STATS_MODE_M8X16,	// e0 m1 x0
+	STATS_MODE_M8X8,	// e0 m1 x1
+	STATS_MODE_EMU,		// e1
+	STATS_MODES
+};
+
+#define HEAT_PAGE_BITS		8		// The heatmap counts accesses per 256 Byte Page
+#define HEAT_PAGE_SIZE		(1UL << HEAT_PAGE_BITS)
+
+#define PROF_DEPTH			32		// Call depth the profiler keeps track of
+
+#define DIFF_HISTORY		16		// Steps the lockstep checker shows before a divergence
+#define DIFF_IO_MAX			256		// IO accesses per step the lockstep checker can replay
+
+#define TRACE_MAGIC			0x36315254	// "TR16", first 4 Bytes of a trace file
+#define TRACE_VERSION		1			// Followed by the version and the record size (2 Bytes each), then the records
+
+#define FUZZ_MAP_BITS		16
+#define FUZZ_MAP_SIZE		(1UL << FUZZ_MAP_BITS)	// Size of the coverage bitmap, same as AFL's default
+
+#define CPU_ALIGN			64		// Alignment (and padding) of CPUs allocated from an Arena, the size of a cache line
+
+// Backing of an Arena
+enum{
+	ARENA_SMALL,		// Normal pages
+	ARENA_THP,			// Transparent huge pages (the kernel uses them where it can)
+	ARENA_HUGETLB		// Reserved huge pages
+};
+
+// Addressing modes of the Disassembler (emu65816_disasm.c)
+enum{
+	DIS_IMP,		// Implied
+	DIS_ACC,		// Accumulator
+	DIS_IMM_M,		// Immediate, 8 or 16 bit depending on M
+	DIS_IMM_X,		// Immediate, 8 or 16 bit depending on X
+	DIS_IMM8,		// Immediate, always 8 bit (BRK, COP)
+	DIS_SIG,		// Signature Byte that isn't printed (WDM)
+	DIS_FLAGS,		// REP/SEP, printed in binary
+	DIS_DP,
+	DIS_DPX,
+	DIS_DPY,
+	DIS_DPI,		// (dp)
+	DIS_DPIX,		// (dp,X)
+	DIS_DPIY,		// (dp),Y
+	DIS_DPIL,		// [dp]
+	DIS_DPILY,		// [dp],Y
+	DIS_ABS,
+	DIS_ABSX,
+	DIS_ABSY,
+	DIS_ABSI,		// (abs)
+	DIS_ABSIX,		// (abs,X)
+	DIS_LONG,
+	DIS_LONGX,
+	DIS_SR,			// sr,S
+	DIS_SRIY,		// (sr,S),Y
+	DIS_REL,		// 8 bit relative (branches)
+	DIS_RELL,		// 16 bit relative (BRL)
+	DIS_PUSH,		// 16 bit immediate pushed onto the stack (PEA, PER)
+	DIS_MOVE		// Block moves (dst,src)
+};
+
 
 #define MEM					(CPU->mem)
 #define MES					(CPU->mem_size)
@@ -138,11 +237,359 @@ typedef struct{
 	bool wai;			// WAI Instruction
 	bool stp;			// STP Instruction
 	uint8_t interrupt;	// Interrupt value (0 = no interrupts pending, 1 = IRQ, 2 = NMI, 3 = ABORT)
+	uint32_t irq_line;	// Level-triggered IRQ Line, one bit per IRQ source (taken while any bit is set and I is cleared)
+	
+	uint64_t cycle_count;	// Total amount of Cycles executed since cpuInit
+	
+	uint8_t *dirty_map;		// One Byte per memory Page, bit n is set once the Page was written to since Snapshot n was saved/loaded (NULL = no tracking)
+	uint8_t dirty_mask;		// Bits of all Snapshots in use
+	struct cpuSnapshot *snaps[SNAP_MAX];	// Snapshots in use, by their bit number
+	
+	// The fields of the optional instrumentation exist in every build, so the layout of cpuState is the same for the
+	// library and every program or object using it, no matter which __EMU_* options they were built with
+	struct cpuStats *stats;	// Execution statistics (NULL = not counted, only used with __EMU_STATS)
+	struct cpuHeatmap *heat;	// Memory and IO access counters (NULL = not counted, only used with __EMU_HEATMAP)
+	struct cpuPerf *perf;		// Runtime performance counters (NULL = not counted, only used with __EMU_PERF)
+	struct cpuTrace *trace;		// Binary execution trace (NULL = not traced, only used with __EMU_TRACE)
+	struct cpuProfile *prof;	// Sampling profiler (NULL = not profiled, only used with __EMU_PROFILE)
+	uint8_t *cov_map;		// AFL style edge coverage bitmap of FUZZ_MAP_SIZE Bytes (NULL = no coverage, only used with __EMU_FUZZ)
+	uint32_t cov_prev;		// Previous location, shifted right by one
 	
 } cpuState;
 
+#ifdef __EMU_STATS
+// Execution statistics, indexed like the cycle table: mode * 256 + opcode (see STATS_MODE_*)
+typedef struct cpuStats{
+	uint64_t count[STATS_MODES * 256];		// Times every opcode was executed in every mode
+	uint64_t cycles[STATS_MODES * 256];		// Cycles they were charged
+} cpuStats;
+#endif
+
+#ifdef __EMU_HEATMAP
+// Accesses to a single IO register, and the host time spent in the io_read/io_write handlers for it
+typedef struct{
+	uint64_t reads;
+	uint64_t writes;
+	uint64_t read_ns;
+	uint64_t write_ns;
+} cpuHeatIO;
+
+// Access counters per Page of HEAT_PAGE_SIZE Bytes and per IO register
+typedef struct cpuHeatmap{
+	uint64_t *reads;		// Data reads (including the stack)
+	uint64_t *writes;		// Data writes (including the stack)
+	uint64_t *fetches;		// Opcode and operand fetches
+	uint32_t pages;
+	cpuHeatIO *io;			// Indexed by the offset into the IO space
+	uint32_t io_size;
+} cpuHeatmap;
+#endif
+
+#ifdef __EMU_PERF
+// Totals since the counters were reset
+typedef struct{
+	uint64_t instructions;	// Instructions retired
+	uint64_t cycles;		// Cycles executed
+	uint64_t interrupts;	// IRQs, NMIs and ABORTs taken (BRK and COP are instructions)
+	uint64_t io_reads;		// Calls of the io_read handler
+	uint64_t io_writes;		// Calls of the io_write handler
+	uint64_t wai_cycles;	// Cycles handed to cpuExecute/cpuRun that were left over because the CPU waited in WAI
+	uint64_t host_ns;		// Host time spent inside cpuExecute/cpuRun
+} cpuPerfCounters;
+
+// Runtime performance counters, the CPU counts into live and publishes a copy at the end of every cpuRun, and every
+// 65536 instructions during long ones
+// (so another thread can read a consistent set with cpuPerfRead while the CPU keeps running)
+typedef struct cpuPerf{
+	cpuPerfCounters live;	// Only touched by the thread running the CPU
+	cpuPerfCounters pub;	// Published copy, guarded by seq
+	uint32_t seq;			// Odd while pub is being updated
+} cpuPerf;
+#endif
+
+#ifdef __EMU_TRACE
+// One executed instruction together with the registers from before it ran (32 Bytes)
+typedef struct{
+	uint64_t cycle;			// cycle_count at the start of the instruction
+	uint32_t pc;			// PB:PC of the opcode
+	uint8_t opcode;
+	uint8_t operand[3];		// The 3 Bytes after the opcode, however many it uses (0 if they are in IO space)
+	uint16_t a, x, y, sp, dp;
+	uint8_t db;
+	uint8_t sr;				// Status Register, like PHP pushes it
+	uint8_t e;				// Emulation Flag
+	uint8_t pad;
+} cpuTraceRec;
+
+// Ring of trace records, the CPU fills it and a writer thread drains it into a file (see emu65816_trace.c)
+typedef struct cpuTrace{
+	cpuTraceRec *buf;
+	uint32_t mask;			// Amount of records - 1 (always a power of 2)
+	bool lossy;				// Drop records while the ring is full instead of waiting for the writer
+	uint64_t dropped;		// Records dropped so far
+	void *writer;			// Writer thread
+	uint32_t head __attribute__((aligned(64)));		// Next record the CPU fills
+	uint32_t tail __attribute__((aligned(64)));		// Next record the writer drains
+} cpuTrace;
+#endif
+
+#ifdef __EMU_PROFILE
+// A distinct call stack seen by the profiler
+typedef struct{
+	uint64_t count;						// Samples taken with this stack
+	uint32_t hash;						// 0 = unused entry
+	uint32_t len;						// Amount of frames, the last one is the sampled PB:PC
+	uint32_t frames[PROF_DEPTH + 1];	// Return Addresses of the active calls, outermost first
+} cpuProfileStack;
+
+typedef struct{
+	uint32_t addr;
+	char *name;
+} cpuProfileSymbol;
+
+// Sampling profiler
+typedef struct cpuProfile{
+	uint32_t interval;			// Cycles between samples
+	uint64_t next;				// Cycle count of the next sample
+	uint64_t samples;			// Samples taken
+	uint32_t stack[PROF_DEPTH];	// Shadow call stack, kept up to date by JSR/JSL/RTS/RTL and interrupts/RTI
+	uint32_t depth;				// Depth of the call stack (only the outermost PROF_DEPTH frames are kept)
+	cpuProfileStack *table;		// Hash table of all distinct stacks
+	uint32_t table_size;
+	uint32_t used;
+	cpuProfileSymbol *syms;		// Symbols, sorted by Address
+	uint32_t sym_count;
+} cpuProfile;
+#endif
+
+// Snapshot of a CPU and it's Memory
+typedef struct cpuSnapshot{
+	cpuState cpu;		// CPU at the time of the Snapshot
+	uint8_t *mem;		// Copy of the Memory at the time of the Snapshot
+	uint32_t mem_size;	// Size of the copy
+	uint32_t generation;	// Counts up with every cpuSnapshotSave, deltas are only valid against the same generation
+	uint32_t *dirty_list;	// Numbers of all Pages written to since the last save/load, in the order they were first written to
+	uint32_t dirty_count;	// Length of the dirty list
+	uint8_t slot;			// Bit of the Snapshot in the CPU's dirty map
+} cpuSnapshot;
+
+// Stop conditions and results of cpuRun
+typedef struct{
+	int32_t cycles;				// Cycle budget, same as the cycles parameter of cpuExecute (RUN_UNLIMITED to effectively disable it)
+	uint32_t instructions;		// Instruction budget (0 = no limit)
+	uint64_t deadline;			// Stop once cycle_count reaches this value (0 = no deadline)
+	const uint32_t *breakpoints;	// List of 24-bit Addresses (PB:PC) to stop at, before the instruction there is executed
+	uint32_t bp_count;			// Length of the breakpoint list
+	
+	int32_t cycle_rem;			// Cycles left over, same as the return value of cpuExecute
+	uint32_t executed;			// Amount of instructions executed
+	uint8_t reason;				// Why the run stopped (RUN_*)
+} cpuRunCtl;
+
+// Vectored Interrupt Controller
+typedef struct{
+	cpuState *cpu;		// CPU the Controller drives
+	uint32_t lines;		// IRQ Lines of the connected Devices
+	uint32_t enable;	// Enable Mask (set by the guest)
+	uint8_t cpu_line;	// IRQ Line of the CPU the Controller is connected to
+} vicState;
+
+// Batch of CPUs that run the same code in lockstep
+typedef struct{
+	cpuState *cpu[BATCH_LANES];	// CPU of every lane
+	uint32_t count;				// Amount of lanes in use
+	int32_t rem[BATCH_LANES];	// Cycles every lane didn't use in the last cpuBatchExecute (same as cpuExecute's return value)
+	uint64_t lockstep;			// Instructions executed in lockstep (counted once for all lanes)
+	uint64_t scalar;			// Instructions executed by single lanes
+} cpuBatch;
+
+// Multi-Instance Scheduler (emu65816_sched.c)
+typedef struct cpuSched cpuSched;
+
+typedef struct{
+	uint64_t cycles;		// Cycles executed
+	uint64_t slices;		// Slices run
+	uint64_t ns;			// Host time spent running the instance (ns)
+	uint64_t steals;		// Times the instance was stolen by another thread
+} cpuSchedStats;
+
+// Copy-on-Write Fork Point (emu65816_fork.c)
+typedef struct{
+	cpuState cpu;		// CPU at the time of the fork
+	int fd;				// Frozen image of the Memory, every child maps it copy-on-write
+	uint32_t mem_size;	// Size of the image
+} cpuForkBase;
+
+// Instance Arena (emu65816_arena.c)
+typedef struct{
+	uint8_t *base;		// Start of the Arena
+	uint64_t size;		// Usable size
+	uint64_t mem_end;	// Memory is handed out from the start of the Arena
+	uint64_t cpu_start;	// CPUs from the end, so they're packed together and don't break up the huge pages of the Memory
+	uint32_t count;		// Amount of CPUs allocated
+	int32_t node;		// NUMA node the Arena is placed on (-1 = any)
+	uint8_t huge;		// Backing of the Arena (ARENA_*)
+	void *map;			// Whole mapping (larger than the Arena if it had to be aligned)
+	uint64_t map_size;
+} cpuArena;
+
+// A decoded instruction (emu65816_disasm.c)
+typedef struct{
+	uint32_t addr;			// PB:PC of the opcode
+	uint8_t opcode;
+	uint8_t mode;			// Addressing mode (DIS_*)
+	uint8_t len;			// Length in Bytes, including the opcode
+	uint8_t bytes[4];		// The raw instruction
+	const char *name;		// Mnemonic
+	uint32_t operand;		// Operand as a number (MVN/MVP: destination bank in the low Byte, source bank in the high Byte)
+	uint32_t target;		// PB:PC a branch, JMP/JML, JSR/JSL or BRL goes to, if it's known without running it
+	bool has_target;
+} cpuDisInst;
+
+// Deterministic Multi-CPU System (emu65816_system.c)
+typedef struct cpuSystem cpuSystem;
+
+// Differential Lockstep Checker (emu65816_diff.c)
+typedef int32_t (*cpuEngine)(cpuState* CPU, int32_t cycles);		// An execution engine, called like cpuExecute
+
+typedef struct{
+	uint32_t addr;		// IO address (as the IO handlers see it)
+	uint8_t val;
+	bool write;
+} cpuDiffIO;
+
+typedef struct{
+	cpuState *ref;				// CPU run by the reference interpreter
+	cpuState test;				// Clone run by the engine under test, with it's own Memory
+	cpuState twin;				// Second clone, only for cpuBatchExecute (a Batch needs 2 lanes to run in lockstep)
+	cpuEngine engine;			// Engine under test (NULL = cpuBatchExecute)
+	cpuBatch batch;
+	cpuSnapshot snap[3];		// Dirty Page tracking of the reference, test and twin (they hold the Memory from before the step)
+	int32_t step;				// Cycles per step (1 = compare after every instruction)
+	uint8_t (*io_read)(uint32_t);			// IO handlers of the reference
+	void (*io_write)(uint32_t, uint8_t);
+	
+	cpuDiffIO io[DIFF_IO_MAX];	// IO accesses the reference made in the current step
+	uint32_t io_count;
+	uint32_t io_pos[2];			// Replay position of test and twin
+	cpuDiffIO io_miss[2];		// First access of test and twin that didn't match the reference
+	bool io_bad[2];
+	
+	uint64_t steps;				// Steps compared
+	uint64_t cycles;			// Cycles the reference executed
+	uint64_t instructions;		// Instructions the reference executed
+	cpuState history[DIFF_HISTORY];	// Reference before each of the last steps
+	
+	// First divergence
+	bool diverged;
+	const char *what;			// What differed ("PC", "A", "P", "Cycles", "Memory", "IO", ...)
+	uint8_t lane;				// Clone that differed (0 = test, 1 = twin)
+	cpuState ref_after;			// Both CPUs after the step
+	cpuState test_after;
+	int32_t ref_rem;			// Cycles both didn't use in the step
+	int32_t test_rem;
+	uint32_t addr;				// First differing Memory address
+	uint8_t old_val;			// It's value before the step, and afterwards
+	uint8_t ref_val;
+	uint8_t test_val;
+} cpuDiff;
+
 void cpuInit(cpuState* CPU, uint8_t* memory, uint32_t memSize, uint32_t ioAddress, uint32_t ioSize, uint8_t (*ioRead)(uint32_t), void (*ioWrite)(uint32_t, uint8_t));
 int32_t cpuExecute(cpuState* CPU, int32_t cycles);
+uint8_t cpuRun(cpuState* CPU, cpuRunCtl* RUN);
+uint8_t cpuStep(cpuState* CPU);
+uint64_t cpuNowNs(void);
+
+bool cpuSnapshotInit(cpuState* CPU, cpuSnapshot* SNAP);
+void cpuSnapshotSave(cpuState* CPU, cpuSnapshot* SNAP);
+void cpuSnapshotLoad(cpuState* CPU, cpuSnapshot* SNAP);
+void cpuSnapshotFree(cpuState* CPU, cpuSnapshot* SNAP);
+void cpuMarkDirty(cpuState* CPU, uint32_t addr, uint32_t size);
+uint32_t cpuSaveState(cpuState* CPU, const cpuSnapshot* BASE, uint8_t* buf, uint32_t size);
+bool cpuLoadState(cpuState* CPU, cpuSnapshot* BASE, const uint8_t* buf, uint32_t size);
+
+#ifdef __EMU_FUZZ
+uint8_t cpuFuzzRun(cpuState* CPU, cpuSnapshot* BASE, const uint8_t* data, uint32_t size, uint32_t addr, cpuRunCtl* RUN);
+#endif
+
+#ifdef __EMU_STATS
+void cpuStatsReset(cpuStats* ST);
+void cpuStatsDump(const cpuStats* ST, FILE* fp, bool json);
+#endif
+
+#ifdef __EMU_HEATMAP
+bool cpuHeatmapInit(cpuState* CPU, cpuHeatmap* H);
+void cpuHeatmapReset(cpuHeatmap* H);
+void cpuHeatmapDump(const cpuHeatmap* H, FILE* fp);
+void cpuHeatmapDumpIO(const cpuHeatmap* H, FILE* fp);
+void cpuHeatmapFree(cpuState* CPU, cpuHeatmap* H);
+#endif
+
+#ifdef __EMU_PERF
+void cpuPerfReset(cpuPerf* P);
+void cpuPerfRead(cpuPerf* P, cpuPerfCounters* out);
+#endif
+
+#ifdef __EMU_TRACE
+cpuTrace* cpuTraceStart(cpuState* CPU, const char* path, uint32_t records, bool lossy);
+uint64_t cpuTraceStop(cpuState* CPU, cpuTrace* T);
+#endif
+
+#ifdef __EMU_PROFILE
+bool cpuProfileInit(cpuState* CPU, cpuProfile* P, uint32_t interval);
+int32_t cpuProfileLoadSymbols(cpuProfile* P, const char* path);
+void cpuProfileDump(const cpuProfile* P, FILE* fp);
+void cpuProfileFree(cpuState* CPU, cpuProfile* P);
+#endif
+
+void vicInit(vicState* VIC, cpuState* CPU, uint8_t cpuLine);
+void vicAssert(vicState* VIC, uint8_t source);
+void vicDeassert(vicState* VIC, uint8_t source);
+uint8_t vicRead(vicState* VIC, uint32_t addr);
+void vicWrite(vicState* VIC, uint32_t addr, uint8_t val);
+
+void cpuBatchInit(cpuBatch* B);
+bool cpuBatchAdd(cpuBatch* B, cpuState* CPU);
+void cpuBatchExecute(cpuBatch* B, int32_t cycles);
+
+cpuSched* cpuSchedCreate(uint32_t threads, bool pin);
+int32_t cpuSchedAdd(cpuSched* S, cpuState* CPU, int32_t slice, void (*service)(cpuState*, void*), void* user);
+int32_t cpuSchedRun(cpuSched* S, uint32_t slices);
+void cpuSchedGetStats(cpuSched* S, int32_t id, cpuSchedStats* stats);
+cpuState* cpuSchedSelf(void);
+void* cpuSchedUser(void);
+void cpuSchedFree(cpuSched* S);
+
+bool cpuForkBaseInit(cpuState* CPU, cpuForkBase* BASE);
+bool cpuFork(const cpuForkBase* BASE, cpuState* CHILD);
+void cpuForkFree(cpuState* CHILD);
+void cpuForkBaseFree(cpuForkBase* BASE);
+
+bool cpuArenaInit(cpuArena* AR, uint64_t size, int32_t node);
+cpuState* cpuCreate(cpuArena* AR, uint32_t memSize);
+int32_t cpuArenaLocalNode(void);
+void cpuArenaFree(cpuArena* AR);
+
+uint8_t cpuDisLength(uint8_t opcode, bool mf, bool xf);
+uint8_t cpuDisDecodeBytes(const uint8_t* bytes, uint32_t addr, bool mf, bool xf, cpuDisInst* I);
+uint8_t cpuDisDecode(const uint8_t* mem, uint32_t memSize, uint32_t addr, bool mf, bool xf, cpuDisInst* I);
+uint32_t cpuDisFormat(const cpuDisInst* I, char* buf, uint32_t size);
+uint32_t cpuDisasm(const uint8_t* mem, uint32_t memSize, uint32_t addr, bool mf, bool xf, char* buf, uint32_t size);
+uint32_t cpuDisDump(const uint8_t* mem, uint32_t memSize, uint32_t addr, uint32_t end, bool mf, bool xf, FILE* fp);
+
+cpuSystem* cpuSystemCreate(int32_t quantum, void (*service)(cpuSystem*, void*), void* user);
+int32_t cpuSystemAdd(cpuSystem* S, cpuState* CPU);
+bool cpuSystemShareMem(cpuSystem* S, uint32_t addr, uint32_t size);
+bool cpuSystemShareIO(cpuSystem* S, uint32_t addr, uint32_t size);
+uint32_t cpuSystemRun(cpuSystem* S, uint32_t quanta);
+int32_t cpuSystemCore(void);
+cpuState* cpuSystemGetCore(cpuSystem* S, uint32_t n);
+void cpuSystemFree(cpuSystem* S);
+
+bool cpuDiffInit(cpuState* CPU, cpuDiff* D, cpuEngine engine, int32_t step);
+bool cpuDiffRun(cpuDiff* D, uint64_t cycles);
+void cpuDiffReport(const cpuDiff* D, FILE* fp);
+void cpuDiffFree(cpuDiff* D);
 
 
 #endif
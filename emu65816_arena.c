@@ -0,0 +1,135 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+// Comment out this #define if compiling on a Big Endian System/CPU
+#define __EMU_LITTLE_ENDIAN
+
+#include "emu65816.h"
+
+
+
+// Instance Arenas
+// Allocates many CPUs and their Memory from one large mapping instead of a malloc each. The mapping is backed by
+// huge pages where possible (so running hundreds of instances doesn't thrash the TLB), and can be bound to a NUMA node
+// so the instances live next to the worker thread that runs them. Every cpuState gets it's own cache lines, so the
+// registers of 2 instances running on different threads never share one.
+
+#define ARENA_HUGE_SIZE		(2UL * 1024 * 1024)		// Size of a huge page (x86/ARM default)
+#define ARENA_SMALL_SIZE	(4096UL)
+
+#ifndef MAP_HUGETLB
+#define MAP_HUGETLB			0
+#endif
+
+// Rounds v up to a multiple of a (which must be a power of 2)
+#define alignUp(v,a)		(((v) + (a) - 1) & ~((uint64_t)(a) - 1))
+
+
+
+#ifdef __linux__
+// Binds the mapping to a NUMA node (before anything was written to it, so every page is placed there on first touch)
+// Uses the syscall directly so there's no need for libnuma
+void static arenaBind(cpuArena* AR){
+	unsigned long mask[4] = {0};
+	
+	if ((AR->node < 0) || (AR->node >= (int32_t)(sizeof(mask) * 8))) return;
+	mask[AR->node / (sizeof(long) * 8)] = 1UL << (AR->node % (sizeof(long) * 8));
+	
+	// MPOL_PREFERRED (1), so the allocation still works if the node runs out of memory
+	syscall(SYS_mbind, AR->base, AR->size, 1, mask, sizeof(mask) * 8 + 1, 0);
+}
+#endif
+
+// Reserves "size" Bytes (rounded up to whole huge pages) for CPUs and their Memory
+// If node isn't negative the Memory is placed on that NUMA node (Linux only)
+// Returns false if the mapping couldn't be created
+bool cpuArenaInit(cpuArena* AR, uint64_t size, int32_t node){
+	void *p;
+	
+	memset(AR, 0, sizeof(cpuArena));
+	AR->size = alignUp(size, ARENA_HUGE_SIZE);
+	AR->node = node;
+	
+	// Explicit huge pages first, they only exist if the admin reserved some (vm.nr_hugepages)
+	p = MAP_HUGETLB ? mmap(NULL, AR->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0) : MAP_FAILED;
+	if (p != MAP_FAILED){
+		AR->huge = ARENA_HUGETLB;
+	}else{
+		// Otherwise ask for transparent huge pages, over-allocating so the arena can start on a huge page boundary
+		p = mmap(NULL, AR->size + ARENA_HUGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED) return false;
+		AR->map = p;
+		AR->map_size = AR->size + ARENA_HUGE_SIZE;
+		p = (void*)alignUp((uintptr_t)p, ARENA_HUGE_SIZE);
+		
+		#ifdef MADV_HUGEPAGE
+		AR->huge = madvise(p, AR->size, MADV_HUGEPAGE) ? ARENA_SMALL : ARENA_THP;
+		#else
+		AR->huge = ARENA_SMALL;
+		#endif
+	}
+	
+	AR->base = p;
+	AR->cpu_start = AR->size;
+	if (!AR->map){
+		AR->map = p;
+		AR->map_size = AR->size;
+	}
+	
+	#ifdef __linux__
+	arenaBind(AR);
+	#endif
+	
+	return true;
+}
+
+// Allocates a CPU and "memSize" Bytes of zeroed Memory for it from an arena
+// The CPU is aligned to (and padded to a multiple of) CPU_ALIGN Bytes, the Memory to a page (or a huge page if it's large enough)
+// Only mem and mem_size are set, load the ROM into CPU->mem and then call cpuInit(CPU, CPU->mem, CPU->mem_size, ...)
+// Returns NULL if the arena is full. Not thread safe, every thread should use it's own arena
+cpuState* cpuCreate(cpuArena* AR, uint32_t memSize){
+	uint64_t cpu, mem;
+	cpuState *CPU;
+	
+	if (AR->cpu_start < alignUp(sizeof(cpuState), CPU_ALIGN)) return NULL;
+	cpu = (AR->cpu_start - alignUp(sizeof(cpuState), CPU_ALIGN)) & ~((uint64_t)CPU_ALIGN - 1);
+	mem = alignUp(AR->mem_end, (memSize >= ARENA_HUGE_SIZE) ? ARENA_HUGE_SIZE : ARENA_SMALL_SIZE);
+	if ((mem + memSize) > cpu) return NULL;
+	
+	// Fresh mappings are already zeroed
+	CPU = (cpuState*)(AR->base + cpu);
+	CPU->mem = AR->base + mem;
+	CPU->mem_size = memSize;
+	
+	AR->cpu_start = cpu;
+	AR->mem_end = mem + memSize;
+	AR->count++;
+	
+	return CPU;
+}
+
+// Returns the NUMA node of the host core the calling thread is running on (0 if unknown)
+// Meant for creating an arena on the node of a (pinned) worker thread
+int32_t cpuArenaLocalNode(void){
+	#ifdef __linux__
+	unsigned cpu, node;
+	
+	if (!syscall(SYS_getcpu, &cpu, &node, NULL)) return node;
+	#endif
+	return 0;
+}
+
+// Frees an arena and every CPU that was allocated from it
+void cpuArenaFree(cpuArena* AR){
+	if (AR->map) munmap(AR->map, AR->map_size);
+	memset(AR, 0, sizeof(cpuArena));
+}
@@ -0,0 +1,337 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+// Comment out this #define if compiling on a Big Endian System/CPU
+#define __EMU_LITTLE_ENDIAN
+
+#include "emu65816.h"
+
+
+
+// Differential Lockstep Checker
+// Runs a CPU in the reference interpreter (cpuRun, what cpuExecute uses) and a clone of it with a copy of it's Memory
+// in another execution engine side by side, one step at a time, and compares them after every step: registers, flags,
+// the cycle count, the cycles left over, the Memory they wrote and the IO they did. A step is a number of cycles, with
+// 1 it's a single instruction. Only the reference talks to the real IO handlers, the accesses it makes are recorded
+// and played back to the clone, which has to make exactly the same ones. The IRQ lines and pending interrupts are
+// copied from the reference before every step, so the host only drives the reference like it normally would.
+// Without an engine of it's own the checker tests cpuBatchExecute, which only runs lanes in lockstep if there are at
+// least 2 of them, so it gets 2 clones (test and twin) as a Batch of it's own.
+
+static __thread cpuDiff *diffCur;		// Checker the current thread runs a step of (the IO handlers don't get one)
+
+// Records an IO access of the reference
+void static diffLog(cpuDiff* D, uint32_t addr, uint8_t val, bool write){
+	if (D->io_count < DIFF_IO_MAX) D->io[D->io_count] = (cpuDiffIO){addr, val, write};
+	D->io_count++;		// Counts on when it's full, so the step is reported
+}
+
+// Plays back the next access of the reference to a clone, the first one that doesn't match is kept
+uint8_t static diffReplay(uint8_t lane, uint32_t addr, uint8_t val, bool write){
+	cpuDiff *D = diffCur;
+	uint32_t pos = D->io_pos[lane]++;
+	const cpuDiffIO *R = &D->io[(pos < DIFF_IO_MAX) ? pos : 0];
+	
+	if ((pos < D->io_count) && (pos < DIFF_IO_MAX) && (R->addr == addr) && (R->write == write) && (!write || (R->val == val))){
+		return R->val;
+	}
+	
+	if (!D->io_bad[lane]){
+		D->io_bad[lane] = true;
+		D->io_miss[lane] = (cpuDiffIO){addr, val, write};
+		D->io_pos[lane] = pos;		// Stays on the access it should have made
+	}
+	return 0;
+}
+
+uint8_t static diffRefRead(uint32_t addr){
+	uint8_t val = diffCur->io_read(addr);
+	
+	diffLog(diffCur, addr, val, false);
+	return val;
+}
+
+void static diffRefWrite(uint32_t addr, uint8_t val){
+	diffLog(diffCur, addr, val, true);
+	diffCur->io_write(addr, val);
+}
+
+uint8_t static diffTestRead(uint32_t addr){
+	return diffReplay(0, addr, 0, false);
+}
+
+void static diffTestWrite(uint32_t addr, uint8_t val){
+	diffReplay(0, addr, val, true);
+}
+
+uint8_t static diffTwinRead(uint32_t addr){
+	return diffReplay(1, addr, 0, false);
+}
+
+void static diffTwinWrite(uint32_t addr, uint8_t val){
+	diffReplay(1, addr, val, true);
+}
+
+// Copies the CPU and it's Memory, the clone gets the replaying IO handlers and none of the Host's tracking
+bool static diffClone(const cpuState* CPU, cpuState* CLONE, uint8_t lane){
+	*CLONE = *CPU;
+	CLONE->mem = malloc(CPU->mem_size);
+	if (!CLONE->mem) return false;
+	memcpy(CLONE->mem, CPU->mem, CPU->mem_size);
+	
+	CLONE->io_read = lane ? diffTwinRead : diffTestRead;
+	CLONE->io_write = lane ? diffTwinWrite : diffTestWrite;
+	CLONE->dirty_map = NULL;
+	CLONE->dirty_mask = 0;
+	memset(CLONE->snaps, 0, sizeof(CLONE->snaps));
+	CLONE->stats = NULL;
+	CLONE->heat = NULL;
+	CLONE->perf = NULL;
+	CLONE->trace = NULL;
+	CLONE->prof = NULL;
+	CLONE->cov_map = NULL;
+	
+	return true;
+}
+
+// Status Register as a Byte
+uint8_t static diffSR(const cpuState* CPU){
+	return (CPU->fl_n << 7) | (CPU->fl_v << 6) | (CPU->fl_m << 5) | (CPU->fl_x << 4)
+		| (CPU->fl_d << 3) | (CPU->fl_i << 2) | (CPU->fl_z << 1) | CPU->fl_c;
+}
+
+// Returns the name of the first register that differs, or NULL
+const char static *diffCompare(const cpuState* R, const cpuState* T){
+	if ((R->reg_pc.w != T->reg_pc.w) || (R->reg_pb != T->reg_pb)) return "PC";
+	if (R->reg_a.w != T->reg_a.w) return "A";
+	if (R->reg_x.w != T->reg_x.w) return "X";
+	if (R->reg_y.w != T->reg_y.w) return "Y";
+	if (R->reg_sp.w != T->reg_sp.w) return "SP";
+	if (R->reg_dp.w != T->reg_dp.w) return "DP";
+	if (R->reg_db != T->reg_db) return "DB";
+	if (diffSR(R) != diffSR(T)) return "P";
+	if (R->fl_e != T->fl_e) return "E";
+	if ((R->wai != T->wai) || (R->stp != T->stp)) return "WAI/STP";
+	if (R->cycle_count != T->cycle_count) return "Cycles";
+	return NULL;
+}
+
+// Compares every Page the reference or the clone wrote to in the step, the first differing Byte ends up in D
+bool static diffMemory(cpuDiff* D, const cpuState* T, uint8_t lane){
+	const cpuSnapshot *S[2] = {&D->snap[0], &D->snap[lane + 1]};
+	const cpuState *R = D->ref;
+	uint32_t ad, size;
+	
+	for (uint32_t s = 0; s < 2; s++){
+		for (uint32_t i = 0; i < S[s]->dirty_count; i++){
+			ad = S[s]->dirty_list[i] << MEM_PAGE_SHIFT;
+			size = ((R->mem_size - ad) < MEM_PAGE_SIZE) ? (R->mem_size - ad) : MEM_PAGE_SIZE;
+			if (!memcmp(R->mem + ad, T->mem + ad, size)) continue;
+			
+			while (R->mem[ad] == T->mem[ad]) ad++;
+			D->addr = ad;
+			D->old_val = D->snap[0].mem[ad];
+			D->ref_val = R->mem[ad];
+			D->test_val = T->mem[ad];
+			return true;
+		}
+	}
+	
+	return false;
+}
+
+// Compares a clone with the reference after a step, returns true (and fills in the divergence) if they differ
+bool static diffCheck(cpuDiff* D, const cpuState* T, uint8_t lane, int32_t rem, int32_t refRem){
+	const char *what = diffCompare(D->ref, T);
+	
+	if (!what && (rem != refRem)) what = "Cycles left";
+	if (!what && (D->io_count > DIFF_IO_MAX)) what = "IO (too many accesses in one step)";
+	if (!what && (D->io_bad[lane] || (D->io_pos[lane] != D->io_count))) what = "IO";
+	if (!what && diffMemory(D, T, lane)) what = "Memory";
+	if (!what) return false;
+	
+	D->diverged = true;
+	D->what = what;
+	D->lane = lane;
+	D->ref_after = *D->ref;
+	D->test_after = *T;
+	D->ref_rem = refRem;
+	D->test_rem = rem;
+	return true;
+}
+
+// Clones the CPU for the engine (NULL = cpuBatchExecute) and starts tracking the Pages both of them write to
+// The CPU keeps it's Memory and IO handlers, it takes one of it's Snapshots though, so it shouldn't be loaded or
+// saved while the checker is in use. Returns false if there isn't enough memory or no Snapshot is left
+bool cpuDiffInit(cpuState* CPU, cpuDiff* D, cpuEngine engine, int32_t step){
+	memset(D, 0, sizeof(cpuDiff));
+	D->ref = CPU;
+	D->engine = engine;
+	D->step = (step > 0) ? step : 1;
+	D->io_read = CPU->io_read;
+	D->io_write = CPU->io_write;
+	
+	if (!diffClone(CPU, &D->test, 0) || !cpuSnapshotInit(CPU, &D->snap[0]) || !cpuSnapshotInit(&D->test, &D->snap[1])){
+		cpuDiffFree(D);
+		return false;
+	}
+	
+	if (!engine){
+		if (!diffClone(CPU, &D->twin, 1) || !cpuSnapshotInit(&D->twin, &D->snap[2])){
+			cpuDiffFree(D);
+			return false;
+		}
+		cpuBatchInit(&D->batch);
+		cpuBatchAdd(&D->batch, &D->test);
+		cpuBatchAdd(&D->batch, &D->twin);
+	}
+	
+	return true;
+}
+
+// Runs both sides for at least the given amount of cycles, step by step
+// Returns false once they diverged (cpuDiffReport tells how), stops early if the reference stopped (STP, or WAI
+// without an IRQ) so the Host can send an interrupt and call it again
+bool cpuDiffRun(cpuDiff* D, uint64_t cycles){
+	cpuState *lanes[2] = {&D->test, &D->twin};
+	uint32_t count = D->engine ? 1 : 2;
+	uint64_t start = D->cycles;
+	int32_t rem[2];
+	cpuRunCtl RUN;
+	
+	if (D->diverged) return false;
+	diffCur = D;
+	
+	while ((D->cycles - start) < cycles){
+		// Interrupts come from the Host (asserting one also ends WAI), the clones get them from the reference
+		for (uint32_t i = 0; i < count; i++){
+			lanes[i]->irq_line = D->ref->irq_line;
+			lanes[i]->interrupt = D->ref->interrupt;
+			lanes[i]->wai = D->ref->wai;
+			D->io_pos[i] = 0;
+			D->io_bad[i] = false;
+		}
+		D->io_count = 0;
+		D->history[D->steps % DIFF_HISTORY] = *D->ref;
+		
+		D->ref->io_read = diffRefRead;
+		D->ref->io_write = diffRefWrite;
+		RUN = (cpuRunCtl){.cycles = D->step};
+		cpuRun(D->ref, &RUN);
+		D->ref->io_read = D->io_read;
+		D->ref->io_write = D->io_write;
+		
+		if (D->engine){
+			rem[0] = D->engine(&D->test, D->step);
+		}else{
+			cpuBatchExecute(&D->batch, D->step);
+			rem[0] = D->batch.rem[0];
+			rem[1] = D->batch.rem[1];
+		}
+		
+		D->steps++;
+		D->cycles += RUN.cycles - RUN.cycle_rem;
+		D->instructions += RUN.executed;
+		
+		for (uint32_t i = 0; i < count; i++){
+			if (diffCheck(D, lanes[i], i, rem[i], RUN.cycle_rem)) break;
+		}
+		if (D->diverged) break;
+		
+		for (uint32_t i = 0; i <= count; i++) cpuSnapshotSave(i ? lanes[i - 1] : D->ref, &D->snap[i]);
+		if (!RUN.executed) break;
+	}
+	
+	diffCur = NULL;
+	return !D->diverged;
+}
+
+void static diffPrintRegs(const cpuState* CPU, FILE* fp){
+	uint8_t sr = diffSR(CPU);
+	
+	fprintf(fp, "A: $%04X X: $%04X Y: $%04X SP: $%04X DP: $%04X DB: $%02X P: %c%c%c%c%c%c%c%c%s (Cycle: %llu)\n",
+		CPU->reg_a.w, CPU->reg_x.w, CPU->reg_y.w, CPU->reg_sp.w, CPU->reg_dp.w, CPU->reg_db,
+		(sr & 0x80) ? 'N' : 'n', (sr & 0x40) ? 'V' : 'v', (sr & 0x20) ? 'M' : 'm', (sr & 0x10) ? 'X' : 'x',
+		(sr & 0x08) ? 'D' : 'd', (sr & 0x04) ? 'I' : 'i', (sr & 0x02) ? 'Z' : 'z', (sr & 0x01) ? 'C' : 'c',
+		CPU->fl_e ? " E" : "", (unsigned long long)CPU->cycle_count);
+}
+
+void static diffPrintIO(const char* who, const cpuDiffIO* IO, FILE* fp){
+	if (IO->write){
+		fprintf(fp, "\t%s wrote $%02X to IO $%04X\n", who, IO->val, IO->addr);
+	}else{
+		fprintf(fp, "\t%s read IO $%04X\n", who, IO->addr);
+	}
+}
+
+// Prints the first divergence with the last steps of the reference leading up to it, or a summary if there's none
+void cpuDiffReport(const cpuDiff* D, FILE* fp){
+	const char *engine = D->engine ? "engine" : (D->lane ? "twin lane" : "test lane");
+	uint64_t first = (D->steps > DIFF_HISTORY) ? (D->steps - DIFF_HISTORY) : 0;
+	const cpuState *H;
+	uint32_t pos = D->io_pos[D->lane];
+	char text[32];
+	
+	if (!D->diverged){
+		fprintf(fp, "No divergence in %llu steps (%llu cycles, %llu instructions)", (unsigned long long)D->steps,
+			(unsigned long long)D->cycles, (unsigned long long)D->instructions);
+		if (!D->engine){
+			fprintf(fp, ", %llu instructions in lockstep, %llu in the interpreter", (unsigned long long)D->batch.lockstep,
+				(unsigned long long)D->batch.scalar);
+		}
+		fprintf(fp, "\n");
+		return;
+	}
+	
+	fprintf(fp, "Divergence in %s at step %llu between the reference and the %s, the last steps were:\n", D->what,
+		(unsigned long long)D->steps, engine);
+	
+	// The Snapshot of the reference still holds the Memory from before the last step
+	for (uint64_t s = first; s < D->steps; s++){
+		H = &D->history[s % DIFF_HISTORY];
+		cpuDisasm(D->snap[0].mem, D->ref->mem_size, ((uint32_t)H->reg_pb << 16) | H->reg_pc.w, H->fl_e || H->fl_m,
+			H->fl_e || H->fl_x, text, sizeof(text));
+		fprintf(fp, "%s $%02X%04X: %-16s ", ((s + 1) == D->steps) ? ">" : " ", H->reg_pb, H->reg_pc.w, text);
+		diffPrintRegs(H, fp);
+	}
+	
+	fprintf(fp, "The reference afterwards (PC $%02X%04X, %d cycles left):\n\t", D->ref_after.reg_pb, D->ref_after.reg_pc.w, D->ref_rem);
+	diffPrintRegs(&D->ref_after, fp);
+	fprintf(fp, "The %s afterwards (PC $%02X%04X, %d cycles left):\n\t", engine, D->test_after.reg_pb, D->test_after.reg_pc.w, D->test_rem);
+	diffPrintRegs(&D->test_after, fp);
+	
+	if (!strcmp(D->what, "Memory")){
+		fprintf(fp, "Memory $%06X was $%02X, the reference wrote $%02X, the %s $%02X\n", D->addr, D->old_val, D->ref_val,
+			engine, D->test_val);
+	}else if (!strcmp(D->what, "IO")){
+		fprintf(fp, "IO access %u of the step:\n", pos + 1);
+		if (pos < D->io_count){
+			diffPrintIO("the reference", &D->io[pos], fp);
+		}else{
+			fprintf(fp, "\tthe reference didn't make one\n");
+		}
+		if (D->io_bad[D->lane]){
+			diffPrintIO(engine, &D->io_miss[D->lane], fp);
+		}else{
+			fprintf(fp, "\tthe %s didn't make one\n", engine);
+		}
+	}
+}
+
+// Frees the clones and gives the CPU it's Snapshot back
+void cpuDiffFree(cpuDiff* D){
+	cpuState *cpus[3] = {D->ref, &D->test, &D->twin};
+	
+	for (uint32_t i = 0; i < 3; i++){
+		if (D->snap[i].mem) cpuSnapshotFree(cpus[i], &D->snap[i]);
+	}
+	
+	free(D->test.mem);
+	free(D->twin.mem);
+	D->test.mem = NULL;
+	D->twin.mem = NULL;
+}
@@ -0,0 +1,232 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+// Comment out this #define if compiling on a Big Endian System/CPU
+#define __EMU_LITTLE_ENDIAN
+
+#include "emu65816.h"
+
+
+
+// Disassembler
+// Decodes guest memory without executing anything, all it needs is the memory and the state of the M and X flags
+// (which decide the size of immediate operands). Everything comes from a single table of mnemonic and addressing
+// mode per opcode, the text uses the same syntax as the dbg output of the emulator.
+
+
+typedef struct{
+	char name[4];
+	uint8_t mode;
+} disOp;
+
+const disOp static disTable[256] = {
+	{"BRK", DIS_IMM8},  {"ORA", DIS_DPIX},  {"COP", DIS_IMM8},  {"ORA", DIS_SR},    {"TSB", DIS_DP},    {"ORA", DIS_DP},    {"ASL", DIS_DP},    {"ORA", DIS_DPIL},
+	{"PHP", DIS_IMP},   {"ORA", DIS_IMM_M}, {"ASL", DIS_ACC},   {"PHD", DIS_IMP},   {"TSB", DIS_ABS},   {"ORA", DIS_ABS},   {"ASL", DIS_ABS},   {"ORA", DIS_LONG},
+	{"BPL", DIS_REL},   {"ORA", DIS_DPIY},  {"ORA", DIS_DPI},   {"ORA", DIS_SRIY},  {"TRB", DIS_DP},    {"ORA", DIS_DPX},   {"ASL", DIS_DPX},   {"ORA", DIS_DPILY},
+	{"CLC", DIS_IMP},   {"ORA", DIS_ABSY},  {"INC", DIS_ACC},   {"TCS", DIS_IMP},   {"TRB", DIS_ABS},   {"ORA", DIS_ABSX},  {"ASL", DIS_ABSX},  {"ORA", DIS_LONGX},
+	{"JSR", DIS_ABS},   {"AND", DIS_DPIX},  {"JSL", DIS_LONG},  {"AND", DIS_SR},    {"BIT", DIS_DP},    {"AND", DIS_DP},    {"ROL", DIS_DP},    {"AND", DIS_DPIL},
+	{"PLP", DIS_IMP},   {"AND", DIS_IMM_M}, {"ROL", DIS_ACC},   {"PLD", DIS_IMP},   {"BIT", DIS_ABS},   {"AND", DIS_ABS},   {"ROL", DIS_ABS},   {"AND", DIS_LONG},
+	{"BMI", DIS_REL},   {"AND", DIS_DPIY},  {"AND", DIS_DPI},   {"AND", DIS_SRIY},  {"BIT", DIS_DPX},   {"AND", DIS_DPX},   {"ROL", DIS_DPX},   {"AND", DIS_DPILY},
+	{"SEC", DIS_IMP},   {"AND", DIS_ABSY},  {"DEC", DIS_ACC},   {"TSC", DIS_IMP},   {"BIT", DIS_ABSX},  {"AND", DIS_ABSX},  {"ROL", DIS_ABSX},  {"AND", DIS_LONGX},
+	{"RTI", DIS_IMP},   {"EOR", DIS_DPIX},  {"WDM", DIS_SIG},   {"EOR", DIS_SR},    {"MVP", DIS_MOVE},  {"EOR", DIS_DP},    {"LSR", DIS_DP},    {"EOR", DIS_DPIL},
+	{"PHA", DIS_IMP},   {"EOR", DIS_IMM_M}, {"LSR", DIS_ACC},   {"PHK", DIS_IMP},   {"JMP", DIS_ABS},   {"EOR", DIS_ABS},   {"LSR", DIS_ABS},   {"EOR", DIS_LONG},
+	{"BVC", DIS_REL},   {"EOR", DIS_DPIY},  {"EOR", DIS_DPI},   {"EOR", DIS_SRIY},  {"MVN", DIS_MOVE},  {"EOR", DIS_DPX},   {"LSR", DIS_DPX},   {"EOR", DIS_DPILY},
+	{"CLI", DIS_IMP},   {"EOR", DIS_ABSY},  {"PHY", DIS_IMP},   {"TCD", DIS_IMP},   {"JML", DIS_LONG},  {"EOR", DIS_ABSX},  {"LSR", DIS_ABSX},  {"EOR", DIS_LONGX},
+	{"RTS", DIS_IMP},   {"ADC", DIS_DPIX},  {"PER", DIS_PUSH},  {"ADC", DIS_SR},    {"STZ", DIS_DP},    {"ADC", DIS_DP},    {"ROR", DIS_DP},    {"ADC", DIS_DPIL},
+	{"PLA", DIS_IMP},   {"ADC", DIS_IMM_M}, {"ROR", DIS_ACC},   {"RTL", DIS_IMP},   {"JMP", DIS_ABSI},  {"ADC", DIS_ABS},   {"ROR", DIS_ABS},   {"ADC", DIS_LONG},
+	{"BVS", DIS_REL},   {"ADC", DIS_DPIY},  {"ADC", DIS_DPI},   {"ADC", DIS_SRIY},  {"STZ", DIS_DPX},   {"ADC", DIS_DPX},   {"ROR", DIS_DPX},   {"ADC", DIS_DPILY},
+	{"SEI", DIS_IMP},   {"ADC", DIS_ABSY},  {"PLY", DIS_IMP},   {"TDC", DIS_IMP},   {"JMP", DIS_ABSIX}, {"ADC", DIS_ABSX},  {"ROR", DIS_ABSX},  {"ADC", DIS_LONGX},
+	{"BRA", DIS_REL},   {"STA", DIS_DPIX},  {"BRL", DIS_RELL},  {"STA", DIS_SR},    {"STY", DIS_DP},    {"STA", DIS_DP},    {"STX", DIS_DP},    {"STA", DIS_DPIL},
+	{"DEY", DIS_IMP},   {"BIT", DIS_IMM_M}, {"TXA", DIS_IMP},   {"PHB", DIS_IMP},   {"STY", DIS_ABS},   {"STA", DIS_ABS},   {"STX", DIS_ABS},   {"STA", DIS_LONG},
+	{"BCC", DIS_REL},   {"STA", DIS_DPIY},  {"STA", DIS_DPI},   {"STA", DIS_SRIY},  {"STY", DIS_DPX},   {"STA", DIS_DPX},   {"STX", DIS_DPY},   {"STA", DIS_DPILY},
+	{"TYA", DIS_IMP},   {"STA", DIS_ABSY},  {"TXS", DIS_IMP},   {"TXY", DIS_IMP},   {"STZ", DIS_ABS},   {"STA", DIS_ABSX},  {"STZ", DIS_ABSX},  {"STA", DIS_LONGX},
+	{"LDY", DIS_IMM_X}, {"LDA", DIS_DPIX},  {"LDX", DIS_IMM_X}, {"LDA", DIS_SR},    {"LDY", DIS_DP},    {"LDA", DIS_DP},    {"LDX", DIS_DP},    {"LDA", DIS_DPIL},
+	{"TAY", DIS_IMP},   {"LDA", DIS_IMM_M}, {"TAX", DIS_IMP},   {"PLB", DIS_IMP},   {"LDY", DIS_ABS},   {"LDA", DIS_ABS},   {"LDX", DIS_ABS},   {"LDA", DIS_LONG},
+	{"BCS", DIS_REL},   {"LDA", DIS_DPIY},  {"LDA", DIS_DPI},   {"LDA", DIS_SRIY},  {"LDY", DIS_DPX},   {"LDA", DIS_DPX},   {"LDX", DIS_DPY},   {"LDA", DIS_DPILY},
+	{"CLV", DIS_IMP},   {"LDA", DIS_ABSY},  {"TSX", DIS_IMP},   {"TYX", DIS_IMP},   {"LDY", DIS_ABSX},  {"LDA", DIS_ABSX},  {"LDX", DIS_ABSY},  {"LDA", DIS_LONGX},
+	{"CPY", DIS_IMM_X}, {"CMP", DIS_DPIX},  {"REP", DIS_FLAGS}, {"CMP", DIS_SR},    {"CPY", DIS_DP},    {"CMP", DIS_DP},    {"DEC", DIS_DP},    {"CMP", DIS_DPIL},
+	{"INY", DIS_IMP},   {"CMP", DIS_IMM_M}, {"DEX", DIS_IMP},   {"WAI", DIS_IMP},   {"CPY", DIS_ABS},   {"CMP", DIS_ABS},   {"DEC", DIS_ABS},   {"CMP", DIS_LONG},
+	{"BNE", DIS_REL},   {"CMP", DIS_DPIY},  {"CMP", DIS_DPI},   {"CMP", DIS_SRIY},  {"PEI", DIS_DP},    {"CMP", DIS_DPX},   {"DEC", DIS_DPX},   {"CMP", DIS_DPILY},
+	{"CLD", DIS_IMP},   {"CMP", DIS_ABSY},  {"PHX", DIS_IMP},   {"STP", DIS_IMP},   {"JML", DIS_ABSI},  {"CMP", DIS_ABSX},  {"DEC", DIS_ABSX},  {"CMP", DIS_LONGX},
+	{"CPX", DIS_IMM_X}, {"SBC", DIS_DPIX},  {"SEP", DIS_FLAGS}, {"SBC", DIS_SR},    {"CPX", DIS_DP},    {"SBC", DIS_DP},    {"INC", DIS_DP},    {"SBC", DIS_DPIL},
+	{"INX", DIS_IMP},   {"SBC", DIS_IMM_M}, {"NOP", DIS_IMP},   {"XBA", DIS_IMP},   {"CPX", DIS_ABS},   {"SBC", DIS_ABS},   {"INC", DIS_ABS},   {"SBC", DIS_LONG},
+	{"BEQ", DIS_REL},   {"SBC", DIS_DPIY},  {"SBC", DIS_DPI},   {"SBC", DIS_SRIY},  {"PEA", DIS_PUSH},  {"SBC", DIS_DPX},   {"INC", DIS_DPX},   {"SBC", DIS_DPILY},
+	{"SED", DIS_IMP},   {"SBC", DIS_ABSY},  {"PLX", DIS_IMP},   {"XCE", DIS_IMP},   {"JSR", DIS_ABSIX}, {"SBC", DIS_ABSX},  {"INC", DIS_ABSX},  {"SBC", DIS_LONGX}
+};
+
+
+
+// Returns the length of an instruction in Bytes, mf/xf are the M and X flags (set = 8 bit, always set in Emulation mode)
+uint8_t cpuDisLength(uint8_t opcode, bool mf, bool xf){
+	switch(disTable[opcode].mode){
+		case DIS_IMP:
+		case DIS_ACC:
+		return 1;
+		
+		case DIS_IMM_M:
+		return mf ? 2 : 3;
+		
+		case DIS_IMM_X:
+		return xf ? 2 : 3;
+		
+		case DIS_ABS:
+		case DIS_ABSX:
+		case DIS_ABSY:
+		case DIS_ABSI:
+		case DIS_ABSIX:
+		case DIS_RELL:
+		case DIS_PUSH:
+		case DIS_MOVE:
+		return 3;
+		
+		case DIS_LONG:
+		case DIS_LONGX:
+		return 4;
+	}
+	return 2;
+}
+
+// Decodes an instruction from it's raw Bytes (up to 4, only as many as it uses are read), addr is where it's located
+// (PB:PC) for calculating branch targets. Returns it's length
+uint8_t cpuDisDecodeBytes(const uint8_t* bytes, uint32_t addr, bool mf, bool xf, cpuDisInst* I){
+	uint8_t pb = addr >> 16;
+	uint16_t pc = addr;
+	
+	memset(I, 0, sizeof(cpuDisInst));
+	I->addr = addr & 0x00FFFFFF;
+	I->opcode = bytes[0];
+	I->mode = disTable[I->opcode].mode;
+	I->name = disTable[I->opcode].name;
+	I->len = cpuDisLength(I->opcode, mf, xf);
+	
+	for (uint32_t i = 0; i < I->len; i++) I->bytes[i] = bytes[i];
+	for (uint32_t i = I->len; i > 1; i--) I->operand = (I->operand << 8) | I->bytes[i - 1];
+	
+	switch(I->mode){
+		case DIS_REL:
+			I->target = ((uint32_t)pb << 16) | (uint16_t)(pc + 2 + (int8_t)I->operand);
+			I->has_target = true;
+		break;
+		
+		case DIS_RELL:
+			I->target = ((uint32_t)pb << 16) | (uint16_t)(pc + 3 + (int16_t)I->operand);
+			I->has_target = true;
+		break;
+		
+		case DIS_ABS:		// JMP, JSR
+			if ((I->opcode == 0x4C) || (I->opcode == 0x20)){
+				I->target = ((uint32_t)pb << 16) | I->operand;
+				I->has_target = true;
+			}
+		break;
+		
+		case DIS_LONG:		// JML, JSL
+			if ((I->opcode == 0x5C) || (I->opcode == 0x22)){
+				I->target = I->operand;
+				I->has_target = true;
+			}
+		break;
+	}
+	
+	return I->len;
+}
+
+// Decodes the instruction at addr (PB:PC) in guest memory into I, returns it's length
+// The PC wraps around inside of the bank like it does when executing, Bytes outside of the memory read as 0
+uint8_t cpuDisDecode(const uint8_t* mem, uint32_t memSize, uint32_t addr, bool mf, bool xf, cpuDisInst* I){
+	uint8_t bytes[4];
+	uint32_t ad;
+	
+	for (uint32_t i = 0; i < 4; i++){
+		ad = (addr & 0x00FF0000) | ((addr + i) & 0x0000FFFF);
+		bytes[i] = (ad < memSize) ? mem[ad] : 0;
+	}
+	
+	return cpuDisDecodeBytes(bytes, addr, mf, xf, I);
+}
+
+// Writes the instruction as text ("LDA ($12),Y") into buf, returns the length of the text like snprintf
+uint32_t cpuDisFormat(const cpuDisInst* I, char* buf, uint32_t size){
+	uint32_t o = I->operand;
+	char bits[9];
+	
+	switch(I->mode){
+		case DIS_ACC:		return snprintf(buf, size, "%s A", I->name);
+		case DIS_IMM_M:
+		case DIS_IMM_X:		return snprintf(buf, size, (I->len == 2) ? "%s #$%02X" : "%s #$%04X", I->name, o);
+		case DIS_IMM8:		return snprintf(buf, size, "%s #$%02X", I->name, o);
+		case DIS_FLAGS:
+			for (uint32_t b = 0; b < 8; b++) bits[b] = (o & (0x80 >> b)) ? '1' : '0';
+			bits[8] = 0;
+		return snprintf(buf, size, "%s #%%%s", I->name, bits);
+		case DIS_DP:		return snprintf(buf, size, "%s $%02X", I->name, o);
+		case DIS_DPX:		return snprintf(buf, size, "%s $%02X,X", I->name, o);
+		case DIS_DPY:		return snprintf(buf, size, "%s $%02X,Y", I->name, o);
+		case DIS_DPI:		return snprintf(buf, size, "%s ($%02X)", I->name, o);
+		case DIS_DPIX:		return snprintf(buf, size, "%s ($%02X,X)", I->name, o);
+		case DIS_DPIY:		return snprintf(buf, size, "%s ($%02X),Y", I->name, o);
+		case DIS_DPIL:		return snprintf(buf, size, "%s [$%02X]", I->name, o);
+		case DIS_DPILY:		return snprintf(buf, size, "%s [$%02X],Y", I->name, o);
+		case DIS_ABS:		return snprintf(buf, size, "%s $%04X", I->name, o);
+		case DIS_ABSX:		return snprintf(buf, size, "%s $%04X,X", I->name, o);
+		case DIS_ABSY:		return snprintf(buf, size, "%s $%04X,Y", I->name, o);
+		case DIS_ABSI:		return snprintf(buf, size, "%s ($%04X)", I->name, o);
+		case DIS_ABSIX:		return snprintf(buf, size, "%s ($%04X,X)", I->name, o);
+		case DIS_LONG:		return snprintf(buf, size, "%s $%06X", I->name, o);
+		case DIS_LONGX:		return snprintf(buf, size, "%s $%06X,X", I->name, o);
+		case DIS_SR:		return snprintf(buf, size, "%s %u,S", I->name, o);
+		case DIS_SRIY:		return snprintf(buf, size, "%s (%u,S),Y", I->name, o);
+		case DIS_REL:
+		case DIS_RELL:		return snprintf(buf, size, "%s $%04X", I->name, I->target & 0x0000FFFF);
+		case DIS_PUSH:		return snprintf(buf, size, "%s #$%04X", I->name, o);
+		case DIS_MOVE:		return snprintf(buf, size, "%s $%02X,$%02X", I->name, I->bytes[2], I->bytes[1]);		// Source bank first
+	}
+	return snprintf(buf, size, "%s", I->name);
+}
+
+// Disassembles a single instruction into buf, returns it's length in Bytes
+uint32_t cpuDisasm(const uint8_t* mem, uint32_t memSize, uint32_t addr, bool mf, bool xf, char* buf, uint32_t size){
+	cpuDisInst I;
+	
+	cpuDisDecode(mem, memSize, addr, mf, xf, &I);
+	cpuDisFormat(&I, buf, size);
+	return I.len;
+}
+
+// Writes a listing of everything from addr up to end ("00C000  A9 34 12     LDA #$1234"), following REP and SEP
+// to keep track of M and X (what XCE or PLP do can't be known without running the code)
+// Returns the amount of instructions
+uint32_t cpuDisDump(const uint8_t* mem, uint32_t memSize, uint32_t addr, uint32_t end, bool mf, bool xf, FILE* fp){
+	cpuDisInst I;
+	char text[32];
+	uint32_t count = 0;
+	
+	while (addr < end){
+		addr += cpuDisDecode(mem, memSize, addr, mf, xf, &I);
+		cpuDisFormat(&I, text, sizeof(text));
+		
+		fprintf(fp, "%06X ", I.addr);
+		for (uint32_t i = 0; i < 4; i++){
+			if (i < I.len){
+				fprintf(fp, " %02X", I.bytes[i]);
+			}else{
+				fprintf(fp, "   ");
+			}
+		}
+		fprintf(fp, "  %s\n", text);
+		
+		if (I.opcode == 0xC2){			// REP
+			if (I.operand & 0x20) mf = false;
+			if (I.operand & 0x10) xf = false;
+		}else if (I.opcode == 0xE2){	// SEP
+			if (I.operand & 0x20) mf = true;
+			if (I.operand & 0x10) xf = true;
+		}
+		count++;
+	}
+	
+	return count;
+}
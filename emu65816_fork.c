@@ -0,0 +1,101 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+// Comment out this #define if compiling on a Big Endian System/CPU
+#define __EMU_LITTLE_ENDIAN
+
+#include "emu65816.h"
+
+
+
+// Copy-on-Write Forking
+// A Fork Base freezes a running CPU and an image of it's Memory (in an anonymous file), after which any amount of
+// children can be created from it. Every child maps the image privately, so the host OS shares all Pages between
+// the children and only copies a Page once a child writes to it. Creating a child costs the same no matter how
+// large the Memory is, and a child only uses as much Memory as it actually changed. The Base itself is the expensive
+// part, it writes the entire Memory into the image, so it's meant to be created once and forked from many times.
+// Children are normal CPUs, they can be run with cpuExecute, a cpuSched, or get Snapshots of their own.
+
+// Creates an empty anonymous file
+int static forkFile(void){
+	#ifdef __linux__
+	return memfd_create("emu65816", MFD_CLOEXEC);
+	#else
+	FILE *f = tmpfile();
+	return f ? dup(fileno(f)) : -1;		// (the FILE itself is closed at exit, the duplicate keeps the file alive)
+	#endif
+}
+
+// Freezes the current state of the CPU and it's Memory as a point to fork from
+// The CPU itself can keep running afterwards, the children won't see any of it's changes
+// Costs O(Memory size), the whole Memory is written into the image (the image can't be updated in place, children
+// that haven't written to a Page yet would see the change)
+// Returns false if the image couldn't be created
+bool cpuForkBaseInit(cpuState* CPU, cpuForkBase* BASE){
+	uint32_t done = 0;
+	ssize_t len;
+	
+	BASE->fd = forkFile();
+	if (BASE->fd < 0) return false;
+	
+	if (ftruncate(BASE->fd, CPU->mem_size)){
+		close(BASE->fd);
+		return false;
+	}
+	
+	while (done < CPU->mem_size){
+		len = pwrite(BASE->fd, CPU->mem + done, CPU->mem_size - done, done);
+		if (len <= 0){
+			close(BASE->fd);
+			return false;
+		}
+		done += len;
+	}
+	
+	BASE->cpu = *CPU;
+	BASE->mem_size = CPU->mem_size;
+	
+	return true;
+}
+
+// Creates a child of the Fork Base, with a copy-on-write view of it's Memory
+// The child gets the IO handlers of the original CPU, but no Snapshots, dirty Page tracking or instrumentation
+// (children usually run on other threads, they can't share the statistics, trace or profiler of the original)
+// Returns false if the Memory couldn't be mapped
+bool cpuFork(const cpuForkBase* BASE, cpuState* CHILD){
+	uint8_t *mem = mmap(NULL, BASE->mem_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, BASE->fd, 0);
+	
+	if (mem == MAP_FAILED) return false;
+	
+	*CHILD = BASE->cpu;
+	CHILD->mem = mem;
+	CHILD->dirty_map = NULL;
+	CHILD->dirty_mask = 0;
+	memset(CHILD->snaps, 0, sizeof(CHILD->snaps));
+	CHILD->stats = NULL;
+	CHILD->heat = NULL;
+	CHILD->perf = NULL;
+	CHILD->trace = NULL;
+	CHILD->prof = NULL;
+	CHILD->cov_map = NULL;
+	
+	return true;
+}
+
+// Releases the Memory of a child (any Snapshots of it have to be freed first)
+void cpuForkFree(cpuState* CHILD){
+	munmap(CHILD->mem, CHILD->mem_size);
+	CHILD->mem = NULL;
+}
+
+// Releases the image, children that still exist keep working
+void cpuForkBaseFree(cpuForkBase* BASE){
+	close(BASE->fd);
+	BASE->fd = -1;
+}
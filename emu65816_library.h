@@ -6,15 +6,52 @@
 
 
 #define dbg_printf(...)		if (DBG) printf(__VA_ARGS__);
+#ifdef __EMU_HEATMAP
+#define heatRead(ad)		if (CPU->heat) CPU->heat->reads[(ad) >> HEAT_PAGE_BITS]++
+#define heatWrite(ad)		if (CPU->heat) CPU->heat->writes[(ad) >> HEAT_PAGE_BITS]++
+#define heatFetch(ad)		if (CPU->heat) CPU->heat->fetches[(ad) >> HEAT_PAGE_BITS]++
+#else
+#define heatRead(ad)
+#define heatWrite(ad)
+#define heatFetch(ad)
+#endif
+#ifdef __EMU_TRACE
+#define traceInst(opc)		traceRecord(CPU, opc)
+#else
+#define traceInst(opc)
+#endif
+#ifdef __EMU_PROFILE
+#define profCall()			profPush(CPU)
+#define profReturn()		profPop(CPU)
+#else
+#define profCall()
+#define profReturn()
+#endif
+#ifdef __EMU_FUZZ
+#define fuzzEdge()			fuzzHit(CPU)
+#else
+#define fuzzEdge()
+#endif
+#ifdef __EMU_PERF
+#define perfCount(n)		(CPU->perf ? (void)CPU->perf->live.n++ : (void)0)
+#else
+#define perfCount(n)		((void)0)
+#endif
 #define chkIO(ad)			(((ad) >= IOB) && ((ad) < (IOB + IOS)))
 #define aaa(opc)			((opc >> 5) & 7U)
+#define cycleIndex(opc)		((EF ? 0x0400 : ((MF ? 0x0200 : 0x0000) | (XF ? 0x0100 : 0x0000))) | (opc))	// Index into the cycle table
 
 #define MEM					(CPU->mem)
 #define MES					(CPU->mem_size)
 #define IOB					(CPU->io_base)
 #define IOS					(CPU->io_size)
-#define IOR(a)				(CPU->io_read(a))
-#define IOW(a,v)			(CPU->io_write(a,v))
+#ifdef __EMU_HEATMAP
+#define IOR(a)				(perfCount(io_reads), heatIORead(CPU, a))
+#define IOW(a,v)			(perfCount(io_writes), heatIOWrite(CPU, a, v))
+#else
+#define IOR(a)				(perfCount(io_reads), CPU->io_read(a))
+#define IOW(a,v)			(perfCount(io_writes), CPU->io_write(a,v))
+#endif
 #define INT					(CPU->interrupt)
 #define DBG					(CPU->dbg)
 
@@ -63,6 +100,54 @@
 #define VECT_N_BRK			(0x0000FFE6)
 #define VECT_N_COP			(0x0000FFE4)
 
+enum{
+	RUN_CYCLES,
+	RUN_INSTRUCTIONS,
+	RUN_DEADLINE,
+	RUN_BREAKPOINT,
+	RUN_WAI,
+	RUN_STP
+};
+
+#define RUN_UNLIMITED		INT32_MAX
+
+#define MEM_PAGE_SHIFT		8
+#define MEM_PAGE_SIZE		(1UL << MEM_PAGE_SHIFT)
+#define MEM_PAGES(s)		(((s) + MEM_PAGE_SIZE - 1) >> MEM_PAGE_SHIFT)
+#define SNAP_MAX			8		// Snapshots that can be used with a CPU at the same time
+
+#define STATE_MAGIC			0x36313845UL	// "E816"
+#define STATE_VERSION		1
+#define STATE_FULL			0				// Saved State holds the entire Memory
+#define STATE_DELTA			1				// Saved State holds the Pages that differ from a Snapshot
+
+#define VIC_PEND			0x00
+#define VIC_ENABLE			0x04
+#define VIC_VECTOR			0x08
+#define VIC_SIZE			0x09
+
+#define VIC_NONE			0x80
+
+#define BATCH_LANES			16		// CPUs per Batch, a multiple of the SIMD width of the host
+
+// Processor modes of the execution statistics (e = emulation, m = memory/accu, x = index registers)
+enum{
+	STATS_MODE_M16X16,	// e0 m0 x0
+	STATS_MODE_M16X8,	// e0 m0 x1
+	STATS_MODE_M8X16,	// e0 m1 x0
+	STATS_MODE_M8X8,	// e0 m1 x1
+	STATS_MODE_EMU,		// e1
+	STATS_MODES
+};
+
+#define HEAT_PAGE_BITS		8		// The heatmap counts accesses per 256 Byte Page
+#define HEAT_PAGE_SIZE		(1UL << HEAT_PAGE_BITS)
+
+#define PROF_DEPTH			32		// Call depth the profiler keeps track of
+
+#define FUZZ_MAP_BITS		16
+#define FUZZ_MAP_SIZE		(1UL << FUZZ_MAP_BITS)	// Size of the coverage bitmap, same as AFL's default
+
 
 
 
@@ -172,12 +257,225 @@ typedef struct{
 	bool wai;			// WAI Instruction
 	bool stp;			// STP Instruction
 	uint8_t interrupt;	// Interrupt value (0 = no interrupts pending, 1 = IRQ, 2 = NMI, 3 = ABORT)
+	uint32_t irq_line;	// Level-triggered IRQ Line, one bit per IRQ source (taken while any bit is set and I is cleared)
+	
+	uint64_t cycle_count;	// Total amount of Cycles executed since cpuInit
+	
+	uint8_t *dirty_map;		// One Byte per memory Page, bit n is set once the Page was written to since Snapshot n was saved/loaded (NULL = no tracking)
+	uint8_t dirty_mask;		// Bits of all Snapshots in use
+	struct cpuSnapshot *snaps[SNAP_MAX];	// Snapshots in use, by their bit number
+	
+	// The fields of the optional instrumentation exist in every build, so the layout of cpuState is the same for the
+	// library and every program or object using it, no matter which __EMU_* options they were built with
+	struct cpuStats *stats;	// Execution statistics (NULL = not counted, only used with __EMU_STATS)
+	struct cpuHeatmap *heat;	// Memory and IO access counters (NULL = not counted, only used with __EMU_HEATMAP)
+	struct cpuPerf *perf;		// Runtime performance counters (NULL = not counted, only used with __EMU_PERF)
+	struct cpuTrace *trace;		// Binary execution trace (NULL = not traced, only used with __EMU_TRACE)
+	struct cpuProfile *prof;	// Sampling profiler (NULL = not profiled, only used with __EMU_PROFILE)
+	uint8_t *cov_map;		// AFL style edge coverage bitmap of FUZZ_MAP_SIZE Bytes (NULL = no coverage, only used with __EMU_FUZZ)
+	uint32_t cov_prev;		// Previous location, shifted right by one
 	
 } cpuState;
 
+#ifdef __EMU_STATS
+// Execution statistics, indexed like the cycle table: mode * 256 + opcode (see STATS_MODE_*)
+typedef struct cpuStats{
+	uint64_t count[STATS_MODES * 256];		// Times every opcode was executed in every mode
+	uint64_t cycles[STATS_MODES * 256];		// Cycles they were charged
+} cpuStats;
+#endif
+
+#ifdef __EMU_HEATMAP
+// Accesses to a single IO register, and the host time spent in the io_read/io_write handlers for it
+typedef struct{
+	uint64_t reads;
+	uint64_t writes;
+	uint64_t read_ns;
+	uint64_t write_ns;
+} cpuHeatIO;
+
+// Access counters per Page of HEAT_PAGE_SIZE Bytes and per IO register
+typedef struct cpuHeatmap{
+	uint64_t *reads;		// Data reads (including the stack)
+	uint64_t *writes;		// Data writes (including the stack)
+	uint64_t *fetches;		// Opcode and operand fetches
+	uint32_t pages;
+	cpuHeatIO *io;			// Indexed by the offset into the IO space
+	uint32_t io_size;
+} cpuHeatmap;
+#endif
+
+#ifdef __EMU_PERF
+// Totals since the counters were reset
+typedef struct{
+	uint64_t instructions;	// Instructions retired
+	uint64_t cycles;		// Cycles executed
+	uint64_t interrupts;	// IRQs, NMIs and ABORTs taken (BRK and COP are instructions)
+	uint64_t io_reads;		// Calls of the io_read handler
+	uint64_t io_writes;		// Calls of the io_write handler
+	uint64_t wai_cycles;	// Cycles handed to cpuExecute/cpuRun that were left over because the CPU waited in WAI
+	uint64_t host_ns;		// Host time spent inside cpuExecute/cpuRun
+} cpuPerfCounters;
+
+// Runtime performance counters, the CPU counts into live and publishes a copy at the end of every cpuRun, and every
+// PERF_INTERVAL instructions during long ones
+// (so another thread can read a consistent set with cpuPerfRead while the CPU keeps running)
+typedef struct cpuPerf{
+	cpuPerfCounters live;	// Only touched by the thread running the CPU
+	cpuPerfCounters pub;	// Published copy, guarded by seq
+	uint32_t seq;			// Odd while pub is being updated
+} cpuPerf;
+#endif
+
+#ifdef __EMU_TRACE
+// One executed instruction together with the registers from before it ran (32 Bytes)
+typedef struct{
+	uint64_t cycle;			// cycle_count at the start of the instruction
+	uint32_t pc;			// PB:PC of the opcode
+	uint8_t opcode;
+	uint8_t operand[3];		// The 3 Bytes after the opcode, however many it uses (0 if they are in IO space)
+	uint16_t a, x, y, sp, dp;
+	uint8_t db;
+	uint8_t sr;				// Status Register, like PHP pushes it
+	uint8_t e;				// Emulation Flag
+	uint8_t pad;
+} cpuTraceRec;
+
+// Ring of trace records, the CPU fills it and a writer thread drains it into a file (see emu65816_trace.c)
+typedef struct cpuTrace{
+	cpuTraceRec *buf;
+	uint32_t mask;			// Amount of records - 1 (always a power of 2)
+	bool lossy;				// Drop records while the ring is full instead of waiting for the writer
+	uint64_t dropped;		// Records dropped so far
+	void *writer;			// Writer thread
+	uint32_t head __attribute__((aligned(64)));		// Next record the CPU fills
+	uint32_t tail __attribute__((aligned(64)));		// Next record the writer drains
+} cpuTrace;
+#endif
+
+#ifdef __EMU_PROFILE
+// A distinct call stack seen by the profiler
+typedef struct{
+	uint64_t count;						// Samples taken with this stack
+	uint32_t hash;						// 0 = unused entry
+	uint32_t len;						// Amount of frames, the last one is the sampled PB:PC
+	uint32_t frames[PROF_DEPTH + 1];	// Return Addresses of the active calls, outermost first
+} cpuProfileStack;
+
+typedef struct{
+	uint32_t addr;
+	char *name;
+} cpuProfileSymbol;
+
+// Sampling profiler
+typedef struct cpuProfile{
+	uint32_t interval;			// Cycles between samples
+	uint64_t next;				// Cycle count of the next sample
+	uint64_t samples;			// Samples taken
+	uint32_t stack[PROF_DEPTH];	// Shadow call stack, kept up to date by JSR/JSL/RTS/RTL and interrupts/RTI
+	uint32_t depth;				// Depth of the call stack (only the outermost PROF_DEPTH frames are kept)
+	cpuProfileStack *table;		// Hash table of all distinct stacks
+	uint32_t table_size;
+	uint32_t used;
+	cpuProfileSymbol *syms;		// Symbols, sorted by Address
+	uint32_t sym_count;
+} cpuProfile;
+#endif
+
+// Snapshot of a CPU and it's Memory
+typedef struct cpuSnapshot{
+	cpuState cpu;		// CPU at the time of the Snapshot
+	uint8_t *mem;		// Copy of the Memory at the time of the Snapshot
+	uint32_t mem_size;	// Size of the copy
+	uint32_t generation;	// Counts up with every cpuSnapshotSave, deltas are only valid against the same generation
+	uint32_t *dirty_list;	// Numbers of all Pages written to since the last save/load, in the order they were first written to
+	uint32_t dirty_count;	// Length of the dirty list
+	uint8_t slot;			// Bit of the Snapshot in the CPU's dirty map
+} cpuSnapshot;
+
+// Stop conditions and results of cpuRun
+typedef struct{
+	int32_t cycles;				// Cycle budget, same as the cycles parameter of cpuExecute (RUN_UNLIMITED to effectively disable it)
+	uint32_t instructions;		// Instruction budget (0 = no limit)
+	uint64_t deadline;			// Stop once cycle_count reaches this value (0 = no deadline)
+	const uint32_t *breakpoints;	// List of 24-bit Addresses (PB:PC) to stop at, before the instruction there is executed
+	uint32_t bp_count;			// Length of the breakpoint list
+	
+	int32_t cycle_rem;			// Cycles left over, same as the return value of cpuExecute
+	uint32_t executed;			// Amount of instructions executed
+	uint8_t reason;				// Why the run stopped (RUN_*)
+} cpuRunCtl;
+
+// Vectored Interrupt Controller
+typedef struct{
+	cpuState *cpu;		// CPU the Controller drives
+	uint32_t lines;		// IRQ Lines of the connected Devices
+	uint32_t enable;	// Enable Mask (set by the guest)
+	uint8_t cpu_line;	// IRQ Line of the CPU the Controller is connected to
+} vicState;
+
+// Batch of CPUs that run the same code in lockstep
+typedef struct{
+	cpuState *cpu[BATCH_LANES];	// CPU of every lane
+	uint32_t count;				// Amount of lanes in use
+	int32_t rem[BATCH_LANES];	// Cycles every lane didn't use in the last cpuBatchExecute (same as cpuExecute's return value)
+	uint64_t lockstep;			// Instructions executed in lockstep (counted once for all lanes)
+	uint64_t scalar;			// Instructions executed by single lanes
+} cpuBatch;
+
 
 void cpuInit(cpuState* CPU, uint8_t* memory, uint32_t memSize, uint32_t ioAddress, uint32_t ioSize, uint8_t (*ioRead)(uint32_t), void (*ioWrite)(uint32_t, uint8_t));
 int32_t cpuExecute(cpuState* CPU, int32_t cycles);
+uint8_t cpuRun(cpuState* CPU, cpuRunCtl* RUN);
+uint8_t cpuStep(cpuState* CPU);
+uint64_t cpuNowNs(void);
+
+bool cpuSnapshotInit(cpuState* CPU, cpuSnapshot* SNAP);
+void cpuSnapshotSave(cpuState* CPU, cpuSnapshot* SNAP);
+void cpuSnapshotLoad(cpuState* CPU, cpuSnapshot* SNAP);
+void cpuSnapshotFree(cpuState* CPU, cpuSnapshot* SNAP);
+void cpuMarkDirty(cpuState* CPU, uint32_t addr, uint32_t size);
+uint32_t cpuSaveState(cpuState* CPU, const cpuSnapshot* BASE, uint8_t* buf, uint32_t size);
+bool cpuLoadState(cpuState* CPU, cpuSnapshot* BASE, const uint8_t* buf, uint32_t size);
+
+#ifdef __EMU_FUZZ
+uint8_t cpuFuzzRun(cpuState* CPU, cpuSnapshot* BASE, const uint8_t* data, uint32_t size, uint32_t addr, cpuRunCtl* RUN);
+#endif
+
+#ifdef __EMU_STATS
+void cpuStatsReset(cpuStats* ST);
+void cpuStatsDump(const cpuStats* ST, FILE* fp, bool json);
+#endif
+
+#ifdef __EMU_HEATMAP
+bool cpuHeatmapInit(cpuState* CPU, cpuHeatmap* H);
+void cpuHeatmapReset(cpuHeatmap* H);
+void cpuHeatmapDump(const cpuHeatmap* H, FILE* fp);
+void cpuHeatmapDumpIO(const cpuHeatmap* H, FILE* fp);
+void cpuHeatmapFree(cpuState* CPU, cpuHeatmap* H);
+#endif
+
+#ifdef __EMU_PERF
+void cpuPerfReset(cpuPerf* P);
+void cpuPerfRead(cpuPerf* P, cpuPerfCounters* out);
+#endif
+
+#ifdef __EMU_PROFILE
+bool cpuProfileInit(cpuState* CPU, cpuProfile* P, uint32_t interval);
+int32_t cpuProfileLoadSymbols(cpuProfile* P, const char* path);
+void cpuProfileDump(const cpuProfile* P, FILE* fp);
+void cpuProfileFree(cpuState* CPU, cpuProfile* P);
+#endif
+
+void vicInit(vicState* VIC, cpuState* CPU, uint8_t cpuLine);
+void vicAssert(vicState* VIC, uint8_t source);
+void vicDeassert(vicState* VIC, uint8_t source);
+uint8_t vicRead(vicState* VIC, uint32_t addr);
+void vicWrite(vicState* VIC, uint32_t addr, uint8_t val);
+
+void cpuBatchInit(cpuBatch* B);
+bool cpuBatchAdd(cpuBatch* B, cpuState* CPU);
+void cpuBatchExecute(cpuBatch* B, int32_t cycles);
 
 
 // --------------------------------------------------------------------- //
@@ -216,10 +514,178 @@ uint32_t static inline addrAbs(cpuState* CPU, uint32_t addr){
 
 // --------------------------------------------------------------------- //
 
+#ifdef __EMU_HEATMAP
+// Calls the io_read handler, and counts the access and the time the handler took if the heatmap is enabled
+uint8_t static inline heatIORead(cpuState* CPU, uint32_t addr){
+	uint64_t t0;
+	uint8_t val;
+	
+	if (!CPU->heat || (addr >= CPU->heat->io_size)) return CPU->io_read(addr);
+	t0 = cpuNowNs();
+	val = CPU->io_read(addr);
+	CPU->heat->io[addr].read_ns += cpuNowNs() - t0;
+	CPU->heat->io[addr].reads++;
+	return val;
+}
+
+void static inline heatIOWrite(cpuState* CPU, uint32_t addr, uint8_t in){
+	uint64_t t0;
+	
+	if (!CPU->heat || (addr >= CPU->heat->io_size)){
+		CPU->io_write(addr, in);
+		return;
+	}
+	t0 = cpuNowNs();
+	CPU->io_write(addr, in);
+	CPU->heat->io[addr].write_ns += cpuNowNs() - t0;
+	CPU->heat->io[addr].writes++;
+}
+#endif
+
+#ifdef __EMU_PERF
+#define PERF_INTERVAL		(1U << 16)		// Instructions between two publishes inside a long cpuRun (must be a power of 2)
+
+// Copies the live counters to the published ones (seqlock writer, only the thread running the CPU calls this)
+void static inline perfPublish(cpuPerf* P){
+	const uint64_t *src = (const uint64_t*)&P->live;
+	uint64_t *dst = (uint64_t*)&P->pub;
+	uint32_t seq = P->seq;
+	
+	__atomic_store_n(&P->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	for (uint32_t i = 0; i < (sizeof(cpuPerfCounters) / sizeof(uint64_t)); i++){
+		__atomic_store_n(&dst[i], src[i], __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&P->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+// Adds what a cpuRun call did since it started (or since the last publish in the middle of it) to the counters and
+// publishes them. Returns the host time, which is where the next part starts
+uint64_t static inline perfAdd(cpuState* CPU, uint32_t instructions, uint64_t cycles, uint64_t t0){
+	cpuPerf *P = CPU->perf;
+	uint64_t now = cpuNowNs();
+	
+	P->live.instructions += instructions;
+	P->live.cycles += cycles;
+	P->live.host_ns += now - t0;
+	perfPublish(P);
+	
+	return now;
+}
+
+// Same as above for the end of a cpuRun call, which also counts the cycles it left over in WAI
+void static inline perfUpdate(cpuState* CPU, const cpuRunCtl* RUN, uint32_t instructions, uint64_t cycles, uint64_t t0){
+	if ((RUN->reason == RUN_WAI) && (RUN->cycles != RUN_UNLIMITED) && (RUN->cycle_rem > 0)) CPU->perf->live.wai_cycles += RUN->cycle_rem;
+	perfAdd(CPU, instructions, cycles, t0);
+}
+#endif
+
+// Remembers that the Page containing ad was written to (only if dirty tracking is enabled)
+// The Page is added to the list of every Snapshot that doesn't already have it
+void static inline markDirty(cpuState* CPU, uint32_t ad){
+	uint32_t pg = ad >> MEM_PAGE_SHIFT;
+	uint8_t add;
+	
+	if (CPU->dirty_map && (CPU->dirty_map[pg] != CPU->dirty_mask)){
+		add = CPU->dirty_mask & ~CPU->dirty_map[pg];
+		for (uint8_t i = 0; i < SNAP_MAX; i++){
+			if (add & (1U << i)) CPU->snaps[i]->dirty_list[CPU->snaps[i]->dirty_count++] = pg;
+		}
+		CPU->dirty_map[pg] = CPU->dirty_mask;
+	}
+}
+
+#ifdef __EMU_PROFILE
+// Puts the current PB:PC on the profiler's shadow call stack, called by JSR/JSL/BRK/COP and interrupts before they
+// change PB:PC, so every frame points into the calling function (calls deeper than PROF_DEPTH are only counted)
+void static inline profPush(cpuState* CPU){
+	if (!CPU->prof) return;
+	if (CPU->prof->depth < PROF_DEPTH) CPU->prof->stack[CPU->prof->depth] = ((uint32_t)PB << 16U) | PC.w;
+	CPU->prof->depth++;
+}
+
+// Leaves the innermost function, returns that don't match a call (ie: stack tricks) are ignored
+void static inline profPop(cpuState* CPU){
+	if (!CPU->prof) return;
+	if (CPU->prof->depth) CPU->prof->depth--;
+}
+
+// Doubles the size of the stack table, returns false if there isn't enough memory
+bool static profGrow(cpuProfile* P){
+	uint32_t size = P->table_size ? P->table_size * 2 : 1024;
+	cpuProfileStack *tmp = calloc(size, sizeof(cpuProfileStack));
+	uint32_t n;
+	
+	if (!tmp) return false;
+	for (uint32_t i = 0; i < P->table_size; i++){
+		if (!P->table[i].hash) continue;
+		n = P->table[i].hash & (size - 1);
+		while (tmp[n].hash) n = (n + 1) & (size - 1);
+		tmp[n] = P->table[i];
+	}
+	
+	free(P->table);
+	P->table = tmp;
+	P->table_size = size;
+	return true;
+}
+
+// Takes a sample of the current call stack plus PB:PC, weighted by the amount of intervals that passed since the last one
+// (a long instruction or a slow IO access can step over more than one)
+void static profSample(cpuState* CPU){
+	cpuProfile *P = CPU->prof;
+	uint32_t frames[PROF_DEPTH + 1];
+	uint32_t len = (P->depth < PROF_DEPTH) ? P->depth : PROF_DEPTH;
+	uint32_t hash = 2166136261U, n;
+	uint64_t weight = (CPU->cycle_count - P->next) / P->interval + 1;
+	
+	P->next += weight * P->interval;
+	P->samples += weight;
+	
+	memcpy(frames, P->stack, len * sizeof(uint32_t));
+	frames[len++] = ((uint32_t)PB << 16U) | PC.w;
+	for (uint32_t i = 0; i < len; i++) hash = (hash ^ frames[i]) * 16777619U;
+	if (!hash) hash = 1;		// 0 marks unused entries
+	
+	if ((P->used + 1) * 4 > P->table_size * 3){
+		if (!profGrow(P)) return;		// Out of memory, the sample gets lost
+	}
+	
+	n = hash & (P->table_size - 1);
+	while (P->table[n].hash){
+		if ((P->table[n].hash == hash) && (P->table[n].len == len) && !memcmp(P->table[n].frames, frames, len * sizeof(uint32_t))) break;
+		n = (n + 1) & (P->table_size - 1);
+	}
+	
+	if (!P->table[n].hash){
+		P->table[n].hash = hash;
+		P->table[n].len = len;
+		memcpy(P->table[n].frames, frames, len * sizeof(uint32_t));
+		P->used++;
+	}
+	P->table[n].count += weight;
+}
+#endif
+
+#ifdef __EMU_FUZZ
+// Records the edge from the previous control transfer to the current PB:PC in the coverage bitmap, the same way AFL does
+void static inline fuzzHit(cpuState* CPU){
+	uint32_t cur;
+	
+	if (!CPU->cov_map) return;
+	cur = ((((uint32_t)PB << 16U) | PC.w) * 2654435761U) >> (32 - FUZZ_MAP_BITS);
+	CPU->cov_map[cur ^ CPU->cov_prev]++;
+	CPU->cov_prev = cur >> 1;
+}
+#endif
+
+// --------------------------------------------------------------------- //
+
 uint8_t static inline readDP(cpuState* CPU, uint32_t addr){
 	uint32_t ad = addrDP(CPU, addr);
 	
 	if (ad >= MES) return 0;		// Prevent accessing out of bounds
+	heatRead(ad);
 	if (chkIO(ad)) return IOR(ad - IOB);
 	return MEM[ad];
 }
@@ -228,6 +694,7 @@ uint8_t static inline readStack(cpuState* CPU, uint32_t addr){
 	uint32_t ad = addrStack(CPU, addr);
 	
 	if (ad >= MES) return 0;		// Prevent accessing out of bounds
+	heatRead(ad);
 	if (chkIO(ad)) return IOR(ad - IOB);
 	return MEM[ad];
 }
@@ -236,6 +703,7 @@ uint8_t static inline readAbs(cpuState* CPU, uint32_t addr){
 	uint32_t ad = addrAbs(CPU, addr);
 	
 	if (ad >= MES) return 0;		// Prevent accessing out of bounds
+	heatRead(ad);
 	if (chkIO(ad)) return IOR(ad - IOB);
 	return MEM[ad];
 }
@@ -244,6 +712,7 @@ uint8_t static inline readMem(cpuState* CPU, uint32_t addr){
 	uint32_t ad = addr & 0x00FFFFFF;
 	
 	if (ad >= MES) return 0;		// Prevent accessing out of bounds
+	heatRead(ad);
 	if (chkIO(ad)) return IOR(ad - IOB);
 	return MEM[ad];
 }
@@ -252,10 +721,12 @@ void static inline writeDP(cpuState* CPU, uint32_t addr, uint8_t in){
 	uint32_t ad = addrDP(CPU, addr);
 	
 	if (ad >= MES) return;			// Prevent accessing out of bounds
+	heatWrite(ad);
 	if (chkIO(ad)){
 		IOW(ad - IOB, in);
 		return;
 	}
+	markDirty(CPU, ad);
 	MEM[ad] = in;
 }
 
@@ -263,10 +734,12 @@ void static inline writeStack(cpuState* CPU, uint32_t addr, uint8_t in){
 	uint32_t ad = addrStack(CPU, addr);
 	
 	if (ad >= MES) return;			// Prevent accessing out of bounds
+	heatWrite(ad);
 	if (chkIO(ad)){
 		IOW(ad - IOB, in);
 		return;
 	}
+	markDirty(CPU, ad);
 	MEM[ad] = in;
 }
 
@@ -274,10 +747,12 @@ void static inline writeAbs(cpuState* CPU, uint32_t addr, uint8_t in){
 	uint32_t ad = addrAbs(CPU, addr);
 	
 	if (ad >= MES) return;			// Prevent accessing out of bounds
+	heatWrite(ad);
 	if (chkIO(ad)){
 		IOW(ad - IOB, in);
 		return;
 	}
+	markDirty(CPU, ad);
 	MEM[ad] = in;
 }
 
@@ -285,10 +760,12 @@ void static inline writeMem(cpuState* CPU, uint32_t addr, uint8_t in){
 	uint32_t ad = addr & 0x00FFFFFF;
 	
 	if (ad >= MES) return;			// Prevent accessing out of bounds
+	heatWrite(ad);
 	if (chkIO(ad)){
 		IOW(ad - IOB, in);
 		return;
 	}
+	markDirty(CPU, ad);
 	MEM[ad] = in;
 }
 
@@ -298,6 +775,7 @@ uint8_t static inline fetch(cpuState* CPU){
 	uint32_t ad = (PC.w++ | (PB << 16U)) & 0x00FFFFFF;
 	
 	if (ad >= MES) return 0;		// Prevent accessing out of bounds
+	heatFetch(ad);
 	if (chkIO(ad)) return IOR(ad - IOB);
 	return MEM[ad];
 }
@@ -311,6 +789,7 @@ uint8_t static inline pullStack(cpuState* CPU){
 	}
 	
 	if (ad >= MES) return 0;		// Prevent accessing out of bounds
+	heatRead(ad);
 	if (chkIO(ad)) return IOR(ad - IOB);
 	
 	return MEM[ad];
@@ -325,11 +804,13 @@ void static inline pushStack(cpuState* CPU, uint8_t in){
 	}
 	
 	if (ad >= MES) return;			// Prevent accessing out of bounds
+	heatWrite(ad);
 	if (chkIO(ad)){
 		IOW(ad - IOB, in);
 		return;
 	}
 	
+	markDirty(CPU, ad);
 	MEM[ad] = in;
 }
 
@@ -357,6 +838,71 @@ void static inline writeSR(cpuState* CPU, uint8_t in){
 	CPU->fl_n = !!(in & 0x80);
 }
 
+// Pushes the return state and loads the PC from the Vector of the given Interrupt type (1 = IRQ, 2 = NMI, 3 = ABORT)
+void static inline enterInterrupt(cpuState* CPU, uint8_t type){
+	profCall();
+	perfCount(interrupts);
+	if (EF){		// Emulation
+		pushStack(CPU, PC.bh);
+		pushStack(CPU, PC.bl);
+		pushStack(CPU, readSR(CPU) | SR_INT);
+		setD(false);
+		setI(true);
+		PC.bl = readMem(CPU, interruptTableE[type]);
+		PC.bh = readMem(CPU, interruptTableE[type] + 1);
+		PB = 0;
+	}else{			// Native
+		pushStack(CPU, PB);
+		pushStack(CPU, PC.bh);
+		pushStack(CPU, PC.bl);
+		pushStack(CPU, readSR(CPU));
+		setD(false);
+		setI(true);
+		PC.bl = readMem(CPU, interruptTableN[type]);
+		PC.bh = readMem(CPU, interruptTableN[type] + 1);
+		PB = 0;
+	}
+}
+
+#ifdef __EMU_TRACE
+// Appends the instruction that was just fetched (the opcode is at PC - 1) to the trace ring
+// If the ring is full this waits for the writer thread, or drops the record if the trace is lossy
+void static inline traceRecord(cpuState* CPU, uint8_t opcode){
+	cpuTrace *T = CPU->trace;
+	cpuTraceRec *R;
+	uint32_t head, ad;
+	
+	if (!T) return;
+	head = T->head;
+	while ((head - __atomic_load_n(&T->tail, __ATOMIC_ACQUIRE)) > T->mask){
+		if (T->lossy){
+			T->dropped++;
+			return;
+		}
+		sched_yield();
+	}
+	
+	R = &T->buf[head & T->mask];
+	R->cycle = CPU->cycle_count;
+	R->pc = ((uint32_t)PB << 16U) | (uint16_t)(PC.w - 1);
+	R->opcode = opcode;
+	for (uint32_t i = 0; i < 3; i++){
+		ad = ((uint32_t)PB << 16U) | (uint16_t)(PC.w + i);
+		R->operand[i] = ((ad < MES) && !chkIO(ad)) ? MEM[ad] : 0;		// Reading IO here would have side effects
+	}
+	R->a = A.w;
+	R->x = X.w;
+	R->y = Y.w;
+	R->sp = SP.w;
+	R->dp = DP.w;
+	R->db = DB;
+	R->sr = readSR(CPU);
+	R->e = EF;
+	
+	__atomic_store_n(&T->head, head + 1, __ATOMIC_RELEASE);
+}
+#endif
+
 // --------------------------------------------------------------------- //
 
 
@@ -0,0 +1,386 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+
+// Comment out this #define if compiling on a Big Endian System/CPU
+#define __EMU_LITTLE_ENDIAN
+
+#include "emu65816.h"
+
+
+
+// Multi-Instance Scheduler
+// Runs the slices of many independent CPUs on a pool of worker threads. Every instance has a home thread whose queue
+// it starts out in, threads work through their own queue first and steal from the other queues once it's empty.
+// An instance runs a batch of slices at a time and then goes back into the queue of the thread that ran it,
+// so instances stay on the same thread (and it's caches) unless the load is uneven.
+
+#define SCHED_RUN_SLICES		(4U)			// Slices an instance runs before it goes back into a queue
+
+
+typedef struct{
+	cpuState *cpu;
+	int32_t slice;							// Cycles per slice
+	int32_t rem;							// Cycles left over from the last slice (return value of cpuExecute)
+	void (*service)(cpuState*, void*);		// Called after every slice (send interrupts, handle IO, etc.), can be NULL
+	void *user;								// User pointer passed to the service function
+	uint32_t home;							// Home thread
+	uint32_t left;							// Slices left in the current run
+	cpuSchedStats stats;
+} schedInst;
+
+// Work queue of a thread, the owner takes from the bottom and thieves take from the top
+typedef struct{
+	pthread_mutex_t lock;
+	uint32_t *items;		// Instance numbers
+	uint32_t size;			// Capacity
+	uint32_t top;			// Oldest entry
+	uint32_t cnt;			// Amount of entries
+} schedQueue;
+
+typedef struct{
+	cpuSched *sched;
+	pthread_t thread;
+	uint32_t id;
+	schedQueue queue;
+} schedWorker;
+
+struct cpuSched{
+	schedInst *inst;		// All instances
+	uint32_t count;			// Amount of instances
+	uint32_t cap;			// Capacity of the instance array
+	
+	schedWorker *workers;
+	uint32_t threads;		// Amount of worker threads
+	bool pin;				// Pin every worker thread to it's own host core
+	
+	pthread_mutex_t lock;
+	pthread_cond_t start;	// Signals a new run to the workers
+	pthread_cond_t done;	// Signals the end of a run to cpuSchedRun
+	pthread_cond_t work;	// Wakes idle workers when there's something to steal or the run is over
+	uint32_t generation;	// Counts up with every run
+	uint32_t busy;			// Workers still working on the current run
+	uint32_t pending;		// Instances that still have slices left in the current run (atomic)
+	uint32_t queued;		// Instances waiting in a queue (atomic)
+	uint32_t idle;			// Workers sleeping on "work" (atomic)
+	bool quit;
+};
+
+// Instance the calling thread is currently running
+static __thread schedInst *current = NULL;
+
+
+// Queue Operations --------------------------------------------------------- //
+
+void static queuePush(schedQueue* q, uint32_t n){
+	pthread_mutex_lock(&q->lock);
+	q->items[(q->top + q->cnt++) % q->size] = n;
+	pthread_mutex_unlock(&q->lock);
+}
+
+// Takes the newest entry, returns false if the queue is empty
+bool static queuePop(schedQueue* q, uint32_t* n){
+	bool ok = false;
+	
+	pthread_mutex_lock(&q->lock);
+	if (q->cnt){
+		*n = q->items[(q->top + --q->cnt) % q->size];
+		ok = true;
+	}
+	pthread_mutex_unlock(&q->lock);
+	
+	return ok;
+}
+
+// Takes the oldest entry, returns false if the queue is empty
+bool static queueSteal(schedQueue* q, uint32_t* n){
+	bool ok = false;
+	
+	pthread_mutex_lock(&q->lock);
+	if (q->cnt){
+		*n = q->items[q->top];
+		q->top = (q->top + 1) % q->size;
+		q->cnt--;
+		ok = true;
+	}
+	pthread_mutex_unlock(&q->lock);
+	
+	return ok;
+}
+
+// Worker Threads ----------------------------------------------------------- //
+
+// Runs a batch of slices of an instance, returns true if it has slices left afterwards
+// A stolen instance moves it's home to the thief, so later runs start out on the thread that has it's data cached
+bool static runInstance(schedWorker* w, schedInst* in, bool stolen){
+	uint64_t t0 = cpuNowNs();
+	int32_t req;
+	
+	current = in;
+	if (stolen){
+		in->stats.steals++;
+		in->home = w->id;
+	}
+	
+	for (uint32_t i = 0; (i < SCHED_RUN_SLICES) && in->left; i++){
+		req = in->slice + in->rem;
+		in->rem = cpuExecute(in->cpu, req);
+		if (in->cpu->wai) in->rem = 0;		// A waiting CPU idles for the whole slice
+		
+		in->stats.cycles += req - in->rem;
+		in->stats.slices++;
+		in->left--;
+		
+		if (in->service) in->service(in->cpu, in->user);
+		if (in->cpu->stp) in->left = 0;
+	}
+	
+	current = NULL;
+	in->stats.ns += cpuNowNs() - t0;
+	
+	return in->left;
+}
+
+// Sleeps until another thread queues something that can be stolen, or the run is over
+void static schedIdle(cpuSched* S){
+	pthread_mutex_lock(&S->lock);
+	__atomic_add_fetch(&S->idle, 1, __ATOMIC_SEQ_CST);
+	while (!__atomic_load_n(&S->queued, __ATOMIC_SEQ_CST) && __atomic_load_n(&S->pending, __ATOMIC_ACQUIRE)){
+		pthread_cond_wait(&S->work, &S->lock);
+	}
+	__atomic_sub_fetch(&S->idle, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&S->lock);
+}
+
+// Puts an instance back into the worker's queue
+// The worker takes it out again right away, so idle workers are only woken if there's more than that in the queues
+// (a wake up that's missed because a worker is just about to sleep only costs parallelism, the owner still runs it)
+void static schedRequeue(schedWorker* w, uint32_t n){
+	cpuSched *S = w->sched;
+	
+	uint32_t queued = __atomic_add_fetch(&S->queued, 1, __ATOMIC_SEQ_CST);		// (counted first, so a thief can't take it below 0)
+	
+	queuePush(&w->queue, n);
+	if ((queued > 1) && __atomic_load_n(&S->idle, __ATOMIC_SEQ_CST)){
+		pthread_mutex_lock(&S->lock);
+		pthread_cond_signal(&S->work);
+		pthread_mutex_unlock(&S->lock);
+	}
+}
+
+void static schedWork(schedWorker* w){
+	cpuSched *S = w->sched;
+	uint32_t n;
+	bool found, stolen;
+	
+	while (__atomic_load_n(&S->pending, __ATOMIC_ACQUIRE)){
+		found = queuePop(&w->queue, &n);
+		stolen = !found;
+		
+		// Own queue is empty, try to steal from the others
+		for (uint32_t i = 1; !found && (i < S->threads); i++){
+			found = queueSteal(&S->workers[(w->id + i) % S->threads].queue, &n);
+		}
+		
+		if (!found){
+			schedIdle(S);		// Everything left is being run by other threads right now
+			continue;
+		}
+		__atomic_sub_fetch(&S->queued, 1, __ATOMIC_SEQ_CST);
+		
+		if (runInstance(w, &S->inst[n], stolen)){
+			schedRequeue(w, n);
+		}else if (!__atomic_sub_fetch(&S->pending, 1, __ATOMIC_ACQ_REL)){
+			// That was the last one, let the idle workers finish the run
+			pthread_mutex_lock(&S->lock);
+			pthread_cond_broadcast(&S->work);
+			pthread_mutex_unlock(&S->lock);
+		}
+	}
+}
+
+void static *schedWorkerMain(void* arg){
+	schedWorker *w = arg;
+	cpuSched *S = w->sched;
+	uint32_t gen = 0;
+	
+	#ifdef __linux__
+	if (S->pin){
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(w->id % sysconf(_SC_NPROCESSORS_ONLN), &set);
+		pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	}
+	#endif
+	
+	pthread_mutex_lock(&S->lock);
+	while(1){
+		while ((S->generation == gen) && !S->quit) pthread_cond_wait(&S->start, &S->lock);
+		if (S->quit) break;
+		gen = S->generation;
+		pthread_mutex_unlock(&S->lock);
+		
+		schedWork(w);
+		
+		pthread_mutex_lock(&S->lock);
+		if (!--S->busy) pthread_cond_signal(&S->done);
+	}
+	pthread_mutex_unlock(&S->lock);
+	
+	return NULL;
+}
+
+// Public Functions --------------------------------------------------------- //
+
+// Creates a scheduler with the given amount of worker threads (0 = one per host core)
+// If pin is set every worker is pinned to it's own host core (Linux only)
+// Returns NULL if the threads or memory couldn't be allocated
+cpuSched* cpuSchedCreate(uint32_t threads, bool pin){
+	cpuSched *S = calloc(1, sizeof(cpuSched));
+	
+	if (!S) return NULL;
+	if (!threads) threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (!threads) threads = 1;
+	
+	S->threads = threads;
+	S->pin = pin;
+	S->workers = calloc(threads, sizeof(schedWorker));
+	if (!S->workers){
+		free(S);
+		return NULL;
+	}
+	
+	pthread_mutex_init(&S->lock, NULL);
+	pthread_cond_init(&S->start, NULL);
+	pthread_cond_init(&S->done, NULL);
+	pthread_cond_init(&S->work, NULL);
+	
+	for (uint32_t i = 0; i < threads; i++){
+		S->workers[i].sched = S;
+		S->workers[i].id = i;
+		pthread_mutex_init(&S->workers[i].queue.lock, NULL);
+		
+		if (pthread_create(&S->workers[i].thread, NULL, schedWorkerMain, &S->workers[i])){
+			pthread_mutex_destroy(&S->workers[i].queue.lock);		// cpuSchedFree only cleans up the threads that exist
+			S->threads = i;
+			cpuSchedFree(S);
+			return NULL;
+		}
+	}
+	
+	return S;
+}
+
+// Adds an already initialized CPU to the scheduler, it will run "slice" cycles at a time and the service
+// function (if not NULL) is called after every slice, from whichever worker thread ran it
+// Returns the ID of the instance, or -1 if there isn't enough memory. Must not be called during cpuSchedRun
+int32_t cpuSchedAdd(cpuSched* S, cpuState* CPU, int32_t slice, void (*service)(cpuState*, void*), void* user){
+	schedInst *tmp;
+	
+	if (S->count == S->cap){
+		tmp = realloc(S->inst, (S->cap ? S->cap * 2 : 16) * sizeof(schedInst));
+		if (!tmp) return -1;
+		S->inst = tmp;
+		S->cap = S->cap ? S->cap * 2 : 16;
+	}
+	
+	memset(&S->inst[S->count], 0, sizeof(schedInst));
+	S->inst[S->count].cpu = CPU;
+	S->inst[S->count].slice = slice;
+	S->inst[S->count].service = service;
+	S->inst[S->count].user = user;
+	S->inst[S->count].home = S->count % S->threads;
+	
+	return S->count++;
+}
+
+// Runs every instance for the given amount of slices (or until it executes a STP instruction)
+// Returns the amount of instances that are still running afterwards, or -1 if there isn't enough memory (nothing ran)
+int32_t cpuSchedRun(cpuSched* S, uint32_t slices){
+	uint32_t *items;
+	int32_t running = 0;
+	
+	// Every queue has to be able to hold all instances, since they can move between threads
+	for (uint32_t i = 0; i < S->threads; i++){
+		if (S->workers[i].queue.size < S->count){
+			items = realloc(S->workers[i].queue.items, S->count * sizeof(uint32_t));
+			if (!items) return -1;
+			S->workers[i].queue.items = items;
+			S->workers[i].queue.size = S->count;
+		}
+		S->workers[i].queue.top = 0;
+		S->workers[i].queue.cnt = 0;
+	}
+	
+	// Put every instance into the queue of it's home thread
+	S->pending = 0;
+	for (uint32_t i = 0; i < S->count; i++){
+		S->inst[i].left = S->inst[i].cpu->stp ? 0 : slices;
+		if (S->inst[i].left){
+			queuePush(&S->workers[S->inst[i].home].queue, i);
+			S->pending++;
+		}
+	}
+	S->queued = S->pending;
+	
+	pthread_mutex_lock(&S->lock);
+	S->busy = S->threads;
+	S->generation++;
+	pthread_cond_broadcast(&S->start);
+	while (S->busy) pthread_cond_wait(&S->done, &S->lock);
+	pthread_mutex_unlock(&S->lock);
+	
+	for (uint32_t i = 0; i < S->count; i++){
+		if (!S->inst[i].cpu->stp) running++;
+	}
+	
+	return running;
+}
+
+// Copies the statistics of an instance, accumulated over all runs
+void cpuSchedGetStats(cpuSched* S, int32_t id, cpuSchedStats* stats){
+	if ((id < 0) || ((uint32_t)id >= S->count)){
+		memset(stats, 0, sizeof(cpuSchedStats));
+		return;
+	}
+	*stats = S->inst[id].stats;
+}
+
+// Returns the CPU that the calling thread is currently running (or NULL)
+// Meant for IO handlers, which don't get told which CPU they belong to
+cpuState* cpuSchedSelf(void){
+	return current ? current->cpu : NULL;
+}
+
+// Returns the user pointer of the instance the calling thread is currently running (or NULL)
+void* cpuSchedUser(void){
+	return current ? current->user : NULL;
+}
+
+// Stops the worker threads and frees the scheduler (the CPUs themselves are left alone)
+void cpuSchedFree(cpuSched* S){
+	pthread_mutex_lock(&S->lock);
+	S->quit = true;
+	pthread_cond_broadcast(&S->start);
+	pthread_mutex_unlock(&S->lock);
+	
+	for (uint32_t i = 0; i < S->threads; i++){
+		pthread_join(S->workers[i].thread, NULL);
+		pthread_mutex_destroy(&S->workers[i].queue.lock);
+		free(S->workers[i].queue.items);
+	}
+	
+	pthread_mutex_destroy(&S->lock);
+	pthread_cond_destroy(&S->start);
+	pthread_cond_destroy(&S->done);
+	pthread_cond_destroy(&S->work);
+	free(S->workers);
+	free(S->inst);
+	free(S);
+}
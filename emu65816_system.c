@@ -0,0 +1,413 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+
+// Comment out this #define if compiling on a Big Endian System/CPU
+#define __EMU_LITTLE_ENDIAN
+
+#include "emu65816.h"
+
+
+
+// Multi-CPU System
+// Runs several CPUs that share parts of their Memory and IO, each on it's own host thread, in quanta of a fixed
+// amount of cycles. The results only depend on the guest code, never on how the host threads happen to be scheduled:
+// - Shared Memory: every core works on it's own copy during a quantum. At the end of the quantum the bytes every core
+//   changed are merged into the shared contents in core order (so if 2 cores write the same byte, the higher core wins),
+//   and the result is copied back to all cores. Writes by other cores become visible at the next quantum.
+// - Shared IO: an access has to wait until it's the earliest one of all cores, ordered by the cycle it happens at within
+//   the quantum (and the core number if that's the same). Cores that are still running could still make an earlier
+//   access, so the waiting core stays blocked until every other core is either done with the quantum or waiting as well.
+//   Cores that access shared IO a lot end up running one after another, so it should be used for control registers only.
+// - Between quanta the service function runs on the calling thread, that's the place for interrupts and timers.
+
+#define SYS_CORES		(64U)		// Cores per System
+#define SYS_REGIONS		(16U)		// Shared Memory/IO regions per System
+
+enum{
+	CORE_RUNNING,
+	CORE_WAITING,		// Waiting to access shared IO
+	CORE_DONE			// Done with the current quantum
+};
+
+typedef struct{
+	uint32_t addr;
+	uint32_t size;
+} sysRegion;
+
+typedef struct{
+	cpuSystem *sys;
+	cpuState *cpu;
+	cpuSnapshot snap;						// Memory at the start of the quantum, to find out what the core changed
+	uint8_t (*io_read)(uint32_t);			// IO handlers of the core (the CPU itself calls the System's)
+	void (*io_write)(uint32_t, uint8_t);
+	pthread_t thread;
+	uint32_t id;
+	int32_t rem;							// Cycles left over from the last quantum
+	uint64_t start;							// Cycle count at the start of the quantum
+	uint64_t time;							// Cycle within the quantum of the shared IO access the core is waiting for
+	uint8_t state;
+} sysCore;
+
+struct cpuSystem{
+	sysCore *cores;
+	uint32_t count;
+	uint32_t cap;
+	int32_t quantum;						// Cycles per quantum
+	void (*service)(cpuSystem*, void*);		// Called between quanta, can be NULL
+	void *user;
+	
+	sysRegion mem[SYS_REGIONS];				// Shared Memory
+	uint32_t mem_count;
+	sysRegion io[SYS_REGIONS];				// Shared IO (Addresses as the IO handlers see them)
+	uint32_t io_count;
+	bool synced;							// All cores start with the same shared Memory
+	
+	uint8_t *changed;						// One Byte per Page, set if the merge changed the Page
+	uint32_t *changed_list;
+	uint32_t changed_count;
+	
+	pthread_mutex_t lock;
+	pthread_cond_t start;					// Signals a new quantum to the cores
+	pthread_cond_t update;					// Signals a change of any core's state
+	uint32_t generation;
+	uint32_t busy;							// Cores that aren't done with the quantum yet
+	bool quit;
+};
+
+// Core the calling thread is running
+static __thread sysCore *self = NULL;
+
+
+
+// Shared IO ---------------------------------------------------------------- //
+
+bool static inRegion(const sysRegion* r, uint32_t cnt, uint32_t addr){
+	for (uint32_t i = 0; i < cnt; i++){
+		if ((addr >= r[i].addr) && ((addr - r[i].addr) < r[i].size)) return true;
+	}
+	return false;
+}
+
+// Returns true if the core's access comes before the access of the other core
+bool static inline sysFirst(const sysCore* c, const sysCore* o){
+	return (c->time < o->time) || ((c->time == o->time) && (c->id < o->id));
+}
+
+// Blocks until it's the calling core's turn to access shared IO, returns with the lock held
+void static sysEnterIO(void){
+	cpuSystem *S = self->sys;
+	bool turn;
+	
+	pthread_mutex_lock(&S->lock);
+	self->time = self->cpu->cycle_count - self->start;
+	self->state = CORE_WAITING;
+	pthread_cond_broadcast(&S->update);
+	
+	while(1){
+		turn = true;
+		for (uint32_t i = 0; turn && (i < S->count); i++){
+			if (&S->cores[i] == self) continue;
+			if (S->cores[i].state == CORE_RUNNING) turn = false;
+			if ((S->cores[i].state == CORE_WAITING) && sysFirst(&S->cores[i], self)) turn = false;
+		}
+		if (turn) break;
+		pthread_cond_wait(&S->update, &S->lock);
+	}
+}
+
+void static sysLeaveIO(void){
+	cpuSystem *S = self->sys;
+	
+	self->state = CORE_RUNNING;
+	pthread_cond_broadcast(&S->update);
+	pthread_mutex_unlock(&S->lock);
+}
+
+uint8_t static sysRead(uint32_t addr){
+	uint8_t val;
+	
+	if (!inRegion(self->sys->io, self->sys->io_count, addr)) return self->io_read(addr);
+	
+	sysEnterIO();
+	val = self->io_read(addr);
+	sysLeaveIO();
+	
+	return val;
+}
+
+void static sysWrite(uint32_t addr, uint8_t val){
+	if (!inRegion(self->sys->io, self->sys->io_count, addr)){
+		self->io_write(addr, val);
+		return;
+	}
+	
+	sysEnterIO();
+	self->io_write(addr, val);
+	sysLeaveIO();
+}
+
+// Shared Memory ------------------------------------------------------------ //
+
+void static sysChanged(cpuSystem* S, uint32_t pg){
+	if (!S->changed[pg]){
+		S->changed[pg] = 1;
+		S->changed_list[S->changed_count++] = pg;
+	}
+}
+
+// Applies the bytes a core changed in shared Memory (compared to the start of the quantum) to the first core
+void static sysMergeCore(cpuSystem* S, sysCore* c, uint8_t* dst){
+	uint32_t pg, lo, hi;
+	
+	for (uint32_t i = 0; i < c->snap.dirty_count; i++){
+		pg = c->snap.dirty_list[i];
+		for (uint32_t r = 0; r < S->mem_count; r++){
+			lo = pg << MEM_PAGE_SHIFT;
+			hi = lo + MEM_PAGE_SIZE;
+			if (lo < S->mem[r].addr) lo = S->mem[r].addr;
+			if (hi > (S->mem[r].addr + S->mem[r].size)) hi = S->mem[r].addr + S->mem[r].size;
+			
+			for (uint32_t ad = lo; ad < hi; ad++){
+				if (c->cpu->mem[ad] != c->snap.mem[ad]){
+					dst[ad] = c->cpu->mem[ad];
+					sysChanged(S, pg);
+				}
+			}
+		}
+	}
+}
+
+// Merges the shared Memory of all cores in core order and gives every core the result
+// The merged contents are collected in the snapshot of core 0 (which is the shared contents at the start of the quantum)
+void static sysMerge(cpuSystem* S){
+	uint8_t *merged = S->cores[0].snap.mem;
+	uint32_t pg, lo, hi;
+	
+	for (uint32_t i = 0; i < S->count; i++){
+		sysMergeCore(S, &S->cores[i], merged);
+	}
+	
+	for (uint32_t i = 0; i < S->changed_count; i++){
+		pg = S->changed_list[i];
+		for (uint32_t r = 0; r < S->mem_count; r++){
+			lo = pg << MEM_PAGE_SHIFT;
+			hi = lo + MEM_PAGE_SIZE;
+			if (lo < S->mem[r].addr) lo = S->mem[r].addr;
+			if (hi > (S->mem[r].addr + S->mem[r].size)) hi = S->mem[r].addr + S->mem[r].size;
+			if (lo >= hi) continue;
+			
+			for (uint32_t c = 0; c < S->count; c++){
+				memcpy(S->cores[c].cpu->mem + lo, merged + lo, hi - lo);
+				cpuMarkDirty(S->cores[c].cpu, lo, hi - lo);
+			}
+		}
+		S->changed[pg] = 0;
+	}
+	S->changed_count = 0;
+	
+	// Start the next quantum from here
+	for (uint32_t c = 0; c < S->count; c++){
+		cpuSnapshotSave(S->cores[c].cpu, &S->cores[c].snap);
+	}
+}
+
+// Gives all cores the shared Memory of the first core
+void static sysSync(cpuSystem* S){
+	for (uint32_t r = 0; r < S->mem_count; r++){
+		for (uint32_t c = 1; c < S->count; c++){
+			memcpy(S->cores[c].cpu->mem + S->mem[r].addr, S->cores[0].cpu->mem + S->mem[r].addr, S->mem[r].size);
+			cpuMarkDirty(S->cores[c].cpu, S->mem[r].addr, S->mem[r].size);
+		}
+	}
+	for (uint32_t c = 0; c < S->count; c++){
+		cpuSnapshotSave(S->cores[c].cpu, &S->cores[c].snap);
+	}
+	S->synced = true;
+}
+
+// Core Threads ------------------------------------------------------------- //
+
+void static *sysCoreMain(void* arg){
+	sysCore *c = arg;
+	cpuSystem *S = c->sys;
+	uint32_t gen = 0;
+	int32_t req;
+	
+	self = c;
+	
+	pthread_mutex_lock(&S->lock);
+	while(1){
+		while ((S->generation == gen) && !S->quit) pthread_cond_wait(&S->start, &S->lock);
+		if (S->quit) break;
+		gen = S->generation;
+		pthread_mutex_unlock(&S->lock);
+		
+		req = S->quantum + c->rem;
+		c->rem = cpuExecute(c->cpu, req);
+		if (c->cpu->wai) c->rem = 0;		// A waiting CPU idles for the whole quantum
+		
+		pthread_mutex_lock(&S->lock);
+		c->state = CORE_DONE;
+		pthread_cond_broadcast(&S->update);
+		if (!--S->busy) pthread_cond_broadcast(&S->update);
+	}
+	pthread_mutex_unlock(&S->lock);
+	
+	return NULL;
+}
+
+// Public Functions --------------------------------------------------------- //
+
+// Creates an empty System that runs it's cores "quantum" cycles at a time
+// The service function (if not NULL) is called between quanta, from the thread that called cpuSystemRun
+cpuSystem* cpuSystemCreate(int32_t quantum, void (*service)(cpuSystem*, void*), void* user){
+	cpuSystem *S = calloc(1, sizeof(cpuSystem));
+	
+	if (!S) return NULL;
+	
+	S->quantum = quantum;
+	S->service = service;
+	S->user = user;
+	pthread_mutex_init(&S->lock, NULL);
+	pthread_cond_init(&S->start, NULL);
+	pthread_cond_init(&S->update, NULL);
+	
+	return S;
+}
+
+// Adds an already initialized CPU as the next core, all cores need the same Memory size
+// The System takes over the CPU's IO handlers (they are still called, but through the System) and one of it's Snapshots
+// Returns the number of the core, or -1 if the core couldn't be created (or there are already SYS_CORES)
+// Must not be called during cpuSystemRun
+int32_t cpuSystemAdd(cpuSystem* S, cpuState* CPU){
+	sysCore *c;
+	
+	if (S->count && (CPU->mem_size != S->cores[0].cpu->mem_size)) return -1;
+	
+	if (!S->count){
+		S->changed = calloc(MEM_PAGES(CPU->mem_size), sizeof(uint8_t));
+		S->changed_list = malloc(MEM_PAGES(CPU->mem_size) * sizeof(uint32_t));
+		if (!S->changed || !S->changed_list) return -1;
+	}
+	
+	// The cores can't move in memory once their threads are running, so they are allocated up front
+	if (!S->cap){
+		S->cores = calloc(SYS_CORES, sizeof(sysCore));
+		if (!S->cores) return -1;
+		S->cap = SYS_CORES;
+	}
+	if (S->count >= S->cap) return -1;
+	
+	c = &S->cores[S->count];
+	c->sys = S;
+	c->cpu = CPU;
+	c->id = S->count;
+	c->io_read = CPU->io_read;
+	c->io_write = CPU->io_write;
+	c->state = CORE_DONE;
+	if (!cpuSnapshotInit(CPU, &c->snap)) return -1;
+	
+	if (pthread_create(&c->thread, NULL, sysCoreMain, c)){
+		cpuSnapshotFree(CPU, &c->snap);
+		return -1;
+	}
+	
+	CPU->io_read = sysRead;
+	CPU->io_write = sysWrite;
+	S->synced = false;
+	
+	return S->count++;
+}
+
+// Makes a region of Memory shared between all cores, it starts out with the contents of core 0
+// Returns false if there are already SYS_REGIONS regions
+bool cpuSystemShareMem(cpuSystem* S, uint32_t addr, uint32_t size){
+	if (S->mem_count >= SYS_REGIONS) return false;
+	S->mem[S->mem_count].addr = addr;
+	S->mem[S->mem_count].size = size;
+	S->mem_count++;
+	S->synced = false;
+	return true;
+}
+
+// Makes a range of IO Addresses (as the IO handlers see them) shared, accesses to them are ordered between the cores
+// Returns false if there are already SYS_REGIONS regions
+bool cpuSystemShareIO(cpuSystem* S, uint32_t addr, uint32_t size){
+	if (S->io_count >= SYS_REGIONS) return false;
+	S->io[S->io_count].addr = addr;
+	S->io[S->io_count].size = size;
+	S->io_count++;
+	return true;
+}
+
+// Runs all cores for the given amount of quanta
+// Returns the amount of quanta run, which is less if all cores executed a STP instruction
+uint32_t cpuSystemRun(cpuSystem* S, uint32_t quanta){
+	uint32_t q, stopped;
+	
+	if (!S->count) return 0;
+	if (!S->synced) sysSync(S);
+	
+	for (q = 0; q < quanta; q++){
+		stopped = 0;
+		for (uint32_t c = 0; c < S->count; c++){
+			if (S->cores[c].cpu->stp) stopped++;
+		}
+		if (stopped == S->count) break;
+		
+		pthread_mutex_lock(&S->lock);
+		for (uint32_t c = 0; c < S->count; c++){
+			S->cores[c].start = S->cores[c].cpu->cycle_count;
+			S->cores[c].state = CORE_RUNNING;
+		}
+		S->busy = S->count;
+		S->generation++;
+		pthread_cond_broadcast(&S->start);
+		while (S->busy) pthread_cond_wait(&S->update, &S->lock);
+		pthread_mutex_unlock(&S->lock);
+		
+		sysMerge(S);
+		if (S->service) S->service(S, S->user);
+	}
+	
+	return q;
+}
+
+// Returns the number of the core the calling thread is running (or -1)
+// Meant for IO handlers, which don't get told which CPU they belong to
+int32_t cpuSystemCore(void){
+	return self ? (int32_t)self->id : -1;
+}
+
+// Returns the CPU of a core (or NULL)
+cpuState* cpuSystemGetCore(cpuSystem* S, uint32_t n){
+	return (n < S->count) ? S->cores[n].cpu : NULL;
+}
+
+// Stops the core threads and frees the System, the CPUs get their own IO handlers back
+void cpuSystemFree(cpuSystem* S){
+	pthread_mutex_lock(&S->lock);
+	S->quit = true;
+	pthread_cond_broadcast(&S->start);
+	pthread_mutex_unlock(&S->lock);
+	
+	for (uint32_t c = 0; c < S->count; c++){
+		pthread_join(S->cores[c].thread, NULL);
+		cpuSnapshotFree(S->cores[c].cpu, &S->cores[c].snap);
+		S->cores[c].cpu->io_read = S->cores[c].io_read;
+		S->cores[c].cpu->io_write = S->cores[c].io_write;
+	}
+	
+	pthread_mutex_destroy(&S->lock);
+	pthread_cond_destroy(&S->start);
+	pthread_cond_destroy(&S->update);
+	free(S->changed);
+	free(S->changed_list);
+	free(S->cores);
+	free(S);
+}
@@ -0,0 +1,133 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+// Comment out this #define if compiling on a Big Endian System/CPU
+#define __EMU_LITTLE_ENDIAN
+
+// The library has to be built with __EMU_TRACE as well (gcc emu65816.c -D__EMU_TRACE ...)
+#ifndef __EMU_TRACE
+#define __EMU_TRACE
+#endif
+
+#include "emu65816.h"
+
+
+
+// Binary Execution Trace
+// Instead of formatting text for every instruction (like DBG does), the CPU copies a fixed size record into a ring
+// and a writer thread drains the ring into a file in large blocks. A trace file starts with an 8 Byte header
+// (TRACE_MAGIC, TRACE_VERSION and the record size) followed by the records in the byte order of the host.
+// tracedump.c turns it back into text.
+
+#define TRACE_IDLE_NS		(100000L)		// How long the writer sleeps when the ring is empty
+
+
+typedef struct{
+	cpuTrace *trace;
+	FILE *fp;
+	pthread_t thread;
+	bool quit;
+	bool error;
+} traceWriter;
+
+
+
+void static *traceWriterMain(void* arg){
+	traceWriter *W = arg;
+	cpuTrace *T = W->trace;
+	struct timespec idle = {0, TRACE_IDLE_NS};
+	uint32_t head, tail = T->tail, n;
+	bool quit;
+	
+	while(1){
+		// Read quit first, so records pushed right before cpuTraceStop are still written out
+		quit = __atomic_load_n(&W->quit, __ATOMIC_ACQUIRE);
+		head = __atomic_load_n(&T->head, __ATOMIC_ACQUIRE);
+		
+		if (head == tail){
+			if (quit) break;
+			nanosleep(&idle, NULL);
+			continue;
+		}
+		
+		// Write everything up to the end of the buffer, the part that wrapped around follows in the next round
+		n = head - tail;
+		if (n > ((T->mask + 1) - (tail & T->mask))) n = (T->mask + 1) - (tail & T->mask);
+		if (fwrite(&T->buf[tail & T->mask], sizeof(cpuTraceRec), n, W->fp) != n) W->error = true;
+		
+		tail += n;
+		__atomic_store_n(&T->tail, tail, __ATOMIC_RELEASE);
+	}
+	
+	return NULL;
+}
+
+// Starts tracing the CPU into the file at path, through a ring of the given amount of records (rounded up to a
+// power of 2). If lossy is set the CPU drops records while the ring is full, otherwise it waits for the writer
+// Returns NULL if the file couldn't be created or there isn't enough memory
+cpuTrace* cpuTraceStart(cpuState* CPU, const char* path, uint32_t records, bool lossy){
+	cpuTrace *T;
+	traceWriter *W;
+	uint32_t size = 1024;
+	uint32_t magic = TRACE_MAGIC;
+	uint16_t hdr[2] = {TRACE_VERSION, sizeof(cpuTraceRec)};
+	
+	while ((size < records) && (size < 0x80000000U)) size <<= 1;
+	
+	T = aligned_alloc(64, sizeof(cpuTrace));
+	W = calloc(1, sizeof(traceWriter));
+	if (!T || !W){
+		free(T);
+		free(W);
+		return NULL;
+	}
+	memset(T, 0, sizeof(cpuTrace));
+	
+	T->buf = malloc(size * sizeof(cpuTraceRec));
+	W->fp = fopen(path, "wb");
+	if (!T->buf || !W->fp) goto fail;
+	
+	T->mask = size - 1;
+	T->lossy = lossy;
+	T->writer = W;
+	W->trace = T;
+	
+	fwrite(&magic, sizeof(magic), 1, W->fp);
+	fwrite(hdr, sizeof(hdr), 1, W->fp);
+	if (pthread_create(&W->thread, NULL, traceWriterMain, W)) goto fail;
+	
+	CPU->trace = T;
+	return T;
+	
+	fail:
+	if (W->fp) fclose(W->fp);
+	free(T->buf);
+	free(T);
+	free(W);
+	return NULL;
+}
+
+// Detaches the trace from the CPU, writes out what is left in the ring and closes the file
+// Returns the amount of records that were dropped (lossy traces only), or UINT64_MAX if the file couldn't be written
+uint64_t cpuTraceStop(cpuState* CPU, cpuTrace* T){
+	traceWriter *W = T->writer;
+	uint64_t dropped = T->dropped;
+	
+	if (CPU->trace == T) CPU->trace = NULL;
+	
+	__atomic_store_n(&W->quit, true, __ATOMIC_RELEASE);
+	pthread_join(W->thread, NULL);
+	if (fclose(W->fp)) W->error = true;
+	if (W->error) dropped = UINT64_MAX;
+	
+	free(T->buf);
+	free(T);
+	free(W);
+	return dropped;
+}
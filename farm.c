@@ -0,0 +1,461 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#define __EMU_LITTLE_ENDIAN
+
+#include "emu65816.h"
+
+
+
+// Emulation Farm, runs a list of jobs (ROM + input) on many worker processes at once
+// The workers are forked from the farm and pull jobs from a queue in shared memory, the results end up in a table
+// that's shared as well. A guest that manages to crash the emulator only takes down it's own worker, the job is
+// marked as crashed and a new worker takes it's place.
+// Jobs see the same IO as main.c (UART with the input file as keys, timer with an IRQ every 10"ms"), minus file IO
+
+#define CLOCK		(160000U)				// Cycles per timer tick (10ms at 16MHz, same as main.c)
+#define FARM_BATCH	(4U)					// Jobs a worker takes from the queue at a time
+#define PATH_LEN	(256U)
+
+// Exit states of a job
+enum{
+	JOB_PENDING,
+	JOB_STP,		// The guest executed a STP instruction
+	JOB_LIMIT,		// Ran out of cycles
+	JOB_ERROR,		// The ROM or input couldn't be loaded, or no worker could be started to run it
+	JOB_CRASH		// The worker process died while running it
+};
+
+const char *jobStates[] = {"pending", "stp", "limit", "error", "crash"};
+
+typedef struct{
+	char rom[PATH_LEN];
+	char input[PATH_LEN];		// Empty = no input
+	uint64_t limit;				// Cycle limit
+} farmJob;
+
+typedef struct{
+	uint64_t cycles;			// Cycles executed
+	uint64_t instructions;		// Instructions executed
+	uint64_t ns;				// Host time
+	uint32_t outLen;			// Amount of Bytes the guest sent to the UART
+	uint32_t outHash;			// FNV-1a hash of them
+	uint16_t a, x, y, pc;		// Registers at the end
+	uint8_t pb;
+	uint8_t state;				// JOB_*
+	int16_t worker;				// Worker that ran it (-1 = none)
+} farmResult;
+
+// Batch of jobs a worker took from the queue, kept in shared memory so a replacement can finish it after a crash
+typedef struct{
+	uint32_t job;				// Next job of the batch
+	uint32_t end;				// End of the batch
+	bool busy;					// Set while the job is running
+} farmSlot;
+
+#define FARM_MAX_WORKERS	(1024U)
+
+// Everything the workers share, the jobs themselves are inherited by fork
+typedef struct{
+	uint32_t next;				// Next job in the queue (atomic)
+	uint32_t done;				// Amount of finished jobs (atomic)
+	farmSlot slots[FARM_MAX_WORKERS];
+	farmResult results[];
+} farmShared;
+
+farmJob *jobs;
+uint32_t jobCount = 0;
+farmShared *shared;
+
+uint32_t workers = 0;			// 0 = one per host core
+uint64_t cycleLimit = 1000000000ULL;
+uint32_t memSize = 1024U * 1024U * 4;
+uint32_t loadAddr = 0x008000;
+uint32_t ioAddr = 0x00FE00;
+bool pin = false;
+
+bool parseOptions(int argc, char* argv[]);
+bool readJobs(const char* path);
+void runWorker(uint32_t id);
+
+
+// Guest IO of the job a worker is running
+uint8_t *input;
+uint32_t inLen, inPos;
+uint32_t outLen, outHash;
+cint32_t timer, tmpTimer;
+uint8_t farmReadIO(uint32_t addr);
+void farmWriteIO(uint32_t addr, uint8_t val);
+
+
+
+
+int main(int argc, char* argv[]){
+	pid_t *pids;
+	int status;
+	pid_t pid;
+	uint32_t alive, crashed = 0;
+	uint64_t t0, total = 0;
+	size_t size;
+	
+	if (argc < 2){
+		printf("Usage: %s jobfile [workers=N] [cycles=N] [mem=N] [load=ADDR] [io=ADDR] [pin=1]\n", argv[0]);
+		printf("Every line of the jobfile is \"rom.bin [input.bin|-] [cycles]\"\n");
+		return -1;
+	}
+	
+	if (!parseOptions(argc, argv)) return -1;
+	if (!readJobs(argv[1])) return -1;
+	
+	if (!workers) workers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (workers > jobCount) workers = jobCount;
+	if (workers > FARM_MAX_WORKERS) workers = FARM_MAX_WORKERS;
+	if (!workers) workers = 1;
+	
+	// The queue and result table are shared with all workers
+	size = sizeof(farmShared) + jobCount * sizeof(farmResult);
+	shared = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	pids = calloc(workers, sizeof(pid_t));
+	if ((shared == MAP_FAILED) || !pids){
+		printf("Couldn't allocate the shared memory!\n");
+		return -1;
+	}
+	
+	fprintf(stderr, "[FARM] %u jobs on %u workers\n", jobCount, workers);
+	fflush(stdout);
+	t0 = cpuNowNs();
+	
+	alive = 0;
+	for (uint32_t i = 0; i < workers; i++){
+		pids[i] = fork();
+		if (!pids[i]) runWorker(i);
+		if (pids[i] > 0) alive++;
+	}
+	if (alive < workers) fprintf(stderr, "[FARM] Only %u of %u workers could be started\n", alive, workers);
+	
+	// Wait for the workers, replacing any that crash in the middle of a job
+	while (alive){
+		pid = wait(&status);
+		if (pid < 0) break;
+		
+		for (uint32_t i = 0; i < workers; i++){
+			if (pids[i] != pid) continue;
+			
+			if (!shared->slots[i].busy){
+				alive--;
+				break;
+			}
+			
+			// The job it was running is lost, record that and let a new worker finish the rest of the batch
+			shared->results[shared->slots[i].job].state = JOB_CRASH;
+			shared->slots[i].job++;
+			shared->slots[i].busy = false;
+			__atomic_add_fetch(&shared->done, 1, __ATOMIC_RELEASE);
+			crashed++;
+			
+			pids[i] = fork();
+			if (!pids[i]) runWorker(i);
+			if (pids[i] < 0) alive--;		// The rest of it's batch is marked as failed below
+			break;
+		}
+	}
+	t0 = cpuNowNs() - t0;
+	
+	// Jobs that no worker got to (because workers couldn't be started) failed
+	for (uint32_t i = 0; i < jobCount; i++){
+		if (shared->results[i].state != JOB_PENDING) continue;
+		shared->results[i].state = JOB_ERROR;
+		shared->results[i].worker = -1;
+	}
+	
+	// Print the result table as CSV
+	printf("job,rom,input,state,cycles,instructions,out_len,out_hash,a,x,y,pb,pc,worker,us\n");
+	for (uint32_t i = 0; i < jobCount; i++){
+		farmResult *r = &shared->results[i];
+		printf("%u,%s,%s,%s,%llu,%llu,%u,%08X,%04X,%04X,%04X,%02X,%04X,%d,%llu\n", i, jobs[i].rom, jobs[i].input[0] ? jobs[i].input : "-",
+			jobStates[r->state], (unsigned long long)r->cycles, (unsigned long long)r->instructions, r->outLen, r->outHash,
+			r->a, r->x, r->y, r->pb, r->pc, r->worker, (unsigned long long)(r->ns / 1000));
+		total += r->cycles;
+	}
+	
+	fprintf(stderr, "[FARM] %u jobs done in %.3f s, %u crashed, %.3f MHz total\n", shared->done, t0 / 1e9, crashed,
+		(double)total * 1000.0 / (t0 ? t0 : 1));
+	
+	munmap(shared, size);
+	free(pids);
+	free(jobs);
+	return 0;
+}
+
+
+
+
+// Parses the optional "name=value" Arguments following the job file
+// Returns false if an Argument is unknown or malformed
+bool parseOptions(int argc, char* argv[]){
+	char *val;
+	
+	for (int i = 2; i < argc; i++){
+		val = strchr(argv[i], '=');
+		if (!val){
+			printf("Argument \"%s\" is not of the form name=value!\n", argv[i]);
+			return false;
+		}
+		val++;
+		
+		if (!strncmp(argv[i], "workers=", 8)){			// Amount of worker processes (0 = one per host core)
+			workers = strtoul(val, NULL, 0);
+		}else if (!strncmp(argv[i], "cycles=", 7)){		// Default cycle limit of a job
+			cycleLimit = strtoull(val, NULL, 0);
+		}else if (!strncmp(argv[i], "mem=", 4)){			// Memory size of every job
+			memSize = strtoul(val, NULL, 0);
+		}else if (!strncmp(argv[i], "load=", 5)){		// Address the ROM is loaded to
+			loadAddr = strtoul(val, NULL, 0);
+		}else if (!strncmp(argv[i], "io=", 3)){			// Start of the 256 Byte IO space
+			ioAddr = strtoul(val, NULL, 0);
+		}else if (!strncmp(argv[i], "pin=", 4)){			// Pin every worker to it's own host core
+			pin = strtoul(val, NULL, 0);
+		}else{
+			printf("Unknown Argument \"%s\"!\n", argv[i]);
+			return false;
+		}
+	}
+	
+	return true;
+}
+
+// Reads the job file, every line is "rom.bin [input.bin|-] [cycles]", empty lines and lines starting with # are skipped
+// Returns false if the file couldn't be read or has no jobs
+bool readJobs(const char* path){
+	FILE *fp;
+	char line[1024], rom[PATH_LEN], in[PATH_LEN];
+	unsigned long long limit;
+	uint32_t cap = 0;
+	farmJob *tmp;
+	int n;
+	
+	fp = fopen(path, "r");
+	if (!fp){
+		printf("Job file not found!\n");
+		return false;
+	}
+	
+	while (fgets(line, sizeof(line), fp)){
+		limit = cycleLimit;
+		n = sscanf(line, "%255s %255s %llu", rom, in, &limit);
+		if ((n < 1) || (rom[0] == '#')) continue;
+		
+		if (jobCount == cap){
+			tmp = realloc(jobs, (cap ? cap * 2 : 64) * sizeof(farmJob));
+			if (!tmp){
+				fclose(fp);
+				return false;
+			}
+			jobs = tmp;
+			cap = cap ? cap * 2 : 64;
+		}
+		
+		strcpy(jobs[jobCount].rom, rom);
+		strcpy(jobs[jobCount].input, ((n >= 2) && strcmp(in, "-")) ? in : "");
+		jobs[jobCount].limit = limit;
+		jobCount++;
+	}
+	fclose(fp);
+	
+	if (!jobCount){
+		printf("No jobs in the job file!\n");
+		return false;
+	}
+	
+	return true;
+}
+
+// Opens and Reads a file as binary into a newly allocated buffer
+// Returns NULL if the file couldn't be read
+uint8_t static *readFile(const char* path, uint32_t* size){
+	FILE *fp;
+	uint8_t *buf;
+	long len;
+	
+	fp = fopen(path, "rb");
+	if (!fp) return NULL;
+	
+	fseek(fp, 0, SEEK_END);
+	len = ftell(fp);
+	rewind(fp);
+	if (len < 0){
+		fclose(fp);
+		return NULL;
+	}
+	
+	buf = malloc(len ? len : 1);
+	if (buf && (fread(buf, 1, len, fp) != (size_t)len)){
+		free(buf);
+		buf = NULL;
+	}
+	fclose(fp);
+	
+	*size = len;
+	return buf;
+}
+
+// Runs a single job on the worker with the given id, the Memory is reused between the jobs of a worker
+void runJob(cpuState* CPU, uint8_t* memory, farmJob* job, farmResult* res, uint32_t id){
+	cpuRunCtl run;
+	uint8_t *rom;
+	uint32_t romSize, slice;
+	uint64_t ran;
+	int32_t tickRem = CLOCK;
+	uint64_t elapsed = 0;			// Emulated cycles, including the ones spent waiting in WAI
+	uint64_t t0 = cpuNowNs();
+	
+	// Every field is filled in, even if the job can't be loaded
+	memset(res, 0, sizeof(farmResult));
+	res->worker = id;
+	
+	rom = readFile(job->rom, &romSize);
+	input = NULL;
+	inLen = 0;
+	if (job->input[0]) input = readFile(job->input, &inLen);
+	
+	if (!rom || (job->input[0] && !input) || (loadAddr >= memSize) || (romSize > (memSize - loadAddr))){
+		res->state = JOB_ERROR;
+		res->ns = cpuNowNs() - t0;
+		free(rom);
+		free(input);
+		return;
+	}
+	
+	memset(memory, 0, memSize);
+	memcpy(memory + loadAddr, rom, romSize);
+	free(rom);
+	inPos = 0;
+	outLen = 0;
+	outHash = 2166136261UL;
+	timer.l = 0;
+	tmpTimer.l = 0;
+	
+	cpuInit(CPU, memory, memSize, ioAddr, 256, farmReadIO, farmWriteIO);
+	
+	// Run in timer ticks until the guest stops or the cycle limit is reached
+	memset(&run, 0, sizeof(run));
+	while (!chkSTP((*CPU)) && (elapsed < job->limit)){
+		slice = tickRem;
+		if (slice > (job->limit - elapsed)) slice = job->limit - elapsed;
+		run.cycles = slice;
+		ran = CPU->cycle_count;
+		cpuRun(CPU, &run);
+		res->instructions += run.executed;
+		ran = CPU->cycle_count - ran;
+		
+		// A waiting CPU idles for the whole slice
+		if (chkWAI((*CPU))) ran = slice;
+		
+		elapsed += ran;
+		tickRem -= ran;
+		if (tickRem <= 0){
+			cpuSendIRQ((*CPU));
+			timer.l++;
+			tickRem += CLOCK;
+		}
+	}
+	free(input);
+	
+	res->state = chkSTP((*CPU)) ? JOB_STP : JOB_LIMIT;
+	res->cycles = elapsed;
+	res->outLen = outLen;
+	res->outHash = outHash;
+	res->a = CPU->reg_a.w;
+	res->x = CPU->reg_x.w;
+	res->y = CPU->reg_y.w;
+	res->pb = CPU->reg_pb;
+	res->pc = CPU->reg_pc.w;
+	res->ns = cpuNowNs() - t0;
+}
+
+// Main function of a worker process, takes batches of jobs from the queue until it's empty
+void runWorker(uint32_t id){
+	farmSlot *slot = &shared->slots[id];
+	cpuState CPU;
+	uint8_t *memory;
+	
+	#ifdef __linux__
+	if (pin){
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(id % sysconf(_SC_NPROCESSORS_ONLN), &set);
+		sched_setaffinity(0, sizeof(set), &set);
+	}
+	#endif
+	
+	memory = malloc(memSize);
+	if (!memory) _exit(1);
+	
+	while(1){
+		// Start a new batch once the last one is done (a replacement worker finishes the batch of the crashed one first)
+		if (slot->job >= slot->end){
+			slot->job = __atomic_fetch_add(&shared->next, FARM_BATCH, __ATOMIC_ACQ_REL);
+			if (slot->job >= jobCount) break;
+			slot->end = ((slot->job + FARM_BATCH) < jobCount) ? (slot->job + FARM_BATCH) : jobCount;
+		}
+		
+		slot->busy = true;
+		runJob(&CPU, memory, &jobs[slot->job], &shared->results[slot->job], id);
+		slot->busy = false;
+		slot->job++;
+		__atomic_add_fetch(&shared->done, 1, __ATOMIC_RELEASE);
+	}
+	
+	free(memory);
+	_exit(0);
+}
+
+
+
+
+uint8_t farmReadIO(uint32_t addr){
+	switch(addr & 0x000000FF){
+		case 0:		// CTRL Register
+		return (inPos < inLen) ? 0x00 : 0x80;
+		
+		case 1:		// UART, reads the next Byte of the input file
+		return (inPos < inLen) ? input[inPos++] : 0;
+		
+		case 4:		// 32-bit Timer, reading the low Byte saves the whole Timer value
+			tmpTimer.l = timer.l;
+		return tmpTimer.bl;
+		
+		case 5:
+		return tmpTimer.bm;
+		
+		case 6:
+		return tmpTimer.bh;
+		
+		case 7:
+		return tmpTimer.bx;
+		
+		default:
+		return 0;
+	}
+}
+
+void farmWriteIO(uint32_t addr, uint8_t val){
+	switch(addr & 0x000000FF){
+		case 1:		// UART, the output is only hashed
+			outHash = (outHash ^ val) * 16777619UL;
+			outLen++;
+		break;
+		
+		default:
+		break;
+	}
+}
@@ -0,0 +1,310 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/shm.h>
+#include <sys/wait.h>
+
+#define __EMU_LITTLE_ENDIAN
+#define __EMU_FUZZ
+
+#include "emu65816.h"
+
+
+
+// Fuzzing Driver, runs guest firmware under AFL (or AFL++) in persistent mode
+// The library has to be built with __EMU_FUZZ as well (gcc emu65816.c -D__EMU_FUZZ ...), so it records edge coverage.
+// Every test case starts from a Snapshot taken right after booting, and is either copied into guest memory or fed
+// to the guest through the UART. A case ends when the guest executes STP or WAI or runs out of cycles, reaching one
+// of the crash addresses is reported to AFL as a crash.
+// Without AFL the input files given on the command line are run once each, to reproduce crashes and check coverage.
+
+#define FORKSRV_FD		198					// AFL's fork server control pipe, the status pipe is FORKSRV_FD + 1
+#define FUZZ_LOOPS		10000U				// Test cases per process before the fork server starts a new one
+#define MAX_INPUT		(64U * 1024U)
+#define MAX_CRASH		16U
+
+enum{
+	MODE_MEM,		// The input is copied into memory at injectAddr
+	MODE_IO			// The input is read through the UART
+};
+
+cpuState CPU;
+cpuSnapshot base;				// The machine right after booting
+uint8_t *memory;
+uint8_t localMap[FUZZ_MAP_SIZE];	// Coverage bitmap when not running under AFL
+
+uint8_t mode = MODE_MEM;
+uint32_t injectAddr = 0x002000;
+int32_t cycleLimit = 10000000;
+uint32_t memSize = 1024U * 1024U;
+uint32_t loadAddr = 0x008000;
+uint32_t ioAddr = 0x00FE00;
+uint32_t crashAddr[MAX_CRASH];	// 24-bit Addresses (PB:PC) that count as a crash
+uint32_t crashCount = 0;
+
+bool parseOptions(int argc, char* argv[]);
+uint8_t runCase(const uint8_t* data, uint32_t size);
+bool forkServer(void);
+void runAFL(void);
+int runFiles(int argc, char* argv[]);
+uint8_t static *readFile(const char* path, uint32_t* size);
+
+
+// Guest IO
+const uint8_t *input;
+uint32_t inLen, inPos;
+uint8_t fuzzReadIO(uint32_t addr);
+void fuzzWriteIO(uint32_t addr, uint8_t val);
+
+
+
+
+int main(int argc, char* argv[]){
+	uint8_t *rom;
+	uint32_t romSize;
+	char *shm;
+	
+	if (argc < 2){
+		printf("Usage: %s rom.bin [name=value ...] [input files ...]\n", argv[0]);
+		printf("Options: mode=mem|io addr=ADDR cycles=N mem=N load=ADDR io=ADDR crash=ADDR (up to %u)\n", MAX_CRASH);
+		return -1;
+	}
+	
+	if (!parseOptions(argc, argv)) return -1;
+	
+	memory = calloc(memSize, sizeof(uint8_t));
+	rom = readFile(argv[1], &romSize);
+	if (!memory || !rom || (loadAddr >= memSize) || (romSize > (memSize - loadAddr))){
+		printf("Couldn't load the ROM!\n");
+		return -1;
+	}
+	memcpy(memory + loadAddr, rom, romSize);
+	free(rom);
+	
+	cpuInit(&CPU, memory, memSize, ioAddr, 256, fuzzReadIO, fuzzWriteIO);
+	if (!cpuSnapshotInit(&CPU, &base)){
+		printf("Not enough Memory for the Snapshot!\n");
+		return -1;
+	}
+	
+	// AFL passes the ID of it's coverage bitmap through the environment
+	shm = getenv("__AFL_SHM_ID");
+	CPU.cov_map = shm ? shmat(atoi(shm), NULL, 0) : localMap;
+	if (CPU.cov_map == (void*)-1){
+		printf("Couldn't attach to AFL's bitmap!\n");
+		return -1;
+	}
+	
+	if (shm) runAFL();
+	return runFiles(argc, argv);
+}
+
+
+
+
+// Parses the "name=value" Arguments following the ROM, anything else is an input file
+// Returns false if an Argument is unknown or malformed
+bool parseOptions(int argc, char* argv[]){
+	char *val;
+	
+	for (int i = 2; i < argc; i++){
+		val = strchr(argv[i], '=');
+		if (!val) continue;
+		val++;
+		
+		if (!strncmp(argv[i], "mode=", 5)){				// Where the input goes (mem or io)
+			if (!strcmp(val, "mem")){
+				mode = MODE_MEM;
+			}else if (!strcmp(val, "io")){
+				mode = MODE_IO;
+			}else{
+				printf("Unknown mode \"%s\"!\n", val);
+				return false;
+			}
+		}else if (!strncmp(argv[i], "addr=", 5)){		// Where the input is copied to in mem mode
+			injectAddr = strtoul(val, NULL, 0);
+		}else if (!strncmp(argv[i], "cycles=", 7)){		// Cycle limit of a test case
+			cycleLimit = strtol(val, NULL, 0);
+		}else if (!strncmp(argv[i], "mem=", 4)){			// Memory size
+			memSize = strtoul(val, NULL, 0);
+		}else if (!strncmp(argv[i], "load=", 5)){		// Address the ROM is loaded to
+			loadAddr = strtoul(val, NULL, 0);
+		}else if (!strncmp(argv[i], "io=", 3)){			// Start of the 256 Byte IO space
+			ioAddr = strtoul(val, NULL, 0);
+		}else if (!strncmp(argv[i], "crash=", 6)){		// Address (PB:PC) that counts as a crash
+			if (crashCount == MAX_CRASH){
+				printf("Too many crash addresses!\n");
+				return false;
+			}
+			crashAddr[crashCount++] = strtoul(val, NULL, 0);
+		}else{
+			printf("Unknown Argument \"%s\"!\n", argv[i]);
+			return false;
+		}
+	}
+	
+	return true;
+}
+
+// Opens and Reads a file as binary into a newly allocated buffer
+// Returns NULL if the file couldn't be read
+uint8_t static *readFile(const char* path, uint32_t* size){
+	FILE *fp;
+	uint8_t *buf;
+	long len;
+	
+	fp = fopen(path, "rb");
+	if (!fp) return NULL;
+	
+	fseek(fp, 0, SEEK_END);
+	len = ftell(fp);
+	rewind(fp);
+	if (len < 0){
+		fclose(fp);
+		return NULL;
+	}
+	
+	buf = malloc(len ? len : 1);
+	if (buf && (fread(buf, 1, len, fp) != (size_t)len)){
+		free(buf);
+		buf = NULL;
+	}
+	fclose(fp);
+	
+	*size = len;
+	return buf;
+}
+
+// Runs a single test case from the freshly booted machine
+// Returns why it stopped (RUN_BREAKPOINT means it reached a crash address)
+uint8_t runCase(const uint8_t* data, uint32_t size){
+	cpuRunCtl run = {.cycles = cycleLimit, .breakpoints = crashAddr, .bp_count = crashCount};
+	
+	input = data;
+	inLen = size;
+	inPos = 0;
+	
+	return cpuFuzzRun(&CPU, &base, (mode == MODE_MEM) ? data : NULL, size, injectAddr, &run);
+}
+
+// Talks to AFL's fork server, the processes it forks return from this function and run the test cases
+// Returns false if the program isn't running under AFL
+// A child stops itself after every case, so AFL can continue it with the next one instead of forking again
+bool forkServer(void){
+	uint32_t wasKilled, msg = 0;
+	pid_t child = -1;
+	bool stopped = false;
+	int status;
+	
+	if (write(FORKSRV_FD + 1, &msg, 4) != 4) return false;
+	
+	while(1){
+		if (read(FORKSRV_FD, &wasKilled, 4) != 4) _exit(1);
+		
+		// AFL killed the stopped child after a timeout, so a new one is needed
+		if (stopped && wasKilled){
+			stopped = false;
+			waitpid(child, &status, 0);
+		}
+		
+		if (!stopped){
+			child = fork();
+			if (child < 0) _exit(1);
+			if (!child){
+				close(FORKSRV_FD);
+				close(FORKSRV_FD + 1);
+				return true;
+			}
+		}else{
+			kill(child, SIGCONT);
+			stopped = false;
+		}
+		
+		if (write(FORKSRV_FD + 1, &child, 4) != 4) _exit(1);
+		if (waitpid(child, &status, WUNTRACED) < 0) _exit(1);
+		if (WIFSTOPPED(status)) stopped = true;
+		if (write(FORKSRV_FD + 1, &status, 4) != 4) _exit(1);
+	}
+}
+
+// Persistent mode loop, AFL rewrites stdin with the next case before continuing the process
+void runAFL(void){
+	static uint8_t buf[MAX_INPUT];
+	ssize_t len, n;
+	
+	if (!forkServer()) return;
+	
+	for (uint32_t i = 0; i < FUZZ_LOOPS; i++){
+		len = 0;
+		while ((len < (ssize_t)MAX_INPUT) && ((n = read(0, buf + len, MAX_INPUT - len)) > 0)) len += n;
+		
+		if (runCase(buf, len) == RUN_BREAKPOINT) abort();
+		raise(SIGSTOP);
+	}
+	
+	_exit(0);
+}
+
+// Runs every input file once and prints how it ended and how many edges it covered
+// Returns 1 if any of them crashed
+int runFiles(int argc, char* argv[]){
+	const char *reasons[] = {"cycles", "instructions", "deadline", "crash", "wai", "stp"};
+	uint8_t *data, reason;
+	uint32_t size, edges;
+	int crashed = 0;
+	
+	for (int i = 2; i < argc; i++){
+		if (strchr(argv[i], '=')) continue;
+		
+		data = readFile(argv[i], &size);
+		if (!data){
+			printf("%s: couldn't be read\n", argv[i]);
+			continue;
+		}
+		
+		memset(CPU.cov_map, 0, FUZZ_MAP_SIZE);
+		reason = runCase(data, size);
+		free(data);
+		
+		edges = 0;
+		for (uint32_t e = 0; e < FUZZ_MAP_SIZE; e++) edges += !!CPU.cov_map[e];
+		
+		printf("%s: %s after %llu cycles at $%02X%04X, %u edges\n", argv[i], reasons[reason],
+			(unsigned long long)(CPU.cycle_count - base.cpu.cycle_count), CPU.reg_pb, CPU.reg_pc.w, edges);
+		if (reason == RUN_BREAKPOINT) crashed = 1;
+	}
+	
+	cpuSnapshotFree(&CPU, &base);
+	return crashed;
+}
+
+
+
+
+uint8_t fuzzReadIO(uint32_t addr){
+	switch(addr & 0x000000FF){
+		case 0:		// CTRL Register
+		return (inPos < inLen) ? 0x00 : 0x80;
+		
+		case 1:		// UART, reads the next Byte of the input in io mode
+		return ((mode == MODE_IO) && (inPos < inLen)) ? input[inPos++] : 0;
+		
+		case 2:		// Length of the input
+		return inLen & 0xFF;
+		
+		case 3:
+		return (inLen >> 8) & 0xFF;
+		
+		default:
+		return 0;
+	}
+}
+
+void fuzzWriteIO(uint32_t addr, uint8_t val){
+	// Output is ignored while fuzzing
+}
@@ -4,15 +4,20 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
 
 #define __EMU_LITTLE_ENDIAN
 
-#include "65816.h"
+#include "emu65816.h"
 
 
 
 
 #define CLOCK		(160000U)				// Cycles per 10 Millisecond			(Currently 16MHz (16 * 10000 Cycles per 10 milliseconds)
+#define CLOCK_HZ	(CLOCK * 100ULL)		// Cycles per Second
 
 #define MEM_SIZE	(1024U * 1024U *  4)	// Amount of RAM starting at 0x000000	(Currently 4MB)
 #define ROM_START	(0x00008000)			// Starting Address of the ROM			(Example value)
@@ -35,6 +40,148 @@ void cpu0WriteIO(uint32_t addr, uint8_t val);
 cint32_t timer, tmpTimer;
 
 
+// UART, keys are buffered together with the slice they arrived in, so replaying a slice sees exactly the same input
+#define RX_SIZE		(256U)
+
+uint8_t rxBuf[RX_SIZE];
+uint32_t rxStamp[RX_SIZE];	// Slice each key arrived in
+uint32_t rxHead = 0;		// Write position (only ever counts up)
+uint32_t rxTail = 0;		// Read position of the guest (only ever counts up)
+uint32_t rxKeep = 0;		// Oldest key that could still be read again after a rollback
+uint8_t uartIrq = 0xFF;		// IRQ Line that's asserted while a key is waiting (0xFF = no IRQ)
+cpuState *uartCpu;			// CPU the UART is connected to
+uint32_t uartPoll(uint32_t slice);
+bool uartReady(void);
+bool uartTxFull(void);
+void uartWrite(uint8_t val);
+void uartUpdateIRQ(cpuState *CPU);
+
+
+// Device Queues, the IO handlers never make host calls themselves. A host thread per direction moves the data
+// between the console and a lock-free single-producer/single-consumer ring, so console traffic never stalls the CPU
+#define RING_SIZE	(4096U)		// Must be a power of 2
+
+typedef struct{
+	uint8_t buf[RING_SIZE];
+	uint32_t head __attribute__((aligned(64)));		// Write position, only changed by the producer (only ever counts up)
+	uint32_t tail __attribute__((aligned(64)));		// Read position, only changed by the consumer (only ever counts up)
+} spscRing;
+
+spscRing rxRing;			// Console -> UART
+spscRing txRing;			// UART -> Console
+pthread_t txThreadId;
+pthread_mutex_t txLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t txCond = PTHREAD_COND_INITIALIZER;		// Signaled when there's output while the output thread sleeps
+pthread_cond_t txSpace = PTHREAD_COND_INITIALIZER;		// Signaled when the output thread emptied the ring while the CPU waits
+bool txIdle = false;		// The output thread is sleeping until there's output
+bool txBlocked = false;		// The CPU is waiting for space in the transmit ring
+bool txDrop = false;		// Drop output while the transmit ring is full instead of waiting
+bool ioQuit = false;		// Tells the output thread to empty the ring and exit
+bool ringPush(spscRing *r, uint8_t val);
+bool ringPop(spscRing *r, uint8_t *val);
+bool ringEmpty(spscRing *r);
+bool ringFull(spscRing *r);
+void txWake(void);
+void txPut(uint8_t val);
+bool ioStart(cpuState *CPU);
+void ioStop(void);
+
+
+// Runahead, runs the emulation a few slices ahead of the wall time so the guest's reaction to input is ready early.
+// The start of every slice that could still be undone is kept in a Snapshot (one per slice, so runahead can be at most
+// RA_MAX), when a key arrives the CPU rolls back to the start of the current slice and replays up to where it was,
+// this time with the key. Output goes through a log, printable characters are shown right away (that's what makes the
+// reaction visible early) and erased again if a replay doesn't write them, anything else waits until the wall time
+// passed the slice that wrote it
+#define RA_MAX		(SNAP_MAX - 2)		// One Snapshot per slice ahead plus the current one, and one is used for resets
+
+// Host side state of the emulated machine, saved and restored together with the CPU Snapshot
+typedef struct{
+	cint32_t timer, tmpTimer, filePtr;
+	uint8_t fileCmd, fileResponse;
+	int32_t tickRem, carry;
+	uint32_t slice;
+	uint32_t rxTail;
+} machineState;
+
+uint32_t runahead = 0;		// Amount of slices to run ahead (0 = disabled)
+uint32_t curSlice = 0;		// Slice the emulated machine is in
+uint32_t wallSlice = 0;		// Slice the wall time is in, everything before it is final
+uint8_t *txLog;				// Output that isn't final yet
+uint32_t *txStamp;			// Slice each Byte was written in
+uint32_t txLogSize;			// Size of the log, big enough for everything the guest can write in runahead + 1 slices
+uint32_t txHead = 0;		// Write position of the guest (only ever counts up, except for rollbacks)
+uint32_t txTail = 0;		// Oldest Byte that isn't final (only ever counts up)
+uint32_t txShown = 0;		// Next Byte to show (only ever counts up, except for rollbacks)
+uint8_t *txGhost;			// Output of rolled back slices that's still on the console
+uint32_t txGhostLen = 0;
+uint32_t txGhostPos = 0;	// Ghost Bytes before this were written again by the replay
+uint32_t txDropped = 0;		// Bytes the guest wrote while the transmit ring was full (only with txdrop=1)
+void machineSave(machineState *m);
+void machineLoad(const machineState *m);
+void txDiscard(uint32_t slice);
+void txShow(void);
+void txCommit(void);
+void txErase(void);
+void runAhead(cpuState *CPU);
+
+
+// Reset, the guest can reset the whole machine by writing to IO register 0x86
+// Most guests never do, so nothing is tracked until the first reset. That one rebuilds the booted machine from a copy
+// of the ROM and keeps it in a Snapshot, every later reset only copies the Pages the guest wrote to since then
+cpuSnapshot pristine;		// The machine right after booting (only after the first reset)
+bool pristineReady = false;
+cpuState bootCpu;			// The CPU right after cpuInit
+uint8_t *bootRom;			// Copy of the ROM
+uint32_t bootRomSize;
+bool resetReq = false;		// Set by the guest, handled at the end of the slice
+void machineReset(cpuState *CPU);
+
+
+// Pacing, keeps emulated time in step with wall time by sleeping until absolute deadlines
+// (the deadline of a slice is derived from the total amount of cycles since the start, so rounding errors and oversleeping don't add up)
+#define PACE_MAX_LAG	(100000000ULL)		// If the Emulator falls more than 100ms behind, give up on catching up and restart the timeline
+
+typedef struct{
+	uint32_t speed;			// Speed ratio (1 = real time, N = N times faster, 0 = unthrottled)
+	uint32_t report;		// Print a status line every N seconds (0 = only when exiting)
+	uint64_t start;			// Wall time the current timeline started at (ns)
+	uint64_t cycles;		// Emulated cycles since the start of the current timeline
+	uint64_t totalCycles;	// Emulated cycles since the Emulator started
+	uint64_t firstStart;	// Wall time the Emulator started at (ns)
+	uint64_t lastReport;	// Wall time of the last status line (ns)
+	uint64_t sleeps;		// Amount of sleeps
+	uint64_t lateSum;		// Sum of how late each sleep woke up (ns)
+	uint64_t lateMax;		// Latest wake up (ns)
+	uint64_t resyncs;		// How often the timeline had to be restarted
+} pacer;
+
+pacer pace = {.speed = 1};
+void paceStart(pacer *p);
+void paceSlice(pacer *p, uint32_t cycles);
+void paceReport(pacer *p);
+
+
+// Slice Governor, adapts the amount of cycles between host servicing points to what the guest is doing
+// While Devices are busy the slices are kept short (latency target), while everything is idle they double
+// every slice up to the longest allowed length (throughput target)
+#define GOV_LATENCY		(1000U)				// Default slice length while Devices are busy (us)
+#define GOV_THROUGHPUT	(10000U)			// Default longest slice length while idle (us)
+
+typedef struct{
+	uint32_t minSlice;		// Slice length while Devices are busy (cycles)
+	uint32_t maxSlice;		// Longest slice length while idle (cycles)
+	uint32_t slice;			// Current slice length (cycles)
+} governor;
+
+uint32_t govLatency = GOV_LATENCY;
+uint32_t govThroughput = GOV_THROUGHPUT;
+governor gov;
+bool ioActivity = false;	// Set by the IO handlers whenever a Device actually transfers data
+void govInit(governor *g, uint32_t latency, uint32_t throughput);
+uint32_t govNext(governor *g, bool active);
+
+
 // Opens and Reads a file as binary and stores it's contents into a memory Array at a specified address
 // Returns the amount of Bytes read
 int32_t readROM(uint8_t* memory, uint32_t memSize, uint32_t address, const char* str){
@@ -66,53 +213,158 @@ int32_t readROM(uint8_t* memory, uint32_t memSize, uint32_t address, const char*
 
 
 
+// Parses the optional "name=value" Arguments following the ROM and Path
+// Returns false if an Argument is unknown or malformed
+bool parseOptions(int argc, char* argv[]){
+	char *val;
+	
+	for (int i = 3; i < argc; i++){
+		val = strchr(argv[i], '=');
+		if (!val){
+			printf("Argument \"%s\" is not of the form name=value!\n", argv[i]);
+			return false;
+		}
+		val++;
+		
+		if (!strncmp(argv[i], "speed=", 6)){				// Speed ratio (1 = real time, N = N times faster, 0 = unthrottled)
+			pace.speed = strtoul(val, NULL, 0);
+		}else if (!strncmp(argv[i], "report=", 7)){		// Print a status line every N seconds
+			pace.report = strtoul(val, NULL, 0);
+		}else if (!strncmp(argv[i], "latency=", 8)){		// Slice length while Devices are busy (us)
+			govLatency = strtoul(val, NULL, 0);
+		}else if (!strncmp(argv[i], "throughput=", 11)){	// Longest slice length while idle (us)
+			govThroughput = strtoul(val, NULL, 0);
+		}else if (!strncmp(argv[i], "runahead=", 9)){		// Amount of slices to run ahead of the wall time
+			runahead = strtoul(val, NULL, 0);
+			if (runahead > RA_MAX){
+				printf("Runahead can be at most %u slices!\n", RA_MAX);
+				return false;
+			}
+		}else if (!strncmp(argv[i], "txdrop=", 7)){		// Drop output while the transmit ring is full instead of waiting
+			txDrop = strtoul(val, NULL, 0);
+		}else if (!strncmp(argv[i], "uartirq=", 8)){		// IRQ Line the UART asserts while a key is waiting
+			uartIrq = strtoul(val, NULL, 0);
+			if (uartIrq > 31){
+				printf("The UART IRQ Line has to be 0-31!\n");
+				return false;
+			}
+		}else{
+			printf("Unknown Argument \"%s\"!\n", argv[i]);
+			return false;
+		}
+	}
+	
+	return true;
+}
+
+
+
+
 int main(int argc, char* argv[]){
 	cpuState CPU0;			// the CPU Struct
 	
-	printf("CPU Struct is %llu Bytes large!\n", sizeof(cpuState));
+	printf("CPU Struct is %llu Bytes large!\n", (unsigned long long)sizeof(cpuState));
 	
-	if (argc != 3){
-		printf("only 2 Arguments are allowed (found %u)!\n", (argc - 1));
+	if (argc < 3){
+		printf("Usage: %s rom path [speed=N] [report=N] [latency=us] [throughput=us] [runahead=N] [uartirq=N] [txdrop=1]\n", argv[0]);
 		return -1;
 	}
 	
+	if (!parseOptions(argc, argv)) return -1;
+	
 	if (chdir(argv[2])){
 		printf("Couldn't open Path to \"%s\"!\n", argv[2]);
 	}
 	
 	// Create the System's Memory and load a ROM file into it
 	printf("Allocating System Memory!\n");
-	uint8_t *memory = malloc(MEM_SIZE * sizeof(uint8_t));
+	uint8_t *memory = calloc(MEM_SIZE, sizeof(uint8_t));		// (cleared, so a reset can rebuild it exactly)
 	if (memory == NULL) return -1;
 	
 	uint32_t ROMsize = readROM(memory, MEM_SIZE, ROM_START, argv[1]);
 	if (!ROMsize) return -1;	// If no ROM was loaded, exit immediately
+	bootRomSize = ROMsize;
+	bootRom = malloc(ROMsize);
+	if (bootRom == NULL) return -1;
+	memcpy(bootRom, memory + ROM_START, ROMsize);
 	
 	// Initialize the CPU struct
 	cpuInit(&CPU0, memory, MEM_SIZE, IO_START, IO_SIZE, cpu0ReadIO, cpu0WriteIO);
+	bootCpu = CPU0;
+	if (!ioStart(&CPU0)){
+		printf("Couldn't start the IO threads!\n");
+		return -1;
+	}
 	
-	// Then run the CPU for 10"ms" at a time
-	int32_t rcyc = CLOCK;
+	// Then run the CPU in slices chosen by the Governor, with a timer tick every 10"ms"
+	int32_t tickRem = CLOCK;	// Cycles until the next timer tick
+	uint32_t slice, ran, step, done;
+	bool active = true;
+	govInit(&gov, govLatency, govThroughput);
+	if (runahead){
+		runAhead(&CPU0);
+		ioStop();
+		paceReport(&pace);
+		if (pristineReady) cpuSnapshotFree(&CPU0, &pristine);
+		free(memory);
+		free(bootRom);
+		return 0;
+	}
+	paceStart(&pace);
 	while(1){
-		// Run for a set amount of Cycles
-		rcyc = cpuExecute(&CPU0, rcyc);
+		// Run for a set amount of Cycles, the timer ticks that fall into the slice are sent in between
+		// (so the slice length doesn't depend on the tick, only the host servicing below waits for the end of it)
+		slice = govNext(&gov, active);
+		ran = 0;
+		while (ran < slice){
+			step = slice - ran;
+			if (step > (uint32_t)tickRem) step = tickRem;
+			done = step - cpuExecute(&CPU0, step);
+			
+			// A waiting CPU idles until the next tick or the end of the slice
+			if (chkWAI(CPU0)) done = step;
+			ran += done;
+			
+			// Send the periodic IRQ and increment the timer
+			tickRem -= done;
+			if (tickRem <= 0){
+				cpuSendIRQ(CPU0);
+				timer.l++;
+				tickRem += CLOCK;
+			}
+			
+			// Anything the host has to handle right away ends the slice early
+			if (chkSTP(CPU0) || resetReq || fileCmd) break;
+		}
+		
+		// Wait until the wall time catches up with the emulated time
+		paceSlice(&pace, ran);
 		
 		// If a STP Instruction was executed, exit the program
 		if (chkSTP(CPU0)) break;
 		
-		// If the "fileCmd" Byte was set, handle it
-		if (fileCmd) fileIO(&CPU0);
-		
-		// Send the periodic IRQ and increment the timer
-		cpuSendIRQ(CPU0);
-		timer.l++;
+		// If the guest asked for a reset, start over with a freshly booted machine
+		if (resetReq){
+			machineReset(&CPU0);
+			tickRem = CLOCK;
+			active = true;
+			continue;
+		}
 		
-		// Then calculate how many cycles to run for the next iteration
-		rcyc = CLOCK + rcyc;
+		// Anything the host has to react to makes the next slices short
+		active = ioActivity || fileCmd || CPU0.interrupt || __atomic_load_n(&CPU0.irq_line, __ATOMIC_RELAXED) || !ringEmpty(&rxRing);
+		ioActivity = false;
 		
+		// If the "fileCmd" Byte was set, handle it
+		if (fileCmd) fileIO(&CPU0);
 	}
 	
+	ioStop();
+	paceReport(&pace);		// (after the output, so it doesn't end up in the middle of it)
+	
+	if (pristineReady) cpuSnapshotFree(&CPU0, &pristine);
 	free(memory);
+	free(bootRom);
 	return 0;
 }
 
@@ -129,12 +381,17 @@ uint8_t cpu0ReadIO(uint32_t addr){
 	
 	//printf("IO Read at 0x%02X!\n", ad);
 	switch(ad){
-		case 0:		// CTRL Register
-		return (_kbhit()) ? 0x00 : 0x80;
+		case 0:		// CTRL Register (bit 7: no key waiting, bit 6: transmit buffer full)
+			if (!runahead) uartPoll(0);
+		return ((uartReady()) ? 0x00 : 0x80) | ((uartTxFull()) ? 0x40 : 0x00);
 		
 		case 1:		// UART
-			if (!_kbhit()) return 0;
-		return _getch();
+			if (!runahead) uartPoll(0);
+			if (!uartReady()) return 0;
+			ioActivity = true;
+			tmp = rxBuf[rxTail++ % RX_SIZE];
+			uartUpdateIRQ(uartCpu);
+		return tmp;
 		
 		case 4:		// 32-bit Timer, reading the low Byte saves the whole Timer value
 			tmpTimer.l = timer.l;
@@ -150,6 +407,7 @@ uint8_t cpu0ReadIO(uint32_t addr){
 		return tmpTimer.bx;
 		
 		case 0x81:	// File IO Response Byte (0x00 = pending, 0x01 = success, >0x7F = error)
+			ioActivity = true;
 			tmp = fileResponse;
 			fileResponse = 0;
 		return tmp;
@@ -177,13 +435,18 @@ void cpu0WriteIO(uint32_t addr, uint8_t val){
 	// printf("  (IO Write at 0x%02X, value: 0x%02X)  ", ad, val);
 	switch(ad){
 		case 1:		// UART
-			putch(val);
+			uartWrite(val);
+			ioActivity = true;
 		break;
 		
 		case 0x80:	// Debug Printing
 			//setDebug(val);
 		break;
 		
+		case 0x86:	// System Reset (any value)
+			resetReq = true;
+		break;
+		
 		// File IO Control Registers
 		case 0x81:	// Control Byte for File IO
 			fileCmd = val;
@@ -320,6 +583,7 @@ void fileIO(cpuState *CPU){
 			// printf("[FIO] Read %u Bytes from File to Address: $%06X\n", tmp0.l, tmp1.l);
 			
 			tmp2.l = fread(&MEM[tmp1.l], 1, tmp0.l, fp);
+			cpuMarkDirty(CPU, tmp1.l, tmp2.l);
 			
 			// Also write back the read amount of Bytes to filePtr
 			filePtr.l = tmp2.l;
@@ -372,8 +636,474 @@ void fileIO(cpuState *CPU){
 
 
 
+void paceStart(pacer *p){
+	p->start = cpuNowNs();
+	p->firstStart = p->start;
+	p->lastReport = p->start;
+	p->cycles = 0;
+}
 
+// Accounts for a slice of executed cycles and sleeps until the wall time of its end
+void paceSlice(pacer *p, uint32_t cycles){
+	uint64_t deadline, now;
+	struct timespec ts;
+	
+	p->cycles += cycles;
+	p->totalCycles += cycles;
+	
+	if (p->speed){
+		deadline = p->start + (p->cycles * 1000000000ULL) / (CLOCK_HZ * p->speed);
+		now = cpuNowNs();
+		
+		if (now < deadline){
+			ts.tv_sec = deadline / 1000000000ULL;
+			ts.tv_nsec = deadline % 1000000000ULL;
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL));	// Restart if interrupted by a signal
+			
+			now = cpuNowNs();
+			p->sleeps++;
+			p->lateSum += now - deadline;
+			if ((now - deadline) > p->lateMax) p->lateMax = now - deadline;
+		}else if ((now - deadline) > PACE_MAX_LAG){
+			// The host couldn't keep up (or the process was suspended), so start a new timeline from here
+			// instead of running unthrottled until the lost time is made up
+			p->start = now;
+			p->cycles = 0;
+			p->resyncs++;
+		}
+	}else{
+		now = cpuNowNs();
+	}
+	
+	if (p->report && (now - p->lastReport) >= (p->report * 1000000000ULL)){
+		paceReport(p);
+		p->lastReport = now;
+	}
+}
+
+// Prints the effective speed and the sleep jitter
+void paceReport(pacer *p){
+	uint64_t elapsed = cpuNowNs() - p->firstStart;
+	
+	if (!elapsed) elapsed = 1;
+	
+	fprintf(stderr, "[PACE] %.3f MHz effective (target: ", (double)p->totalCycles * 1000.0 / elapsed);
+	if (p->speed){
+		fprintf(stderr, "%.3f MHz)", (double)CLOCK_HZ * p->speed / 1000000.0);
+	}else{
+		fprintf(stderr, "unthrottled)");
+	}
+	fprintf(stderr, ", jitter: %.1f us avg, %.1f us max, %llu resyncs\n",
+		p->sleeps ? (double)p->lateSum / p->sleeps / 1000.0 : 0.0, (double)p->lateMax / 1000.0, (unsigned long long)p->resyncs);
+}
 
 
 
 
+// Converts the latency and throughput targets (us) into slice lengths (cycles)
+void govInit(governor *g, uint32_t latency, uint32_t throughput){
+	g->minSlice = (CLOCK_HZ * latency) / 1000000ULL;
+	g->maxSlice = (CLOCK_HZ * throughput) / 1000000ULL;
+	
+	if (!g->minSlice) g->minSlice = 1;
+	if (g->maxSlice < g->minSlice) g->maxSlice = g->minSlice;
+	
+	g->slice = g->minSlice;
+}
+
+// Returns the length of the next slice, depending on whether the last one had any Device activity
+uint32_t govNext(governor *g, bool active){
+	if (active){
+		g->slice = g->minSlice;
+	}else if (g->slice < g->maxSlice){
+		g->slice = (g->slice > (g->maxSlice / 2)) ? g->maxSlice : (g->slice * 2);
+	}
+	
+	return g->slice;
+}
+
+
+
+
+// Moves all pending keys into the receive buffer, marking them as arrived in the given slice
+// Returns how many keys were added
+uint32_t uartPoll(uint32_t slice){
+	uint32_t cnt = 0;
+	
+	if (!runahead) rxKeep = rxTail;
+	
+	while (((rxHead - rxKeep) < RX_SIZE) && ringPop(&rxRing, &rxBuf[rxHead % RX_SIZE])){
+		rxStamp[rxHead % RX_SIZE] = slice;
+		rxHead++;
+		cnt++;
+	}
+	
+	return cnt;
+}
+
+// Returns true if the guest can read a key in the current slice
+bool uartReady(void){
+	return (rxTail != rxHead) && (rxStamp[rxTail % RX_SIZE] <= curSlice);
+}
+
+void uartWrite(uint8_t val){
+	if (runahead){
+		// Held back until the slice is final, see txCommit (the log is sized so it can't fill up, this is just a safety net)
+		if ((txHead - txTail) >= txLogSize){
+			txDropped++;
+			return;
+		}
+		txLog[txHead & (txLogSize - 1)] = val;
+		txStamp[txHead & (txLogSize - 1)] = curSlice;
+		txHead++;
+		txShow();
+		return;
+	}
+	
+	// With txdrop=1 the Byte is lost if the transmit buffer is full, like on a real UART, the guest has to check the CTRL
+	// Register first. Otherwise the CPU waits for the console to catch up
+	if (txDrop && ringFull(&txRing)){
+		txDropped++;
+		return;
+	}
+	txPut(val);
+}
+
+// Returns true while a Byte written to the UART would have to wait (or be dropped with txdrop=1)
+// (never in runahead mode, the log always has room and the console mustn't change what a replay sees)
+bool uartTxFull(void){
+	if (runahead) return false;
+	return ringFull(&txRing);
+}
+
+// Asserts the UART's IRQ Line while the guest can read a key, and deasserts it once there are none left
+void uartUpdateIRQ(cpuState *CPU){
+	if (uartIrq > 31) return;
+	
+	if (!uartReady()){
+		cpuDeassertIRQ((*CPU), uartIrq);
+		if (!runahead) uartPoll(0);		// A key could've arrived right before the Line was cleared
+	}
+	if (uartReady()) cpuAssertIRQ((*CPU), uartIrq);
+}
+
+void machineSave(machineState *m){
+	m->timer = timer;
+	m->tmpTimer = tmpTimer;
+	m->filePtr = filePtr;
+	m->fileCmd = fileCmd;
+	m->fileResponse = fileResponse;
+	m->slice = curSlice;
+	m->rxTail = rxTail;
+}
+
+void machineLoad(const machineState *m){
+	timer = m->timer;
+	tmpTimer = m->tmpTimer;
+	filePtr = m->filePtr;
+	fileCmd = m->fileCmd;
+	fileResponse = m->fileResponse;
+	curSlice = m->slice;
+	rxTail = m->rxTail;
+}
+
+// Resets the machine to how it was right after booting
+// Keys that were already read stay read, and in runahead mode the reset can be rolled back like anything else
+void machineReset(cpuState *CPU){
+	// The first time the Snapshot is rebuilt from the ROM and every Page is marked dirty, so loading it copies all of them
+	if (!pristineReady){
+		if (!cpuSnapshotInit(CPU, &pristine)){
+			printf("Not enough Memory for the reset Snapshot!\n");
+			resetReq = false;
+			return;
+		}
+		memset(pristine.mem, 0, MEM_SIZE);
+		memcpy(pristine.mem + ROM_START, bootRom, bootRomSize);
+		pristine.cpu = bootCpu;		// (only the registers are restored, the rest of the CPU struct stays)
+		cpuMarkDirty(CPU, 0, MEM_SIZE);
+		pristineReady = true;
+	}
+	
+	cpuSnapshotLoad(CPU, &pristine);
+	timer.l = 0;
+	tmpTimer.l = 0;
+	filePtr.l = 0;
+	fileCmd = 0;
+	fileResponse = 0;
+	resetReq = false;
+	uartUpdateIRQ(CPU);
+}
+
+// Forgets the output of the given slice and all after it (they're about to be replayed)
+// Whatever of it is on the console already becomes a ghost, in front of what's left of the ghost of an earlier rollback
+void txDiscard(uint32_t slice){
+	uint32_t keep;
+	
+	while ((txHead != txTail) && (txStamp[(txHead - 1) & (txLogSize - 1)] >= slice)) txHead--;
+	if (txShown <= txHead) return;
+	
+	keep = txGhostLen - txGhostPos;
+	memmove(txGhost + (txShown - txHead), txGhost + txGhostPos, keep);
+	for (uint32_t i = txHead; i != txShown; i++) txGhost[i - txHead] = txLog[i & (txLogSize - 1)];
+	txGhostLen = (txShown - txHead) + keep;
+	txGhostPos = 0;
+	txShown = txHead;
+}
+
+// Returns true for output that can be taken off the console again (printable characters, erased with backspaces)
+bool txErasable(uint8_t val){
+	return (val >= 0x20) && (val < 0x7F);
+}
+
+// Takes the part of the ghost that the replay didn't write again off the console
+// (only works as long as it's all on one line of the terminal)
+void txErase(void){
+	for (; txGhostLen > txGhostPos; txGhostLen--){
+		txPut('\b');
+		txPut(' ');
+		txPut('\b');
+	}
+	txGhostLen = 0;
+	txGhostPos = 0;
+}
+
+// Shows as much of the log as possible: everything that's final, and after that everything that can be erased again
+// Bytes that the ghost already shows at the same spot aren't printed again
+void txShow(void){
+	uint32_t i;
+	
+	while (txShown != txHead){
+		i = txShown & (txLogSize - 1);
+		if ((txStamp[i] >= wallSlice) && !txErasable(txLog[i])) break;
+		
+		if ((txGhostPos < txGhostLen) && (txGhost[txGhostPos] == txLog[i])){
+			txGhostPos++;
+		}else{
+			txErase();
+			txPut(txLog[i]);
+		}
+		txShown++;
+	}
+}
+
+// Shows the output of every slice before the wall time and forgets it, it can't be rolled back anymore
+void txCommit(void){
+	txShow();
+	while ((txTail != txShown) && (txStamp[txTail & (txLogSize - 1)] < wallSlice)) txTail++;
+}
+
+// Main loop for runahead mode
+// All slices have the same length (the Governor's latency target), so a replayed slice gives the same results as the first run
+void runAhead(cpuState *CPU){
+	cpuSnapshot snaps[RA_MAX + 1];		// Start of the slices that could still be replayed, by slice % slots
+	machineState bases[RA_MAX + 1];
+	uint32_t slots = runahead + 1;
+	uint32_t slice = gov.minSlice;
+	uint32_t slot;
+	int32_t tickRem = CLOCK, carry = 0, req;
+	
+	// Writing the UART takes at least 3 cycles, and a slice can run over by one instruction
+	txLogSize = 1;
+	while (txLogSize < (slots * ((slice + 16) / 3 + 1))) txLogSize *= 2;
+	txLog = malloc(txLogSize);
+	txStamp = malloc(txLogSize * sizeof(uint32_t));
+	txGhost = malloc(txLogSize);		// (there's never more on the console than was shown from the log)
+	if (!txLog || !txStamp || !txGhost){
+		printf("Not enough Memory for runahead!\n");
+		return;
+	}
+	
+	for (uint32_t i = 0; i < slots; i++){
+		if (!cpuSnapshotInit(CPU, &snaps[i])){
+			printf("Not enough Memory for runahead!\n");
+			while (i--) cpuSnapshotFree(CPU, &snaps[i]);
+			return;
+		}
+	}
+	
+	paceStart(&pace);
+	while(1){
+		// New input invalidates every slice that was run without it, so go back to the start of the current one and replay
+		if (uartPoll(wallSlice) && (curSlice > wallSlice)){
+			slot = wallSlice % slots;
+			cpuSnapshotLoad(CPU, &snaps[slot]);
+			machineLoad(&bases[slot]);
+			tickRem = bases[slot].tickRem;
+			carry = bases[slot].carry;
+			txDiscard(wallSlice);
+		}
+		
+		// Stay runahead slices ahead of the wall time, but stop at anything that can't be undone (file commands, STP)
+		// until the wall time catches up
+		while ((curSlice <= (wallSlice + runahead)) && !chkSTP((*CPU)) && !fileCmd){
+			slot = curSlice % slots;
+			cpuSnapshotSave(CPU, &snaps[slot]);
+			machineSave(&bases[slot]);
+			bases[slot].tickRem = tickRem;
+			bases[slot].carry = carry;
+			
+			uartUpdateIRQ(CPU);		// Keys only show up in the slice they arrived in, so the Line follows them
+			req = slice + carry;
+			carry = cpuExecute(CPU, req);
+			if (chkWAI((*CPU))) carry = 0;		// A waiting CPU idles for the whole slice
+			
+			tickRem -= req - carry;
+			if (resetReq){
+				machineReset(CPU);
+				tickRem = CLOCK;
+				carry = 0;
+			}
+			if (tickRem <= 0){
+				cpuSendIRQ((*CPU));
+				timer.l++;
+				tickRem += CLOCK;
+			}
+			curSlice++;
+		}
+		if (txShown == txHead) txErase();		// Whatever the replay didn't write again by now was wrong
+		
+		// Let one slice worth of wall time pass, everything before it is final now
+		paceSlice(&pace, slice);
+		wallSlice++;
+		txCommit();
+		rxKeep = (curSlice > wallSlice) ? bases[wallSlice % slots].rxTail : rxTail;	// Keys a rollback could read again
+		
+		// Things that can't be undone are handled once the wall time caught up with the machine
+		if (curSlice <= wallSlice){
+			if (chkSTP((*CPU))) break;
+			if (fileCmd) fileIO(CPU);
+		}
+	}
+	
+	// Show the rest of the output
+	wallSlice = UINT32_MAX;
+	txCommit();
+	txErase();
+	for (uint32_t i = 0; i < slots; i++) cpuSnapshotFree(CPU, &snaps[i]);
+	free(txLog);
+	free(txStamp);
+	free(txGhost);
+}
+
+
+
+
+// Returns false if the ring is full
+bool ringPush(spscRing *r, uint8_t val){
+	uint32_t head = r->head;
+	
+	if ((head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)) >= RING_SIZE) return false;
+	r->buf[head & (RING_SIZE - 1)] = val;
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+	
+	return true;
+}
+
+// Returns false if the ring is empty
+bool ringPop(spscRing *r, uint8_t *val){
+	uint32_t tail = r->tail;
+	
+	if (tail == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)) return false;
+	*val = r->buf[tail & (RING_SIZE - 1)];
+	__atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+	
+	return true;
+}
+
+bool ringEmpty(spscRing *r){
+	return __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+}
+
+// Only meaningful for the producer
+bool ringFull(spscRing *r){
+	return (r->head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)) >= RING_SIZE;
+}
+
+// Waits for keys and hands them to the UART, the IRQ Line is asserted right away so a CPU in WAI wakes up
+// (in runahead mode the Line is only changed between slices, so replays see it at the same point)
+void *rxThread(void *arg){
+	uint8_t key;
+	
+	while(1){
+		key = _getch();
+		while (!ringPush(&rxRing, key)) usleep(1000);	// The guest isn't reading, wait for it to catch up
+		if ((uartIrq <= 31) && !runahead) cpuAssertIRQ((*uartCpu), uartIrq);
+	}
+	
+	return NULL;
+}
+
+// Wakes the output thread if it's sleeping (while it's busy this is only a load)
+// (the fence pairs with the one in txThread, either the thread sees the new output or this sees it sleeping)
+void txWake(void){
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&txIdle, __ATOMIC_RELAXED)) return;
+	
+	pthread_mutex_lock(&txLock);
+	pthread_cond_signal(&txCond);
+	pthread_mutex_unlock(&txLock);
+}
+
+// Hands a Byte to the output thread, waits while the ring is full
+// The emulated machine stops in the meantime, so the guest can't outrun the console (not even with speed=0)
+void txPut(uint8_t val){
+	while (!ringPush(&txRing, val)){
+		pthread_mutex_lock(&txLock);
+		__atomic_store_n(&txBlocked, true, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		while (ringFull(&txRing)) pthread_cond_wait(&txSpace, &txLock);
+		__atomic_store_n(&txBlocked, false, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&txLock);
+	}
+	txWake();
+}
+
+// Prints everything the UART sent, sleeps while there's nothing to print
+void *txThread(void *arg){
+	uint8_t val;
+	
+	while(1){
+		while (ringPop(&txRing, &val)) putch(val);
+		
+		// Let a waiting CPU go on (the fence pairs with the one in txPut, like in txWake)
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&txBlocked, __ATOMIC_RELAXED)){
+			pthread_mutex_lock(&txLock);
+			pthread_cond_signal(&txSpace);
+			pthread_mutex_unlock(&txLock);
+		}
+		
+		if (__atomic_load_n(&ioQuit, __ATOMIC_ACQUIRE) && ringEmpty(&txRing)) break;
+		
+		pthread_mutex_lock(&txLock);
+		__atomic_store_n(&txIdle, true, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		while (ringEmpty(&txRing) && !__atomic_load_n(&ioQuit, __ATOMIC_ACQUIRE)) pthread_cond_wait(&txCond, &txLock);
+		__atomic_store_n(&txIdle, false, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&txLock);
+	}
+	
+	return NULL;
+}
+
+// Starts the IO threads, returns false if they couldn't be created
+bool ioStart(cpuState *CPU){
+	pthread_t rx;
+	
+	uartCpu = CPU;
+	if (pthread_create(&rx, NULL, rxThread, NULL)) return false;
+	pthread_detach(rx);		// Blocked in _getch until the program exits
+	
+	return !pthread_create(&txThreadId, NULL, txThread, NULL);
+}
+
+// Waits until all output was printed
+void ioStop(void){
+	__atomic_store_n(&ioQuit, true, __ATOMIC_RELEASE);
+	pthread_mutex_lock(&txLock);
+	pthread_cond_signal(&txCond);
+	pthread_mutex_unlock(&txLock);
+	pthread_join(txThreadId, NULL);
+	
+	if (txDropped) fprintf(stderr, "[UART] %u Bytes of output were dropped because the transmit buffer was full (txdrop=1)\n", txDropped);
+}
@@ -0,0 +1,399 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define __EMU_LITTLE_ENDIAN
+
+#include "emu65816.h"
+
+
+
+// Per Opcode Microbenchmark, times every opcode in every processor mode on it's own
+// For every entry of the cycle table a guest loop is generated that sets up the mode and the registers and then
+// executes COPIES copies of the instruction, it's run through cpuRun (what cpuExecute uses) for a fixed amount of
+// cycles. The same loop without the copies is timed once per mode, it's time and cycles per round are subtracted,
+// which leaves the host time and the cycles of a single instruction. The copies are built so they don't leave the
+// loop: jumps, calls and branches go to the next copy, returns find a prepared stack frame that points to the next
+// copy, and BRK/COP go to a handler that only contains RTI (it's measured RTI time is subtracted again).
+// STP and WAI stop the CPU and MVN/MVP aren't implemented by the emulator, those are left out.
+// The instructions are generated with the disassembler, so link it with the library: gcc opbench.c -l:emu65816.a
+
+#define OPB_MEM			(0x10000U)		// 64kB, the vectors are at the end
+#define OPB_IO			(0xFE00U)		// Start of the 256 Byte IO space (unused)
+#define OPB_CODE		(0x8000U)		// The loop
+#define OPB_HANDLER		(0x9000U)		// RTI for BRK/COP
+#define OPB_DATA		(0x2000U)		// Target of all Absolute and Long addressing modes
+#define OPB_POINTERS	(0x3000U)		// One pointer per copy for JMP (abs), JML [abs] and JMP/JSR (abs,X)
+#define OPB_DP			(0x10U)			// Direct Page operand, holds a Long pointer to OPB_DATA
+#define OPB_FRAMES_N	(0x1000U)		// Stack frames for RTS/RTL/RTI/PLP in Native mode
+#define OPB_FRAMES_E	(0x0100U)		// and in Emulation mode (SP wraps to $0100)
+#define OPB_SLICE		(100000)		// Cycles per cpuRun call
+#define COPIES			(64U)			// Copies of the instruction per round
+#define WARMUP			(100000)		// Untimed cycles before every measurement
+
+typedef struct{
+	bool valid;
+	char text[32];			// First copy, disassembled
+	double ns;				// Host time and cycles per round of the loop
+	double cycles;
+} opbMeasure;
+
+typedef struct{
+	uint32_t entry;			// Cycle table index (mode * 256 + opcode)
+	const char *text;
+	double cycles;			// Per instruction
+	double ns;
+} opbRow;
+
+const char *modeNames[STATS_MODES] = {"m16x16", "m16x8", "m8x16", "m8x8", "emu"};
+
+cpuState CPU;
+uint8_t memory[OPB_MEM];
+uint16_t emitPC;
+
+opbMeasure overhead[STATS_MODES];
+opbMeasure results[STATS_MODES][256];
+opbRow rows[STATS_MODES * 256];
+
+uint64_t cycleCount = 1000000;
+uint32_t repeat = 3;
+int32_t onlyOpcode = -1;
+int32_t onlyMode = -1;
+bool sortRows = false;
+double tolerance = 10.0;
+const char *baselinePath = NULL;
+
+bool parseOptions(int argc, char* argv[]);
+uint32_t buildLoop(uint8_t mode, int32_t opcode, char* text);
+void runLoop(uint32_t perRound, opbMeasure* M);
+int compareRows(const void* a, const void* b);
+uint32_t checkBaseline(const opbRow* R, uint32_t count);
+
+uint8_t opbReadIO(uint32_t addr);
+void opbWriteIO(uint32_t addr, uint8_t val);
+
+
+
+
+int main(int argc, char* argv[]){
+	const opbMeasure *M, *rti;
+	uint32_t perRound, count = 0;
+	
+	if (!parseOptions(argc, argv)) return -1;
+	
+	for (uint8_t mode = 0; mode < STATS_MODES; mode++){
+		if ((onlyMode >= 0) && (mode != onlyMode)) continue;
+		
+		perRound = buildLoop(mode, -1, NULL);
+		runLoop(perRound, &overhead[mode]);
+		
+		for (uint32_t opc = 0; opc < 256; opc++){
+			// RTI is always measured, BRK and COP need it
+			if ((onlyOpcode >= 0) && (opc != (uint32_t)onlyOpcode) && (opc != 0x40)) continue;
+			
+			perRound = buildLoop(mode, opc, results[mode][opc].text);
+			if (!perRound) continue;
+			runLoop(perRound, &results[mode][opc]);
+		}
+	}
+	
+	for (uint8_t mode = 0; mode < STATS_MODES; mode++){
+		for (uint32_t opc = 0; opc < 256; opc++){
+			if ((onlyOpcode >= 0) && (opc != (uint32_t)onlyOpcode)) continue;
+			
+			M = &results[mode][opc];
+			if (!M->valid) continue;
+			
+			rows[count].entry = mode * 256 + opc;
+			rows[count].text = M->text;
+			rows[count].cycles = (M->cycles - overhead[mode].cycles) / COPIES;
+			rows[count].ns = (M->ns - overhead[mode].ns) / COPIES;
+			
+			if ((opc == 0x00) || (opc == 0x02)){		// BRK/COP, without the RTI of the handler
+				rti = &results[mode][0x40];
+				rows[count].cycles -= (rti->cycles - overhead[mode].cycles) / COPIES;
+				rows[count].ns -= (rti->ns - overhead[mode].ns) / COPIES;
+			}
+			count++;
+		}
+	}
+	
+	if (sortRows) qsort(rows, count, sizeof(opbRow), compareRows);
+	
+	printf("entry,opcode,mode,cycles,ns_per_inst,ns_per_cycle,instruction\n");
+	for (uint32_t i = 0; i < count; i++){
+		printf("%u,0x%02X,%s,%.2f,%.3f,%.3f,\"%s\"\n", rows[i].entry, rows[i].entry & 0xFF, modeNames[rows[i].entry >> 8],
+			rows[i].cycles, rows[i].ns, (rows[i].cycles > 0) ? rows[i].ns / rows[i].cycles : 0.0, rows[i].text);
+	}
+	
+	if (baselinePath && checkBaseline(rows, count)) return 1;
+	return 0;
+}
+
+
+
+
+bool parseOptions(int argc, char* argv[]){
+	char *val;
+	
+	for (int i = 1; i < argc; i++){
+		val = strchr(argv[i], '=');
+		if (!val){
+			printf("Usage: %s [name=value ...]\n", argv[0]);
+			printf("Options: cycles=N repeat=N opcode=N mode=NAME sort=0|1 baseline=FILE tolerance=PERCENT\n");
+			return false;
+		}
+		val++;
+		
+		if (!strncmp(argv[i], "cycles=", 7)){			// Timed cycles per loop
+			cycleCount = strtoull(val, NULL, 0);
+		}else if (!strncmp(argv[i], "repeat=", 7)){		// Runs per loop, the fastest one counts
+			repeat = strtoul(val, NULL, 0);
+			if (!repeat) repeat = 1;
+		}else if (!strncmp(argv[i], "opcode=", 7)){		// Only measure a single opcode
+			onlyOpcode = strtoul(val, NULL, 0) & 0xFF;
+		}else if (!strncmp(argv[i], "mode=", 5)){		// Only measure a single mode (m16x16, m16x8, m8x16, m8x8, emu)
+			for (uint8_t m = 0; m < STATS_MODES; m++){
+				if (!strcmp(val, modeNames[m])) onlyMode = m;
+			}
+			if (onlyMode < 0){
+				printf("Unknown mode \"%s\"!\n", val);
+				return false;
+			}
+		}else if (!strncmp(argv[i], "sort=", 5)){		// Sort by the time per cycle, slowest first
+			sortRows = !!strtoul(val, NULL, 0);
+		}else if (!strncmp(argv[i], "baseline=", 9)){	// Compare against earlier results
+			baselinePath = val;
+		}else if (!strncmp(argv[i], "tolerance=", 10)){	// How much slower than the baseline is still ok (percent)
+			tolerance = strtod(val, NULL);
+		}else{
+			printf("Unknown Argument \"%s\"!\n", argv[i]);
+			return false;
+		}
+	}
+	
+	return true;
+}
+
+void static emit(uint8_t val){
+	memory[emitPC++] = val;
+}
+
+void static emit16(uint16_t val){
+	emit(val);
+	emit(val >> 8);
+}
+
+// Generates the loop for an opcode in a mode into a fresh memory image (opcode -1 = only the overhead)
+// Writes the disassembly of the first copy to text, returns the amount of instructions per round (0 = left out)
+uint32_t buildLoop(uint8_t mode, int32_t opcode, char* text){
+	bool ef = (mode == STATS_MODE_EMU);
+	bool mf = ef || (mode == STATS_MODE_M8X16) || (mode == STATS_MODE_M8X8);
+	bool xf = ef || (mode == STATS_MODE_M16X8) || (mode == STATS_MODE_M8X8);
+	uint8_t sr = (mf ? 0x20 : 0) | (xf ? 0x10 : 0) | 0x04 | (ef ? 0x01 : 0);		// I set, C = E so XCE doesn't switch
+	uint16_t frames = ef ? OPB_FRAMES_E : OPB_FRAMES_N;
+	uint8_t probe[4] = {opcode, 0, 0, 0};
+	uint16_t ptr, next, at;
+	uint32_t insts;
+	cpuDisInst I;
+	uint8_t len;
+	
+	if ((opcode == 0xDB) || (opcode == 0xCB) || (opcode == 0x44) || (opcode == 0x54)) return 0;	// STP, WAI, MVP, MVN
+	
+	memset(memory, 0, sizeof(memory));
+	memory[0xFFFC] = OPB_CODE & 0xFF;				// Reset
+	memory[0xFFFD] = OPB_CODE >> 8;
+	memory[0xFFE4] = memory[0xFFF4] = OPB_HANDLER & 0xFF;		// COP (Native, Emulation)
+	memory[0xFFE5] = memory[0xFFF5] = OPB_HANDLER >> 8;
+	memory[0xFFE6] = memory[0xFFFE] = OPB_HANDLER & 0xFF;		// BRK (Native), IRQ/BRK (Emulation)
+	memory[0xFFE7] = memory[0xFFFF] = OPB_HANDLER >> 8;
+	memory[OPB_HANDLER] = 0x40;						// RTI
+	memory[OPB_DP + 1] = OPB_DATA >> 8;				// Long pointer to the data
+	
+	// Prologue, the same for every opcode of a mode
+	emitPC = OPB_CODE;
+	emit(0x78);				// SEI
+	emit(0xB8);				// CLV
+	emit(0xD8);				// CLD
+	emit(0x18);				// CLC
+	emit(0xFB);				// XCE
+	emit(0xC2); emit(0x30);	// REP #$30
+	emit(0xA2); emit16(ef ? 0x01FF : frames - 1);	// LDX #SP (first, so PHK doesn't overwrite the frames)
+	emit(0x9A);				// TXS
+	emit(0xA9); emit16(0);	// LDA #$0000
+	emit(0x5B);				// TCD
+	emit(0x4B);				// PHK
+	emit(0xAB);				// PLB
+	if (ef){
+		emit(0x38);			// SEC
+		emit(0xFB);			// XCE
+	}else{
+		emit(0xE2); emit(sr & 0x30);	// SEP #mx
+		emit(0xEA);			// NOP
+	}
+	emit(0xA2); emit(0); if (!xf) emit(0);		// LDX #0
+	emit(0xA0); emit(0); if (!xf) emit(0);		// LDY #0
+	emit(0xA9); emit(0); if (!mf) emit(0);		// LDA #0
+	emit(ef ? 0x38 : 0x18);						// SEC/CLC
+	insts = 18;
+	
+	cpuDisDecodeBytes(probe, 0, mf, xf, &I);		// Only for the addressing mode
+	
+	for (uint32_t i = 0; (opcode >= 0) && (i < COPIES); i++){
+		at = emitPC;
+		len = cpuDisLength(opcode, mf, xf);
+		next = at + len;
+		ptr = OPB_POINTERS + i * 4;
+		
+		emit(opcode);
+		switch(I.mode){
+			case DIS_DP: case DIS_DPX: case DIS_DPY: case DIS_DPI: case DIS_DPIX: case DIS_DPIY: case DIS_DPIL: case DIS_DPILY:
+				emit(OPB_DP);
+			break;
+			
+			case DIS_ABS: case DIS_ABSX: case DIS_ABSY:
+				emit16(((opcode == 0x4C) || (opcode == 0x20)) ? next : OPB_DATA);		// JMP and JSR go to the next copy
+			break;
+			
+			case DIS_LONG: case DIS_LONGX:
+				emit16(((opcode == 0x5C) || (opcode == 0x22)) ? next : OPB_DATA);		// JML and JSL too, in Bank 0
+				emit(0);
+			break;
+			
+			case DIS_ABSI: case DIS_ABSIX:		// X is 0, so the same pointer works for both
+				emit16(ptr);
+				memory[ptr] = next & 0xFF;
+				memory[ptr + 1] = next >> 8;
+			break;
+			
+			case DIS_SR: case DIS_SRIY:
+				emit(1);
+			break;
+			
+			default:		// Immediates, REP/SEP and branches are 0, so they don't change anything
+				for (uint32_t b = 1; b < len; b++) emit(0);
+			break;
+		}
+		
+		// Stack frames for the pulls, SP starts right below them
+		switch(opcode){
+			case 0x60:		// RTS
+				memory[frames + i * 2] = (next - 1) & 0xFF;
+				memory[frames + i * 2 + 1] = (next - 1) >> 8;
+			break;
+			
+			case 0x6B:		// RTL, in Emulation mode the first one pulls from $0200 and the SP wraps back to Page 1 after it
+				for (uint32_t b = 0; b <= (ef ? 0x0100U : 0); b += 0x0100){
+					memory[frames + b + i * 3] = (next - 1) & 0xFF;
+					memory[frames + b + i * 3 + 1] = (next - 1) >> 8;
+				}
+			break;
+			
+			case 0x40:		// RTI
+				memory[frames + i * (ef ? 3 : 4)] = sr;
+				memory[frames + i * (ef ? 3 : 4) + 1] = next & 0xFF;
+				memory[frames + i * (ef ? 3 : 4) + 2] = next >> 8;
+			break;
+			
+			case 0x28:		// PLP
+				memory[frames + i] = sr;
+			break;
+		}
+		
+		if (!i && text){
+			cpuDisDecode(memory, OPB_MEM, at, mf, xf, &I);
+			cpuDisFormat(&I, text, 32);
+		}
+		insts += ((opcode == 0x00) || (opcode == 0x02)) ? 2 : 1;	// BRK/COP also execute the RTI
+	}
+	
+	emit(0x4C); emit16(OPB_CODE);		// JMP loop
+	return insts + 1;
+}
+
+// Runs the loop in memory "repeat" times, the fastest run ends up in M as time and cycles per round
+void runLoop(uint32_t perRound, opbMeasure* M){
+	cpuRunCtl RUN;
+	uint64_t t0, cyc0, left, used, insts;
+	double rounds;
+	
+	cpuInit(&CPU, memory, OPB_MEM, OPB_IO, 256, opbReadIO, opbWriteIO);
+	
+	for (uint32_t r = 0; r <= repeat; r++){
+		left = r ? cycleCount : WARMUP;		// The first round only warms up the caches and branch predictors
+		cyc0 = CPU.cycle_count;
+		insts = 0;
+		t0 = cpuNowNs();
+		
+		while (left && !CPU.stp){
+			RUN = (cpuRunCtl){.cycles = (left < OPB_SLICE) ? (int32_t)left : OPB_SLICE};
+			cpuRun(&CPU, &RUN);
+			insts += RUN.executed;
+			used = RUN.cycles - RUN.cycle_rem;
+			left = (used >= left) ? 0 : left - used;
+		}
+		
+		t0 = cpuNowNs() - t0;
+		rounds = (double)insts / perRound;
+		if (r && (!M->valid || ((t0 / rounds) < M->ns))){
+			M->valid = true;
+			M->ns = t0 / rounds;
+			M->cycles = (CPU.cycle_count - cyc0) / rounds;
+		}
+	}
+}
+
+// Slowest time per cycle first
+int compareRows(const void* a, const void* b){
+	const opbRow *rowA = a, *rowB = b;
+	double ra = (rowA->cycles > 0) ? rowA->ns / rowA->cycles : 0.0;
+	double rb = (rowB->cycles > 0) ? rowB->ns / rowB->cycles : 0.0;
+	
+	return (ra < rb) - (ra > rb);
+}
+
+// Compares the host time per instruction against a saved output, entries that aren't in it are skipped
+// Returns the amount of regressions
+uint32_t checkBaseline(const opbRow* R, uint32_t count){
+	FILE *fp = fopen(baselinePath, "r");
+	char line[256];
+	uint32_t entry, regressions = 0;
+	double base;
+	
+	if (!fp){
+		printf("Couldn't read the baseline \"%s\"!\n", baselinePath);
+		return 1;
+	}
+	
+	while (fgets(line, sizeof(line), fp)){
+		// entry,opcode,mode,cycles,ns_per_inst,...
+		if (sscanf(line, "%u,%*[^,],%*[^,],%*[^,],%lf", &entry, &base) != 2) continue;
+		
+		for (uint32_t i = 0; i < count; i++){
+			if (R[i].entry != entry) continue;
+			
+			// Tiny times are mostly noise, a tenth of a nanosecond more is never a regression
+			if ((R[i].ns > (base * (1.0 + tolerance / 100.0))) && ((R[i].ns - base) > 0.1)){
+				fprintf(stderr, "REGRESSION %s (%s): %.3f ns/inst, baseline %.3f ns/inst (%+.1f%%)\n", R[i].text,
+					modeNames[entry >> 8], R[i].ns, base, (R[i].ns / base - 1.0) * 100.0);
+				regressions++;
+			}
+		}
+	}
+	
+	fclose(fp);
+	return regressions;
+}
+
+
+
+
+uint8_t opbReadIO(uint32_t addr){
+	return 0;
+}
+
+void opbWriteIO(uint32_t addr, uint8_t val){
+}
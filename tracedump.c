@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define __EMU_LITTLE_ENDIAN
+#ifndef __EMU_TRACE
+#define __EMU_TRACE
+#endif
+
+#include "emu65816.h"
+
+
+
+// Trace Decoder, prints a trace file written by cpuTraceStart as the same kind of text DBG prints while running
+// (the instructions are decoded by the disassembler, so link it with the library: gcc tracedump.c -l:emu65816.a)
+// The records only hold the state from before each instruction, so the parts of the DBG output that depend on
+// memory contents (the "Target"/"Value" of loads, stores and returns) are replaced by the registers, which show
+// the result of an instruction in the line after it. Branches are decoded completely, including if they're taken.
+
+// Flag a conditional branch tests (bit of the Status Register) and the value it branches on, by opcode >> 6
+const uint8_t branchFlag[4] = {0x80, 0x40, 0x01, 0x02};		// N, V, C, Z
+
+uint64_t firstCycle = 0;
+uint64_t maxCount = UINT64_MAX;
+bool showRegs = true;
+
+bool parseOptions(int argc, char* argv[]);
+void printInst(const cpuTraceRec* R);
+
+
+
+
+int main(int argc, char* argv[]){
+	FILE *fp;
+	cpuTraceRec R;
+	uint32_t magic;
+	uint16_t hdr[2];
+	uint64_t count = 0;
+	
+	if (argc < 2){
+		printf("Usage: %s trace.bin [name=value ...]\n", argv[0]);
+		printf("Options: from=CYCLE count=N regs=0|1\n");
+		return -1;
+	}
+	
+	if (!parseOptions(argc, argv)) return -1;
+	
+	fp = fopen(argv[1], "rb");
+	if (!fp){
+		printf("Couldn't open \"%s\"!\n", argv[1]);
+		return -1;
+	}
+	
+	if ((fread(&magic, sizeof(magic), 1, fp) != 1) || (fread(hdr, sizeof(hdr), 1, fp) != 1) || (magic != TRACE_MAGIC)){
+		printf("\"%s\" isn't a trace file!\n", argv[1]);
+		return -1;
+	}
+	if ((hdr[0] != TRACE_VERSION) || (hdr[1] != sizeof(cpuTraceRec))){
+		printf("Unsupported trace version %u (record size %u)!\n", hdr[0], hdr[1]);
+		return -1;
+	}
+	
+	while ((count < maxCount) && (fread(&R, sizeof(R), 1, fp) == 1)){
+		if (R.cycle < firstCycle) continue;
+		printInst(&R);
+		count++;
+	}
+	
+	fclose(fp);
+	return 0;
+}
+
+
+
+
+bool parseOptions(int argc, char* argv[]){
+	char *val;
+	
+	for (int i = 2; i < argc; i++){
+		val = strchr(argv[i], '=');
+		if (!val) continue;
+		val++;
+		
+		if (!strncmp(argv[i], "from=", 5)){				// Skip everything before this cycle
+			firstCycle = strtoull(val, NULL, 0);
+		}else if (!strncmp(argv[i], "count=", 6)){		// Amount of instructions to print
+			maxCount = strtoull(val, NULL, 0);
+		}else if (!strncmp(argv[i], "regs=", 5)){		// Print the registers after every instruction
+			showRegs = !!strtoul(val, NULL, 0);
+		}else{
+			printf("Unknown Argument \"%s\"!\n", argv[i]);
+			return false;
+		}
+	}
+	
+	return true;
+}
+
+// Prints a single record the same way the DBG output starts it, followed by the instruction
+void printInst(const cpuTraceRec* R){
+	cpuDisInst I;
+	uint8_t bytes[4] = {R->opcode, R->operand[0], R->operand[1], R->operand[2]};
+	char text[32];
+	
+	cpuDisDecodeBytes(bytes, R->pc, R->e || (R->sr & 0x20), R->e || (R->sr & 0x10), &I);
+	printf("Executing Instruction (0x%02X at 0x%02X%04X): ", R->opcode, R->pc >> 16, R->pc & 0x0000FFFF);
+	
+	// Branches show their target and whether they're taken like DBG does, everything else is plain disassembly
+	if (I.mode == DIS_REL){
+		printf("%s (Target: $%06X", I.name, I.target);
+		if (R->opcode == 0x80){		// BRA
+			printf(")");
+		}else{
+			printf(", %s)", (!!(R->sr & branchFlag[R->opcode >> 6]) == !!(R->opcode & 0x20)) ? "Taken" : "Not Taken");
+		}
+	}else if (I.mode == DIS_RELL){
+		printf("%s (Target: $%06X)", I.name, I.target);
+	}else{
+		cpuDisFormat(&I, text, sizeof(text));
+		printf("%s", text);
+	}
+	
+	// Calls get the same separator line as in the DBG output
+	if (R->opcode == 0x20) printf(" ------------------------------------------------");
+	if (R->opcode == 0x22) printf(" ----------------------------------------------");
+	
+	printf(" (Cycle: %llu)\n", (unsigned long long)R->cycle);
+	
+	if (showRegs){
+		printf("\tA: $%04X X: $%04X Y: $%04X SP: $%04X DP: $%04X DB: $%02X P: %c%c%c%c%c%c%c%c%s\n",
+			R->a, R->x, R->y, R->sp, R->dp, R->db,
+			(R->sr & 0x80) ? 'N' : 'n', (R->sr & 0x40) ? 'V' : 'v', (R->sr & 0x20) ? 'M' : 'm', (R->sr & 0x10) ? 'X' : 'x',
+			(R->sr & 0x08) ? 'D' : 'd', (R->sr & 0x04) ? 'I' : 'i', (R->sr & 0x02) ? 'Z' : 'z', (R->sr & 0x01) ? 'C' : 'c',
+			R->e ? " E" : "");
+	}
+}